@@ -2,48 +2,425 @@
 // Created by matt on 5/28/16.
 //
 
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include "Simulation.h"
+#include "WorkerPool.h"
 #include "log.h"
 
-Simulation::Simulation() {
-    LOGI("Simulation()");
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1
+#endif
+
+//Fused multiply-adds round differently, keep them out so every platform produces the same bits. GCC ignores the
+//pragma so the builds also compile this file with -ffp-contract=off.
+#ifdef __clang__
+#pragma STDC FP_CONTRACT OFF
+#endif
+
+//Arrays are padded to a multiple of the widest vector and aligned for it.
+#define SIMULATION_PADDING 8
+#define SIMULATION_ALIGNMENT 32
+//Boxes per worker pool chunk, a multiple of the padding so every chunk is whole vectors.
+#define SIMULATION_CHUNK 8192
+
+//Random samples used by each box: the colour and depth at creation then four per reset.
+#define SAMPLE_COLOUR 0
+#define SAMPLE_DEPTH 3
+#define SAMPLE_RESET 4
+#define SAMPLES_PER_RESET 4
+
+//The boxes are 2x2x2 cubes (see models.h), this is the radius of the sphere around one.
+#define BOX_BOUNDING_RADIUS 1.7320508f
+
+static float *allocateArray(int count)
+{
+    void *array = NULL;
+    if (posix_memalign(&array, SIMULATION_ALIGNMENT, sizeof(float)*count) != 0)
+        return NULL;
+    memset(array, 0, sizeof(float)*count);
+    return (float*)array;
+}
+
+//Integer hash with good avalanche (lowbias32 by Chris Wellons).
+static inline uint32_t hash32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+//Counter based generator: every (seed, box, sample) gives an independent value in [0, 1),
+//so boxes can be updated in any order on any thread and runs repeat exactly from the seed.
+static inline float randomFloat(uint32_t seedHash, uint32_t box, uint32_t sample)
+{
+    uint32_t h = hash32(box ^ hash32(sample ^ seedHash));
+    return (float)(h >> 8) * (1.0f / 16777216.0f);
+}
+
+//Gives the lanes set in mask a new random position and velocity.
+void Simulation::randomResetLanes(int mask, int first, float *x, float *y, float *vx, float *vy)
+{
+    for (int lane = 0; lane < SIMD_WIDTH; lane++)
+    {
+        if (!(mask & (1 << lane)))
+            continue;
+        int box = first+lane;
+        uint32_t sample = SAMPLE_RESET + resetCounts[box]*SAMPLES_PER_RESET;
+        resetCounts[box]++;
+        x[lane]=randomFloat(seedHash, box, sample) * 40.0f - 20.0f;
+        y[lane]=randomFloat(seedHash, box, sample+1) * 30.0f - 15.0f;
+        vx[lane]=randomFloat(seedHash, box, sample+2) / 8.0f -(1.0f/16.0f);
+        vy[lane]=randomFloat(seedHash, box, sample+3) / 8.0f -(1.0f/16.0f);
+    }
+}
+
+Simulation::Simulation(int capacity, uint32_t seed, WorkerPool *workerPool) {
+    LOGI("Simulation(%d, seed %u)", capacity, seed);
+    this->capacity=capacity;
+    this->workerPool=workerPool;
+    seedHash=hash32(seed);
     paused=false;
-    for (int i = 0; i < MAX_BOXES*3; i++)
-        colours[i] = (float) rand() / (float) (RAND_MAX);
-    float identityMatrix[16]={1,0,0,0,0,1,0,0,0,0,1,0,0,0,0,1};
-    for(int i=0; i<MAX_BOXES; i++)
-        memcpy(transforms+(i*16), identityMatrix, sizeof(float)*16);
-    for (int i = 0; i < MAX_BOXES; i++) {
-        transforms[i * 16 + 12] = 200;
-        transforms[i * 16 + 13] = 200;
-        transforms[i * 16 + 14] = (float)rand()/(float)(RAND_MAX) * 20.0f - 40.0f;
+    int paddedCapacity = (capacity + SIMULATION_PADDING - 1) / SIMULATION_PADDING * SIMULATION_PADDING;
+    posX = allocateArray(paddedCapacity);
+    posY = allocateArray(paddedCapacity);
+    posZ = allocateArray(paddedCapacity);
+    velX = allocateArray(paddedCapacity);
+    velY = allocateArray(paddedCapacity);
+    resetCounts = new uint32_t[paddedCapacity]();
+    visible = new int[paddedCapacity];
+    visibleCount = 0;
+    chunkVisibleCounts = new int[(capacity + SIMULATION_CHUNK - 1) / SIMULATION_CHUNK];
+    colours = new float[capacity*3];
+    for (int i = 0; i < capacity; i++)
+        for (int c = 0; c < 3; c++)
+            colours[i*3+c] = randomFloat(seedHash, i, SAMPLE_COLOUR+c);
+    //Boxes start outside the bounds so their first step gives them a random position and velocity.
+    for (int i = 0; i < paddedCapacity; i++) {
+        posX[i] = 200;
+        posY[i] = 200;
+        posZ[i] = randomFloat(seedHash, i, SAMPLE_DEPTH) * 20.0f - 40.0f;
     }
 }
 
-void Simulation::step() {
+Simulation::~Simulation() {
+    free(posX);
+    free(posY);
+    free(posZ);
+    free(velX);
+    free(velY);
+    delete[] resetCounts;
+    delete[] visible;
+    delete[] chunkVisibleCounts;
+    delete[] colours;
+}
+
+//Only the first count boxes (rounded up to whole vectors) are moved, the rest keep their start position until they are used.
+//Each box draws its random numbers from its own stream so the chunks can run on any thread in any order.
+void Simulation::step(int count) {
     if (paused)
         return;
-    for(int i=0; i<MAX_BOXES; i++)
+    int end = (count + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+    std::function<void(int, int, int)> integrateChunk = [this](int begin, int end, int worker) {
+        integrate(begin, end);
+    };
+    if (workerPool)
+        workerPool->parallelFor(end, SIMULATION_CHUNK, integrateChunk);
+    else
+        integrate(0, end);
+}
+
+//Moves the boxes in [begin, end) by their velocity, boxes outside the bounds are blended with a fresh random start first.
+void Simulation::integrate(int begin, int end) {
+#if defined(__AVX__)
+    const __m256 minX = _mm256_set1_ps(-30), maxX = _mm256_set1_ps(30);
+    const __m256 minY = _mm256_set1_ps(-20), maxY = _mm256_set1_ps(20);
+    for (int i = begin; i < end; i += SIMD_WIDTH)
     {
-        if (transforms[i * 16 + 12] < -30 || transforms[i * 16 + 12] > 30 || transforms[i * 16 + 13] < -20 || transforms[i * 16 + 13] > 20)
+        __m256 x = _mm256_load_ps(posX+i);
+        __m256 y = _mm256_load_ps(posY+i);
+        __m256 vx = _mm256_load_ps(velX+i);
+        __m256 vy = _mm256_load_ps(velY+i);
+        __m256 out = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(x, minX, _CMP_LT_OQ), _mm256_cmp_ps(x, maxX, _CMP_GT_OQ)),
+                                  _mm256_or_ps(_mm256_cmp_ps(y, minY, _CMP_LT_OQ), _mm256_cmp_ps(y, maxY, _CMP_GT_OQ)));
+        int mask = _mm256_movemask_ps(out);
+        if (mask)
+        {
+            float resetX[SIMD_WIDTH] __attribute__((aligned(32))), resetY[SIMD_WIDTH] __attribute__((aligned(32)));
+            float resetVX[SIMD_WIDTH] __attribute__((aligned(32))), resetVY[SIMD_WIDTH] __attribute__((aligned(32)));
+            randomResetLanes(mask, i, resetX, resetY, resetVX, resetVY);
+            x = _mm256_blendv_ps(x, _mm256_load_ps(resetX), out);
+            y = _mm256_blendv_ps(y, _mm256_load_ps(resetY), out);
+            vx = _mm256_blendv_ps(vx, _mm256_load_ps(resetVX), out);
+            vy = _mm256_blendv_ps(vy, _mm256_load_ps(resetVY), out);
+            _mm256_store_ps(velX+i, vx);
+            _mm256_store_ps(velY+i, vy);
+        }
+        _mm256_store_ps(posX+i, _mm256_add_ps(x, vx));
+        _mm256_store_ps(posY+i, _mm256_add_ps(y, vy));
+    }
+#elif defined(__SSE2__)
+    const __m128 minX = _mm_set1_ps(-30), maxX = _mm_set1_ps(30);
+    const __m128 minY = _mm_set1_ps(-20), maxY = _mm_set1_ps(20);
+    for (int i = begin; i < end; i += SIMD_WIDTH)
+    {
+        __m128 x = _mm_load_ps(posX+i);
+        __m128 y = _mm_load_ps(posY+i);
+        __m128 vx = _mm_load_ps(velX+i);
+        __m128 vy = _mm_load_ps(velY+i);
+        __m128 out = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(x, minX), _mm_cmpgt_ps(x, maxX)),
+                               _mm_or_ps(_mm_cmplt_ps(y, minY), _mm_cmpgt_ps(y, maxY)));
+        int mask = _mm_movemask_ps(out);
+        if (mask)
+        {
+            //SSE2 has no blendv so select with and/andnot/or.
+            float resetX[SIMD_WIDTH] __attribute__((aligned(16))), resetY[SIMD_WIDTH] __attribute__((aligned(16)));
+            float resetVX[SIMD_WIDTH] __attribute__((aligned(16))), resetVY[SIMD_WIDTH] __attribute__((aligned(16)));
+            randomResetLanes(mask, i, resetX, resetY, resetVX, resetVY);
+            x = _mm_or_ps(_mm_and_ps(out, _mm_load_ps(resetX)), _mm_andnot_ps(out, x));
+            y = _mm_or_ps(_mm_and_ps(out, _mm_load_ps(resetY)), _mm_andnot_ps(out, y));
+            vx = _mm_or_ps(_mm_and_ps(out, _mm_load_ps(resetVX)), _mm_andnot_ps(out, vx));
+            vy = _mm_or_ps(_mm_and_ps(out, _mm_load_ps(resetVY)), _mm_andnot_ps(out, vy));
+            _mm_store_ps(velX+i, vx);
+            _mm_store_ps(velY+i, vy);
+        }
+        _mm_store_ps(posX+i, _mm_add_ps(x, vx));
+        _mm_store_ps(posY+i, _mm_add_ps(y, vy));
+    }
+#elif SIMD_WIDTH == 4
+    const float32x4_t minX = vdupq_n_f32(-30), maxX = vdupq_n_f32(30);
+    const float32x4_t minY = vdupq_n_f32(-20), maxY = vdupq_n_f32(20);
+    const uint32x4_t laneBits = {1, 2, 4, 8};
+    for (int i = begin; i < end; i += SIMD_WIDTH)
+    {
+        float32x4_t x = vld1q_f32(posX+i);
+        float32x4_t y = vld1q_f32(posY+i);
+        float32x4_t vx = vld1q_f32(velX+i);
+        float32x4_t vy = vld1q_f32(velY+i);
+        uint32x4_t out = vorrq_u32(vorrq_u32(vcltq_f32(x, minX), vcgtq_f32(x, maxX)),
+                                   vorrq_u32(vcltq_f32(y, minY), vcgtq_f32(y, maxY)));
+        //NEON has no movemask, or together one distinct bit per lane instead.
+        uint32x4_t bits = vandq_u32(out, laneBits);
+        uint32x2_t pairs = vorr_u32(vget_low_u32(bits), vget_high_u32(bits));
+        int mask = vget_lane_u32(pairs, 0) | vget_lane_u32(pairs, 1);
+        if (mask)
+        {
+            float resetX[SIMD_WIDTH], resetY[SIMD_WIDTH], resetVX[SIMD_WIDTH], resetVY[SIMD_WIDTH];
+            randomResetLanes(mask, i, resetX, resetY, resetVX, resetVY);
+            x = vbslq_f32(out, vld1q_f32(resetX), x);
+            y = vbslq_f32(out, vld1q_f32(resetY), y);
+            vx = vbslq_f32(out, vld1q_f32(resetVX), vx);
+            vy = vbslq_f32(out, vld1q_f32(resetVY), vy);
+            vst1q_f32(velX+i, vx);
+            vst1q_f32(velY+i, vy);
+        }
+        vst1q_f32(posX+i, vaddq_f32(x, vx));
+        vst1q_f32(posY+i, vaddq_f32(y, vy));
+    }
+#else
+    for(int i=begin; i<end; i++)
+    {
+        if (posX[i] < -30 || posX[i] > 30 || posY[i] < -20 || posY[i] > 20)
+            randomResetLanes(1, i, posX+i, posY+i, velX+i, velY+i);
+        posX[i]+=velX[i];
+        posY[i]+=velY[i];
+    }
+#endif
+}
+
+//Each chunk writes its own matrices so the chunks can go to different threads.
+//With indices (such as the visible list) matrix i is written for box indices[i] rather than box i.
+void Simulation::write(uint8_t *buffer, int offset, int count, const int *indices) {
+    std::function<void(int, int, int)> writeChunk = [=](int begin, int end, int worker) {
+        for (int i=begin; i<end; i++)
         {
-            transforms[i*16+12]=(float)rand()/(float)(RAND_MAX) * 40.0f - 20.0f;
-            transforms[i*16+13]=(float)rand()/(float)(RAND_MAX) * 30.0f - 15.0f;
-            velocities[i*2]=(float)rand()/(float)(RAND_MAX) / 8.0f -(1.0/16.0f);
-            velocities[i*2+1]=(float)rand()/(float)(RAND_MAX) / 8.0f -(1.0f/16.0f);
-//            LOGI("Reset cube %d (%f, %f, %f)", i, transforms[i*16+12], transforms[i*16+13], transforms[i*16+14]);
+            int box = indices ? indices[i] : i;
+            float *matrix = (float*)(buffer + offset*i);
+            matrix[0] = 1; matrix[1] = 0; matrix[2] = 0; matrix[3] = 0;
+            matrix[4] = 0; matrix[5] = 1; matrix[6] = 0; matrix[7] = 0;
+            matrix[8] = 0; matrix[9] = 0; matrix[10] = 1; matrix[11] = 0;
+            matrix[12] = posX[box]; matrix[13] = posY[box]; matrix[14] = posZ[box]; matrix[15] = 1;
         }
-        transforms[i*16+12]+=velocities[i*2];
-        transforms[i*16+13]+=velocities[i*2+1];
+    };
+    if (workerPool)
+        workerPool->parallelFor(count, SIMULATION_CHUNK, writeChunk);
+    else
+        writeChunk(0, count, 0);
+}
+
+//Finds which of the first count boxes are at least partly inside the frustum of projection (column major, as
+//written by perspective_matrix). The boxes have no rotation or view transform so only their bounding spheres
+//at posX/Y/Z need testing. Each chunk lists its boxes at the start of its own range of visible, then the lists
+//are moved together so the boxes stay in ascending order.
+int Simulation::cull(const float *projection, int count) {
+    //The planes are the sums and differences of the projection's last row with the others, normalised so the
+    //distance to them can be compared with the radius.
+    float planes[6][4];
+    for (int plane = 0; plane < 6; plane++) {
+        int row = plane/2;
+        float sign = (plane & 1) ? -1.0f : 1.0f;
+        for (int column = 0; column < 4; column++)
+            planes[plane][column] = projection[column*4+3] + sign*projection[column*4+row];
+        float length = sqrtf(planes[plane][0]*planes[plane][0] + planes[plane][1]*planes[plane][1] + planes[plane][2]*planes[plane][2]);
+        for (int column = 0; column < 4; column++)
+            planes[plane][column] /= length;
+    }
+    std::function<void(int, int, int)> cullTask = [&](int begin, int end, int worker) {
+        chunkVisibleCounts[begin/SIMULATION_CHUNK] = cullChunk(planes, begin, end);
+    };
+    if (workerPool)
+        workerPool->parallelFor(count, SIMULATION_CHUNK, cullTask);
+    else
+        for (int begin = 0; begin < count; begin += SIMULATION_CHUNK)
+            cullTask(begin, (begin+SIMULATION_CHUNK < count) ? begin+SIMULATION_CHUNK : count, 0);
+    visibleCount = 0;
+    for (int begin = 0; begin < count; begin += SIMULATION_CHUNK) {
+        int chunkCount = chunkVisibleCounts[begin/SIMULATION_CHUNK];
+        if (begin != visibleCount)
+            memmove(visible+visibleCount, visible+begin, sizeof(int)*chunkCount);
+        visibleCount += chunkCount;
+    }
+    return visibleCount;
+}
+
+//Appends the boxes of the lanes set in mask without branching, lanes past end in the last vector are dropped.
+static inline int appendLanes(int mask, int first, int end, int *list)
+{
+    int found = 0;
+    for (int lane = 0; lane < SIMD_WIDTH; lane++)
+    {
+        list[found] = first+lane;
+        found += ((mask >> lane) & 1) & (first+lane < end);
+    }
+    return found;
+}
+
+//Lists the boxes in [begin, end) whose bounding sphere isn't wholly behind any of the planes at visible+begin.
+//The last vector may run past end into the padding.
+int Simulation::cullChunk(const float (*planes)[4], int begin, int end) {
+    int *list = visible+begin;
+    int found = 0;
+#if defined(__AVX__)
+    __m256 planeX[6], planeY[6], planeZ[6], planeW[6];
+    for (int plane = 0; plane < 6; plane++)
+    {
+        planeX[plane] = _mm256_set1_ps(planes[plane][0]);
+        planeY[plane] = _mm256_set1_ps(planes[plane][1]);
+        planeZ[plane] = _mm256_set1_ps(planes[plane][2]);
+        planeW[plane] = _mm256_set1_ps(planes[plane][3]);
+    }
+    const __m256 minDistance = _mm256_set1_ps(-BOX_BOUNDING_RADIUS);
+    for (int i = begin; i < end; i += SIMD_WIDTH)
+    {
+        __m256 x = _mm256_load_ps(posX+i);
+        __m256 y = _mm256_load_ps(posY+i);
+        __m256 z = _mm256_load_ps(posZ+i);
+        __m256 inside = _mm256_cmp_ps(minDistance, minDistance, _CMP_EQ_OQ);
+        for (int plane = 0; plane < 6; plane++)
+        {
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, planeX[plane]), _mm256_mul_ps(y, planeY[plane])),
+                                            _mm256_add_ps(_mm256_mul_ps(z, planeZ[plane]), planeW[plane]));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, minDistance, _CMP_GE_OQ));
+        }
+        found += appendLanes(_mm256_movemask_ps(inside), i, end, list+found);
+    }
+#elif defined(__SSE2__)
+    __m128 planeX[6], planeY[6], planeZ[6], planeW[6];
+    for (int plane = 0; plane < 6; plane++)
+    {
+        planeX[plane] = _mm_set1_ps(planes[plane][0]);
+        planeY[plane] = _mm_set1_ps(planes[plane][1]);
+        planeZ[plane] = _mm_set1_ps(planes[plane][2]);
+        planeW[plane] = _mm_set1_ps(planes[plane][3]);
+    }
+    const __m128 minDistance = _mm_set1_ps(-BOX_BOUNDING_RADIUS);
+    for (int i = begin; i < end; i += SIMD_WIDTH)
+    {
+        __m128 x = _mm_load_ps(posX+i);
+        __m128 y = _mm_load_ps(posY+i);
+        __m128 z = _mm_load_ps(posZ+i);
+        __m128 inside = _mm_cmpeq_ps(minDistance, minDistance);
+        for (int plane = 0; plane < 6; plane++)
+        {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, planeX[plane]), _mm_mul_ps(y, planeY[plane])),
+                                         _mm_add_ps(_mm_mul_ps(z, planeZ[plane]), planeW[plane]));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, minDistance));
+        }
+        found += appendLanes(_mm_movemask_ps(inside), i, end, list+found);
+    }
+#elif SIMD_WIDTH == 4
+    float32x4_t planeX[6], planeY[6], planeZ[6], planeW[6];
+    for (int plane = 0; plane < 6; plane++)
+    {
+        planeX[plane] = vdupq_n_f32(planes[plane][0]);
+        planeY[plane] = vdupq_n_f32(planes[plane][1]);
+        planeZ[plane] = vdupq_n_f32(planes[plane][2]);
+        planeW[plane] = vdupq_n_f32(planes[plane][3]);
+    }
+    const float32x4_t minDistance = vdupq_n_f32(-BOX_BOUNDING_RADIUS);
+    const uint32x4_t laneBits = {1, 2, 4, 8};
+    for (int i = begin; i < end; i += SIMD_WIDTH)
+    {
+        float32x4_t x = vld1q_f32(posX+i);
+        float32x4_t y = vld1q_f32(posY+i);
+        float32x4_t z = vld1q_f32(posZ+i);
+        uint32x4_t inside = vdupq_n_u32(0xffffffff);
+        for (int plane = 0; plane < 6; plane++)
+        {
+            //Separate multiplies and adds rather than vmlaq so the results match the other paths.
+            float32x4_t distance = vaddq_f32(vaddq_f32(vmulq_f32(x, planeX[plane]), vmulq_f32(y, planeY[plane])),
+                                             vaddq_f32(vmulq_f32(z, planeZ[plane]), planeW[plane]));
+            inside = vandq_u32(inside, vcgeq_f32(distance, minDistance));
+        }
+        uint32x4_t bits = vandq_u32(inside, laneBits);
+        uint32x2_t pairs = vorr_u32(vget_low_u32(bits), vget_high_u32(bits));
+        found += appendLanes(vget_lane_u32(pairs, 0) | vget_lane_u32(pairs, 1), i, end, list+found);
+    }
+#else
+    for (int i = begin; i < end; i++)
+    {
+        int mask = 1;
+        for (int plane = 0; plane < 6; plane++)
+            if (posX[i]*planes[plane][0] + posY[i]*planes[plane][1] + posZ[i]*planes[plane][2] + planes[plane][3] < -BOX_BOUNDING_RADIUS)
+                mask = 0;
+        found += appendLanes(mask, i, end, list+found);
+    }
+#endif
+    return found;
+}
+
+//Packs the box state for the GPU simulation, 32 bytes per box: x, y, z, 0, vx, vy, reset count, 0.
+void Simulation::writeState(uint8_t *buffer, int count) {
+    for (int i=0; i<count; i++)
+    {
+        float *state = (float*)(buffer + sizeof(float)*8*i);
+        state[0] = posX[i]; state[1] = posY[i]; state[2] = posZ[i]; state[3] = 0;
+        state[4] = velX[i]; state[5] = velY[i];
+        memcpy(&state[6], &resetCounts[i], sizeof(uint32_t));
+        state[7] = 0;
     }
 }
 
-void Simulation::write(uint8_t *buffer, int offset) {
-    for (int i=0; i<MAX_BOXES; i++)
+//Loads state packed by writeState, used to continue from the GPU simulation.
+void Simulation::readState(const uint8_t *buffer, int count) {
+    for (int i=0; i<count; i++)
     {
-        uint8_t *matrix = buffer + offset*i;
-        memcpy(matrix, &transforms[i*16], sizeof(float)*16);
+        const float *state = (const float*)(buffer + sizeof(float)*8*i);
+        posX[i] = state[0]; posY[i] = state[1]; posZ[i] = state[2];
+        velX[i] = state[4]; velY[i] = state[5];
+        memcpy(&resetCounts[i], &state[6], sizeof(uint32_t));
     }
 }
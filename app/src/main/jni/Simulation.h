@@ -6,19 +6,42 @@
 #define VULKAN_DEPTHPEEL_SIMULATION_H
 
 #include <stdint.h>
+#include <stddef.h>
 
-#define MAX_BOXES 500
+class WorkerPool;
 
 class Simulation {
 public:
-    Simulation();
-    void step();
-    void write(uint8_t *buffer, int offset);
-//    float positions[100*3];
-    float velocities[MAX_BOXES*2];
-    float transforms[MAX_BOXES*16];
-    float colours[MAX_BOXES*3];
+    Simulation(int capacity, uint32_t seed, WorkerPool *workerPool = NULL);
+    ~Simulation();
+    void step(int count);
+    void write(uint8_t *buffer, int offset, int count, const int *indices = NULL);
+    int cull(const float *projection, int count);
+    void writeState(uint8_t *buffer, int count);
+    void readState(const uint8_t *buffer, int count);
+    int capacity;
+    //The box state is stored as a structure of arrays so step only touches what it uses.
+    //Each array is aligned and padded to a whole number of SIMD vectors.
+    float *posX;
+    float *posY;
+    float *posZ;
+    float *velX;
+    float *velY;
+    float *colours;
     bool paused;
+    //The boxes found inside the frustum by the last cull in ascending order, visibleCount of them.
+    int *visible;
+    int visibleCount;
+private:
+    void integrate(int begin, int end);
+    void randomResetLanes(int mask, int first, float *x, float *y, float *vx, float *vy);
+    int cullChunk(const float (*planes)[4], int begin, int end);
+    WorkerPool *workerPool;
+    uint32_t seedHash;
+    //How many times each box has been reset, this picks the next random numbers from the box's stream.
+    uint32_t *resetCounts;
+    //How many boxes each chunk of the last cull found, the chunks are compacted once they are all done.
+    int *chunkVisibleCounts;
 };
 
 
@@ -0,0 +1,83 @@
+//
+// Persistent worker threads used to split loops over many boxes (or other independent items) across cores.
+//
+
+#include "WorkerPool.h"
+#include "log.h"
+
+WorkerPool::WorkerPool(int workerCount) {
+    task=NULL;
+    count=0;
+    chunkSize=1;
+    chunkCount=0;
+    nextChunk=0;
+    busyWorkers=0;
+    generation=0;
+    quit=false;
+    for (int i = 0; i < workerCount; i++)
+        threads.push_back(std::thread(&WorkerPool::workerLoop, this, i+1));
+    LOGI("WorkerPool started %d worker threads", workerCount);
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit=true;
+    }
+    startCondition.notify_all();
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
+
+//Claims chunks until there are none left, so faster threads simply take more of them.
+void WorkerPool::runChunks(int worker) {
+    int chunk;
+    while ((chunk = nextChunk++) < chunkCount) {
+        int begin = chunk*chunkSize;
+        int end = (begin+chunkSize < count) ? begin+chunkSize : count;
+        (*task)(begin, end, worker);
+    }
+}
+
+void WorkerPool::workerLoop(int worker) {
+    unsigned seenGeneration = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            startCondition.wait(lock, [&]{ return quit || generation != seenGeneration; });
+            if (quit)
+                return;
+            seenGeneration = generation;
+        }
+        runChunks(worker);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busyWorkers--;
+        }
+        doneCondition.notify_one();
+    }
+}
+
+void WorkerPool::parallelFor(int count, int chunkSize, const std::function<void(int begin, int end, int worker)> &task) {
+    int chunks = (count + chunkSize - 1) / chunkSize;
+    if (chunks <= 1 || threads.empty()) {
+        //Not worth waking the workers.
+        for (int begin = 0; begin < count; begin += chunkSize)
+            task(begin, (begin+chunkSize < count) ? begin+chunkSize : count, 0);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->task = &task;
+        this->count = count;
+        this->chunkSize = chunkSize;
+        chunkCount = chunks;
+        nextChunk = 0;
+        busyWorkers = (int)threads.size();
+        generation++;
+    }
+    startCondition.notify_all();
+    runChunks(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCondition.wait(lock, [&]{ return busyWorkers == 0; });
+}
@@ -0,0 +1,43 @@
+//
+// Persistent worker threads used to split loops over many boxes (or other independent items) across cores.
+//
+
+#ifndef VULKAN_DEPTHPEEL_WORKERPOOL_H
+#define VULKAN_DEPTHPEEL_WORKERPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool {
+public:
+    WorkerPool(int workerCount);
+    ~WorkerPool();
+    //Runs task over [0, count) in chunks of chunkSize and returns once every chunk is done.
+    //Chunk boundaries only depend on count and chunkSize, never on the number of threads.
+    //worker is 0 for the calling thread and 1..workerCount for the pool threads.
+    //Must only be called from one thread at a time and not from inside a task.
+    void parallelFor(int count, int chunkSize, const std::function<void(int begin, int end, int worker)> &task);
+    int threadCount() { return (int)threads.size()+1; }
+private:
+    void workerLoop(int worker);
+    void runChunks(int worker);
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable startCondition;
+    std::condition_variable doneCondition;
+    const std::function<void(int, int, int)> *task;
+    int count;
+    int chunkSize;
+    int chunkCount;
+    std::atomic<int> nextChunk;
+    int busyWorkers;
+    unsigned generation;
+    bool quit;
+};
+
+
+#endif //VULKAN_DEPTHPEEL_WORKERPOOL_H
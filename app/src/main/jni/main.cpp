@@ -16,6 +16,28 @@
  */
 
 #define MAX_LAYERS 8
+#define MAX_FRAMES_IN_FLIGHT 3
+//A start and end timestamp for the traditional blend buffer and each peel and blend buffer.
+#define TIMESTAMP_QUERY_COUNT (2+MAX_LAYERS*4)
+//An occlusion and a pipeline statistics query for the traditional blend buffer and each peel buffer.
+#define LAYER_QUERY_COUNT (1+MAX_LAYERS)
+//Frames in a row that fewer layers must be enough before the adaptive layer count drops.
+#define ADAPTIVE_SHRINK_FRAMES 30
+//Dual depth peeling peels two layers per geometry pass so needs half as many passes.
+#define DUAL_PEEL_PASSES (MAX_LAYERS/2)
+//The traditional blend, the initial depth range, a peel, front blend and back blend per pass, then the composite.
+#define DUAL_PEEL_SUBPASS_COUNT (DUAL_PEEL_PASSES*3+3)
+//Secondary buffers are recorded against a null framebuffer so one per subpass is shared by every swapchain image.
+#define SECONDARY_BUFFERS_PER_FRAME (MAX_LAYERS*2+1)
+//The traditional blend, first peel and peel pipelines of each draw mode, the blend and the two saturation termination pipelines.
+#define DEPTH_PEEL_PIPELINE_COUNT 12
+//The A-buffer fragment pool size when none is given, in nodes per pixel.
+#define ABUFFER_DEFAULT_NODES_PER_PIXEL 4
+//A node is a colour, a depth and the index of the next node, padded to a multiple of the vec4 alignment.
+#define ABUFFER_NODE_SIZE 32
+#define DEFAULT_BOX_CAPACITY 500
+//The per box uniform draw modes need a descriptor set or aligned uniform slot per box so they are limited to this many boxes.
+#define MAX_UNIFORM_BOXES 65536
 //#define FORCE_VALIDATION
 //#define NO_SURFACE_EXTENSIONS //Usefull for mali devices that report no surface extentions.
 
@@ -30,10 +52,15 @@
 #include <string.h>
 
 #include <stdio.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
 #include "matrix.h"
 #include "models.h"
 #include "btQuickprof.h"
 #include "Simulation.h"
+#include "WorkerPool.h"
 #include "log.h"
 
 #ifdef __ANDROID__
@@ -50,11 +77,128 @@
 #include <vulkan/vk_platform.h>
 #endif
 
+//Ways of submitting the boxes, selectable at runtime.
+enum DrawMode {
+    DRAW_MODE_DESCRIPTOR_SETS, //One descriptor set bind and draw per box.
+    DRAW_MODE_INSTANCED, //One instanced draw per subpass, model matrices read from a storage buffer.
+    DRAW_MODE_DYNAMIC_OFFSETS, //One draw per box, a single dynamic uniform buffer set rebound with per box offsets.
+    DRAW_MODE_COUNT
+};
+
+const char* drawModeNames[DRAW_MODE_COUNT] = {"descriptor sets", "instanced", "dynamic offsets"};
+
+//Order independent transparency techniques, selectable at runtime.
+enum OitMode {
+    OIT_MODE_DEPTH_PEEL, //One layer per geometry pass, front to back.
+    OIT_MODE_DUAL_PEEL, //The nearest and furthest remaining layers per geometry pass.
+    OIT_MODE_WEIGHTED_BLENDED, //An approximation in a single geometry pass.
+    OIT_MODE_ABUFFER, //Per pixel linked lists of fragments built in a single geometry pass then sorted.
+    OIT_MODE_COUNT
+};
+
+const char* oitModeNames[OIT_MODE_COUNT] = {"depth peeling", "dual depth peeling", "weighted blended OIT", "A-buffer"};
+const char* oitModeOptions[OIT_MODE_COUNT] = {"peel", "dual", "weighted", "abuffer"}; //For --oit on Linux.
+
+//The pipelines used by the dual depth peel render pass.
+enum DualPeelStage {
+    DUAL_PEEL_STAGE_TRADITIONAL_BLEND,
+    DUAL_PEEL_STAGE_INIT, //Finds the depth range of all the layers.
+    DUAL_PEEL_STAGE_PEEL,
+    DUAL_PEEL_STAGE_FRONT_BLEND, //Blends the nearest layer under the colour buffer.
+    DUAL_PEEL_STAGE_BACK_BLEND, //Blends the furthest layer over the back layers.
+    DUAL_PEEL_STAGE_COMPOSITE //Blends the back layers under the colour buffer.
+};
+
+//The pipelines used by the weighted blended render pass.
+enum WeightedBlendedStage {
+    WEIGHTED_BLENDED_STAGE_TRADITIONAL_BLEND,
+    WEIGHTED_BLENDED_STAGE_ACCUMULATE, //Sums the weighted colours and multiplies the revealage.
+    WEIGHTED_BLENDED_STAGE_RESOLVE //Blends the weighted average under the colour buffer.
+};
+
+//The pipelines used by the A-buffer render pass.
+enum ABufferStage {
+    ABUFFER_STAGE_TRADITIONAL_BLEND,
+    ABUFFER_STAGE_BUILD, //Appends every fragment to its pixel's list.
+    ABUFFER_STAGE_RESOLVE //Sorts each pixel's list and blends it under the colour buffer.
+};
+
 void createSecondaryBuffers(struct engine* engine);
+void cycleDrawMode(struct engine* engine);
+void toggleGpuSimulation(struct engine* engine);
+int uniformBoxCount(struct engine* engine);
+void recordBoxDraws(struct engine* engine, VkCommandBuffer commandBuffer, VkPipelineLayout pipelineLayout, int frame);
+void recordSecondaryBuffer(struct engine* engine, int frame, int subpass, VkCommandBuffer commandBuffer);
 int setupUniforms(struct engine* engine);
-int setupTraditionalBlendPipeline(struct engine* engine);
-int setupBlendPipeline(struct engine* engine);
-int setupPeelPipeline(struct engine* engine);
+int setupModelDescriptorSets(struct engine* engine);
+int setupPipelineCache(struct engine* engine);
+int savePipelineCache(struct engine* engine);
+int setupTraditionalBlendPipeline(struct engine* engine, int drawMode);
+int setupBlendPipeline(struct engine* engine, bool writeTransmittance);
+int setupPeelPipeline(struct engine* engine, int drawMode, bool firstPeel);
+int setupGpuSimulation(struct engine* engine);
+int setupSimulationPipeline(struct engine* engine);
+void setupPipelines(struct engine* engine);
+void waitForPipelines(struct engine* engine);
+void recordGpuSimulation(struct engine* engine, VkCommandBuffer commandBuffer);
+int readGpuSimulation(struct engine* engine);
+int setupGpuCulling(struct engine* engine);
+int setupCullPipeline(struct engine* engine);
+void recordGpuCulling(struct engine* engine, VkCommandBuffer commandBuffer, int frame);
+void toggleGpuCulling(struct engine* engine);
+void toggleCpuCulling(struct engine* engine);
+int setupTimestampQueries(struct engine* engine);
+void writeTimestamp(struct engine* engine, VkCommandBuffer commandBuffer, VkPipelineStageFlagBits stage, int frame, int query);
+void readTimestamps(struct engine* engine, int frame);
+void resetGpuTimes(struct engine* engine);
+void reportGpuTimes(struct engine* engine);
+int setupLayerQueries(struct engine* engine);
+void beginLayerQueries(struct engine* engine, VkCommandBuffer commandBuffer, int frame, int query);
+void endLayerQueries(struct engine* engine, VkCommandBuffer commandBuffer, int frame, int query);
+void readLayerStats(struct engine* engine, int frame);
+void resetLayerStats(struct engine* engine);
+void reportLayerStats(struct engine* engine);
+void toggleLayerStats(struct engine* engine);
+void updateAdaptiveLayers(struct engine* engine, const uint64_t (*samples)[2], int peeledLayers);
+void toggleAdaptiveLayers(struct engine* engine);
+bool oitModeSupported(struct engine* engine, int oitMode);
+void cycleOitMode(struct engine* engine);
+int createAttachmentImage(struct engine* engine, VkFormat format, VkExtent2D extent, VkImageView *view);
+int createLayerRenderPass(struct engine* engine, int layers);
+int selectLayerRenderPass(struct engine* engine, int layers);
+int switchLayerRenderPass(struct engine* engine, int layers);
+int setupDualPeel(struct engine* engine, VkFormat format, VkFormat depthFormat, VkExtent2D extent);
+int setupDualPeelPipeline(struct engine* engine, int drawMode, int stage);
+void recordDualPeelSecondaryBuffer(struct engine* engine, int frame, int subpass, VkCommandBuffer commandBuffer);
+int setupWeightedBlended(struct engine* engine, VkFormat format, VkFormat depthFormat, VkExtent2D extent);
+int setupWeightedBlendedPipeline(struct engine* engine, int drawMode, int stage);
+void recordWeightedBlendedSecondaryBuffer(struct engine* engine, int frame, int stage, VkCommandBuffer commandBuffer);
+int setupABuffer(struct engine* engine, VkFormat format, VkFormat depthFormat, VkExtent2D extent);
+int setupABufferPipeline(struct engine* engine, int drawMode, int stage);
+void recordABufferSecondaryBuffer(struct engine* engine, int frame, int stage, VkCommandBuffer commandBuffer);
+void recordABufferReset(struct engine* engine, VkCommandBuffer commandBuffer);
+void recordABufferReadback(struct engine* engine, VkCommandBuffer commandBuffer, int frame);
+void readABufferCount(struct engine* engine, int frame);
+void resetABufferStats(struct engine* engine);
+void reportABufferStats(struct engine* engine);
+int setupSaturationTermination(struct engine* engine, VkFormat depthFormat);
+int setupSaturationMarkPipeline(struct engine* engine);
+void toggleSaturationTermination(struct engine* engine);
+
+//Command pools can only be used by one thread at a time, so each worker pool thread records its secondary buffers
+//into buffers allocated from a pool of its own. The pool is reset before each rebuild and its buffers reused.
+struct RecordPool {
+    VkCommandPool commandPool;
+    VkCommandBuffer *commandBuffers;
+    int allocated;
+    int used;
+};
+
+//The depth peel pipelines built for one layer render pass, kept while another layer count is used.
+struct LayerPipelines {
+    bool created;
+    VkPipeline pipelines[DEPTH_PEEL_PIPELINE_COUNT];
+};
 
 /**
  * Our saved state data.
@@ -86,34 +230,64 @@ struct engine {
     VkPhysicalDeviceProperties deviceProperties;
     VkPhysicalDeviceMemoryProperties physicalDeviceMemoryProperties;
     VkCommandBuffer setupCommandBuffer;
-    VkCommandBuffer renderCommandBuffer[2];
-    VkCommandBuffer *secondaryCommandBuffers;
+    VkCommandBuffer renderCommandBuffer[MAX_FRAMES_IN_FLIGHT];
+    VkCommandBuffer *secondaryCommandBuffers; //Handles from the record pools, in the order they are executed.
+    struct RecordPool *recordPools; //One per worker pool thread.
+    int recordPoolCount;
     VkImage depthImage[2];
     VkImageView depthView[2];
+    VkImageView depthAttachmentView[2]; //Both aspects of the depth buffers where they have a stencil.
+    bool depthHasStencil;
     VkDeviceMemory depthMemory;
     VkImage peelImage;
     VkImageView peelView;
     VkDeviceMemory peelMemory;
+    VkImageView transmittanceView; //What light gets through the layers blended so far, one per pixel.
     uint32_t swapchainImageCount = 0;
     VkSwapchainKHR swapchain;
     VkImage *swapChainImages;
     VkImageView *swapChainViews;
-    VkFramebuffer *framebuffers;
+    VkFramebuffer *framebuffers; //The framebuffers of the current depth peel render pass.
+    VkBuffer uniformBuffer;
     uint8_t *uniformMappedMemory;
-    VkSemaphore presentCompleteSemaphore;
-    VkRenderPass renderPass;
+    VkDeviceSize uniformSlotSize;
+    VkSemaphore imageAcquiredSemaphores[MAX_FRAMES_IN_FLIGHT];
+    VkSemaphore renderCompleteSemaphores[MAX_FRAMES_IN_FLIGHT];
+    VkFence frameFences[MAX_FRAMES_IN_FLIGHT];
+    int framesInFlight;
+    VkRenderPass renderPass; //The depth peel render pass for renderPassLayers layers.
+    VkFormat colourFormat;
+    VkFormat depthFormat;
+    VkRenderPass layerRenderPasses[MAX_LAYERS+1]; //Created the first time each layer count is used.
+    VkFramebuffer *layerFramebuffers[MAX_LAYERS+1];
+    struct LayerPipelines layerPipelines[MAX_LAYERS+1]; //Of the render passes that aren't current.
+    int renderPassLayers;
     VkPipelineLayout pipelineLayout;
     VkPipelineLayout blendPeelPipelineLayout;
     VkDescriptorSetLayout *descriptorSetLayouts;
-    VkDescriptorSet sceneDescriptorSet;
-    VkDescriptorSet *modelDescriptorSets;
-    VkDescriptorSet identityModelDescriptorSet;
-    VkDescriptorSet identitySceneDescriptorSet;
+    VkDescriptorSet sceneDescriptorSets[MAX_FRAMES_IN_FLIGHT];
+    VkDescriptorSet *modelDescriptorSets; //Created when the descriptor sets draw mode is first used.
+    VkDescriptorSet identityModelDescriptorSets[MAX_FRAMES_IN_FLIGHT];
+    VkDescriptorSet identitySceneDescriptorSets[MAX_FRAMES_IN_FLIGHT];
     VkDescriptorSet colourInputAttachmentDescriptorSet;
     VkDescriptorSet depthInputAttachmentDescriptorSets[2];
     uint32_t modelBufferValsOffset;
+    VkPipelineLayout instancedPipelineLayout;
+    VkPipelineLayout instancedBlendPeelPipelineLayout;
+    VkDescriptorSetLayout instanceDescriptorSetLayout;
+    VkDescriptorSet instanceDescriptorSets[MAX_FRAMES_IN_FLIGHT];
+    VkPipelineLayout dynamicPipelineLayout;
+    VkPipelineLayout dynamicBlendPeelPipelineLayout;
+    VkDescriptorSetLayout dynamicModelDescriptorSetLayout;
+    VkDescriptorSet dynamicModelDescriptorSets[MAX_FRAMES_IN_FLIGHT];
+    uint8_t *instanceMappedMemory;
+    VkDeviceSize instanceSlotSize;
+    VkBuffer instanceBuffer;
+    VkBuffer indirectBuffer;
+    VkDrawIndirectCommand *indirectCommands; //One per frame slot, the instanced draws take the box count from it.
     VkBuffer vertexBuffer;
     VkQueue queue;
+    VkPipelineCache pipelineCache;
     bool vulkanSetupOK;
     int frame = 0;
     int32_t width;
@@ -123,16 +297,139 @@ struct engine {
     VkPipeline peelPipeline;
     VkPipeline firstPeelPipeline;
     VkPipeline blendPipeline;
+    VkPipeline instancedTraditionalBlendPipeline;
+    VkPipeline instancedPeelPipeline;
+    VkPipeline instancedFirstPeelPipeline;
+    VkPipeline dynamicTraditionalBlendPipeline;
+    VkPipeline dynamicPeelPipeline;
+    VkPipeline dynamicFirstPeelPipeline;
     btClock *frameRateClock;
     Simulation *simulation;
+    WorkerPool *workerPool;
+    std::thread *pipelineThread;
+    int threadCount;
+    uint32_t seed;
     bool splitscreen;
+    bool headless; //Render to offscreen images with no window, surface or swapchain.
     bool rebuildCommadBuffersRequired;
     VkVertexInputBindingDescription vertexInputBindingDescription;
     VkVertexInputAttributeDescription vertexInputAttributeDescription[2];
     VkShaderModule shdermodules[6];
+    VkShaderModule instancedVertexShaderModule;
+    bool instancingSupported;
+    int drawMode;
+    //GPU simulation: the box state stays in device local memory and a compute dispatch writes the instance matrices.
+    VkPipelineLayout simulationPipelineLayout;
+    VkPipeline simulationPipeline;
+    VkShaderModule simulationShaderModule;
+    VkDescriptorSet simulationDescriptorSet;
+    VkDescriptorSet simulationInstanceDescriptorSet;
+    VkBuffer simulationStateBuffer;
+    VkBuffer simulationInstanceBuffer;
+    VkBuffer simulationStagingBuffer;
+    uint8_t *simulationStagingMappedMemory;
+    bool computeSupported;
+    bool gpuSimulationSupported;
+    bool gpuSimulation;
+    bool gpuSimulationUploadRequired;
+    //GPU culling: a compute dispatch compacts the matrices of the boxes inside the frustum into a device local slot
+    //and counts them into the indirect draw every subpass uses.
+    VkPipelineLayout cullPipelineLayout;
+    VkPipeline cullPipeline;
+    VkShaderModule cullShaderModule;
+    VkDescriptorSet cullDescriptorSets[2][MAX_FRAMES_IN_FLIGHT]; //Reading the CPU slot's or the GPU simulation's matrices.
+    VkDescriptorSet culledInstanceDescriptorSets[MAX_FRAMES_IN_FLIGHT];
+    VkBuffer culledIndirectBuffer;
+    VkDeviceSize culledIndirectSlotSize;
+    bool gpuCullingSupported;
+    bool gpuCulling;
+    bool cpuCulling; //The simulation lists the visible boxes and only their matrices are uploaded and drawn.
+    //GPU timing: the secondary buffers write timestamps which are read back once their frame slot's fence signals.
+    VkQueryPool timestampQueryPool;
+    uint32_t timestampValidBits;
+    bool timestampsSupported;
+    bool timestampsPending[MAX_FRAMES_IN_FLIGHT];
+    double gpuTimeTotals[MAX_LAYERS+2]; //Traditional blend, each layer then the whole frame.
+    int gpuTimeSamples[MAX_LAYERS+2];
+    //Layer statistics: samples passed, fragment shader invocations and clipping primitives for the traditional
+    //blend and each peel, an optional mode as the queries may cost GPU time.
+    bool layerStats;
+    bool occlusionQueryPrecise;
+    bool pipelineStatisticsSupported;
+    VkQueryPool occlusionQueryPool;
+    VkQueryPool statisticsQueryPool;
+    bool layerStatsPending[MAX_FRAMES_IN_FLIGHT];
+    bool statisticsPending[MAX_FRAMES_IN_FLIGHT];
+    uint64_t layerSampleTotals[LAYER_QUERY_COUNT];
+    uint64_t layerFragmentTotals[LAYER_QUERY_COUNT];
+    uint64_t layerPrimitiveTotals[LAYER_QUERY_COUNT];
+    int layerStatsSamples[LAYER_QUERY_COUNT];
+    //Adaptive layers: peel only as many of the layerCount layers as the occlusion queries show are needed.
+    bool adaptiveLayers;
+    int adaptiveLayerCount;
+    int adaptiveShrinkFrames;
+    int peeledLayers[MAX_FRAMES_IN_FLIGHT]; //-1 for frames drawn by another technique.
+    int oitMode;
+    //Dual depth peeling: a render pass of its own whose passes each peel the nearest and furthest remaining layers.
+    bool dualPeelSupported;
+    VkRenderPass dualPeelRenderPass;
+    VkFramebuffer *dualPeelFramebuffers;
+    VkDescriptorSet dualDepthDescriptorSets[2];
+    VkDescriptorSet dualFrontDescriptorSet;
+    VkDescriptorSet dualBackDescriptorSet;
+    VkDescriptorSet dualBackAccumulationDescriptorSet;
+    VkShaderModule dualShaderModules[3]; //The init, peel and composite fragment shaders.
+    VkPipeline dualTraditionalBlendPipelines[DRAW_MODE_COUNT];
+    VkPipeline dualInitPipelines[DRAW_MODE_COUNT];
+    VkPipeline dualPeelPipelines[DRAW_MODE_COUNT];
+    VkPipeline dualFrontBlendPipeline;
+    VkPipeline dualBackBlendPipeline;
+    VkPipeline dualCompositePipeline;
+    //Weighted blended OIT: a three subpass render pass, the traditional blend, the accumulation and the resolve.
+    bool weightedBlendedSupported;
+    VkRenderPass weightedBlendedRenderPass;
+    VkFramebuffer *weightedBlendedFramebuffers;
+    VkDescriptorSet weightedBlendedDescriptorSets[2]; //The accumulation and revealage input attachments.
+    VkPipelineLayout weightedBlendedResolvePipelineLayout;
+    VkShaderModule weightedBlendedShaderModules[2]; //The accumulate and resolve fragment shaders.
+    VkPipeline weightedBlendedTraditionalBlendPipelines[DRAW_MODE_COUNT];
+    VkPipeline weightedBlendedAccumulatePipelines[DRAW_MODE_COUNT];
+    VkPipeline weightedBlendedResolvePipeline;
+    //A-buffer: fragments are appended to per pixel linked lists in a storage buffer pool, then sorted and blended.
+    bool fragmentStoresAndAtomics;
+    bool abufferSupported;
+    uint32_t abufferCapacity; //Nodes in the fragment pool, 0 for ABUFFER_DEFAULT_NODES_PER_PIXEL per pixel.
+    VkRenderPass abufferRenderPass;
+    VkFramebuffer *abufferFramebuffers;
+    VkBuffer abufferHeadBuffer;
+    VkBuffer abufferCounterBuffer; //The node count, capacity and framebuffer width.
+    VkBuffer abufferReadbackBuffer;
+    uint32_t *abufferReadbackMappedMemory; //The node count of each frame slot's last frame.
+    uint32_t abufferWidth;
+    VkDescriptorSet abufferDescriptorSet;
+    VkPipelineLayout abufferPipelineLayouts[DRAW_MODE_COUNT];
+    VkShaderModule abufferShaderModules[2]; //The build and resolve fragment shaders.
+    VkPipeline abufferTraditionalBlendPipelines[DRAW_MODE_COUNT];
+    VkPipeline abufferBuildPipelines[DRAW_MODE_COUNT];
+    VkPipeline abufferResolvePipeline;
+    bool abufferCountPending[MAX_FRAMES_IN_FLIGHT];
+    uint32_t abufferPeakFragments;
+    uint64_t abufferDroppedFragments;
+    int abufferOverflowFrames;
+    int abufferFrames;
+    //Saturation termination: pixels no deeper layer can change are marked in the stencil and skipped by later peels.
+    bool saturationSupported;
+    bool saturationTermination;
+    VkShaderModule saturationShaderModules[2]; //The mark and blend fragment shaders.
+    VkPipelineLayout saturationMarkPipelineLayout;
+    VkDescriptorSet transmittanceDescriptorSet;
+    VkPipeline saturationMarkPipeline;
+    VkPipeline saturationBlendPipeline; //The blend pipeline that also multiplies in the transmittance.
     int displayLayer;
     int layerCount;
     int boxCount;
+    int boxCapacity;
+    int uniformBoxCapacity;
 
     const int NUM_SAMPLES = 1;
 };
@@ -187,6 +484,382 @@ char* loadAsset(const char* filename, struct engine *pEngine, bool &ok, size_t &
 #endif
 }
 
+//Creates a shader module from a SPIR-V asset. Returns 1 if the asset is missing so optional techniques can be
+//disabled, -1 if the module can't be created.
+int loadShaderModule(struct engine* engine, const char* path, VkShaderModule *module)
+{
+    bool ok;
+    size_t shaderSize=0;
+    char *shader = loadAsset(path, engine, ok, shaderSize);
+    if (!ok || shaderSize==0) {
+        free(shader);
+        return 1;
+    }
+
+    VkShaderModuleCreateInfo moduleCreateInfo;
+    moduleCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    moduleCreateInfo.pNext = NULL;
+    moduleCreateInfo.flags = 0;
+    moduleCreateInfo.codeSize = shaderSize;
+    moduleCreateInfo.pCode = (uint32_t*)shader;
+    VkResult res = vkCreateShaderModule(engine->vkDevice, &moduleCreateInfo, NULL, module);
+    free(shader);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateShaderModule returned error %d.\n", res);
+        return -1;
+    }
+    return 0;
+}
+
+//Creates a buffer and binds it to a new allocation from a memory type with the required properties.
+int createBuffer(struct engine* engine, VkDeviceSize size, VkBufferUsageFlags usage, VkFlags requirements_mask, VkBuffer *buffer, VkDeviceMemory *memory)
+{
+    VkResult res;
+    VkBufferCreateInfo bufferCreateInfo;
+    bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferCreateInfo.pNext = NULL;
+    bufferCreateInfo.usage = usage;
+    bufferCreateInfo.size = size;
+    bufferCreateInfo.queueFamilyIndexCount = 0;
+    bufferCreateInfo.pQueueFamilyIndices = NULL;
+    bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    bufferCreateInfo.flags = 0;
+
+    res = vkCreateBuffer(engine->vkDevice, &bufferCreateInfo, NULL, buffer);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateBuffer returned error %d.\n", res);
+        return -1;
+    }
+
+    VkMemoryRequirements memoryRequirements;
+    vkGetBufferMemoryRequirements(engine->vkDevice, *buffer, &memoryRequirements);
+    uint8_t found = 0;
+    uint32_t typeBits = memoryRequirements.memoryTypeBits;
+    uint32_t typeIndex;
+    for (typeIndex = 0; typeIndex < engine->physicalDeviceMemoryProperties.memoryTypeCount; typeIndex++) {
+        if ((typeBits & 1) == 1)//Check last bit;
+        {
+            if ((engine->physicalDeviceMemoryProperties.memoryTypes[typeIndex].propertyFlags & requirements_mask) == requirements_mask)
+            {
+                found=1;
+                break;
+            }
+        }
+        typeBits >>= 1;
+    }
+
+    if (!found)
+    {
+        LOGE ("Did not find a suitable memory type.\n");
+        return -1;
+    }
+
+    VkMemoryAllocateInfo memAllocInfo;
+    memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memAllocInfo.pNext = NULL;
+    memAllocInfo.allocationSize = memoryRequirements.size;
+    memAllocInfo.memoryTypeIndex = typeIndex;
+
+    res = vkAllocateMemory(engine->vkDevice, &memAllocInfo, NULL, memory);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkAllocateMemory returned error %d.\n", res);
+        return -1;
+    }
+
+    res = vkBindBufferMemory(engine->vkDevice, *buffer, *memory, 0);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkBindBufferMemory returned error %d.\n", res);
+        return -1;
+    }
+    return 0;
+}
+
+
+//Gives the file the pipeline cache is kept in, internal storage on Android and the XDG cache directory on Linux.
+bool pipelineCachePath(struct engine* engine, char *path, size_t size)
+{
+#ifdef __ANDROID__
+    const char *directory = engine->app->activity->internalDataPath;
+    if (!directory)
+        return false;
+    snprintf(path, size, "%s/pipeline_cache.bin", directory);
+#else
+    char directory[PATH_MAX];
+    const char *cacheHome = getenv("XDG_CACHE_HOME");
+    if (cacheHome && cacheHome[0]=='/')
+        snprintf(directory, sizeof(directory), "%s", cacheHome);
+    else {
+        const char *home = getenv("HOME");
+        if (!home)
+            return false;
+        snprintf(directory, sizeof(directory), "%s/.cache", home);
+    }
+    mkdir(directory, 0700);
+    strncat(directory, "/VulkanDepthPeel", sizeof(directory)-strlen(directory)-1);
+    mkdir(directory, 0700);
+    snprintf(path, size, "%s/pipeline_cache.bin", directory);
+#endif
+    return true;
+}
+
+//Creates the pipeline cache shared by every pipeline, seeded from the last run if the saved data
+//was written by the same driver for the same device.
+int setupPipelineCache(struct engine* engine)
+{
+    VkResult res;
+    char *data = NULL;
+    size_t size = 0;
+    char path[PATH_MAX];
+    if (pipelineCachePath(engine, path, sizeof(path))) {
+        FILE *fileHandle = fopen(path, "rb");
+        if (fileHandle) {
+            fseek(fileHandle, 0L, SEEK_END);
+            long length = ftell(fileHandle);
+            fseek(fileHandle, 0L, SEEK_SET);
+            if (length > 0) {
+                size = length;
+                data = (char*)malloc(size);
+                if (fread(data, size, 1, fileHandle) != 1)
+                    size = 0;
+            }
+            fclose(fileHandle);
+        }
+    }
+
+    //The header is: length, version, vendor ID, device ID then the cache UUID.
+    const size_t headerSize = sizeof(uint32_t)*4 + VK_UUID_SIZE;
+    if (size > 0) {
+        uint32_t header[4];
+        if (size < headerSize)
+            size = 0;
+        else {
+            memcpy(header, data, sizeof(header));
+            if (header[0] < headerSize || header[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+                header[2] != engine->deviceProperties.vendorID || header[3] != engine->deviceProperties.deviceID ||
+                memcmp(data + sizeof(header), engine->deviceProperties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+                size = 0;
+        }
+        if (size == 0)
+            LOGI("Discarding pipeline cache from a different device or driver");
+    }
+
+    VkPipelineCacheCreateInfo pipelineCacheCreateInfo;
+    pipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    pipelineCacheCreateInfo.pNext = NULL;
+    pipelineCacheCreateInfo.flags = 0;
+    pipelineCacheCreateInfo.initialDataSize = size;
+    pipelineCacheCreateInfo.pInitialData = (size > 0) ? data : NULL;
+    res = vkCreatePipelineCache(engine->vkDevice, &pipelineCacheCreateInfo, NULL, &engine->pipelineCache);
+    free(data);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreatePipelineCache returned error %d.\n", res);
+        engine->pipelineCache = VK_NULL_HANDLE;
+        return -1;
+    }
+    LOGI("Pipeline cache created with %d bytes of saved data", (int)size);
+    return 0;
+}
+
+//Writes the pipeline cache out for the next run, through a temporary file so a partial write is never loaded.
+int savePipelineCache(struct engine* engine)
+{
+    VkResult res;
+    if (engine->pipelineCache == VK_NULL_HANDLE)
+        return 0;
+    char path[PATH_MAX];
+    char tempPath[PATH_MAX];
+    if (!pipelineCachePath(engine, path, sizeof(path)))
+        return -1;
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+
+    size_t size = 0;
+    res = vkGetPipelineCacheData(engine->vkDevice, engine->pipelineCache, &size, NULL);
+    if (res != VK_SUCCESS || size == 0) {
+        LOGE ("vkGetPipelineCacheData returned error %d.\n", res);
+        return -1;
+    }
+    char *data = (char*)malloc(size);
+    res = vkGetPipelineCacheData(engine->vkDevice, engine->pipelineCache, &size, data);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkGetPipelineCacheData returned error %d.\n", res);
+        free(data);
+        return -1;
+    }
+
+    FILE *fileHandle = fopen(tempPath, "wb");
+    if (!fileHandle) {
+        LOGE ("Cannot write pipeline cache %s", tempPath);
+        free(data);
+        return -1;
+    }
+    bool ok = fwrite(data, size, 1, fileHandle) == 1;
+    ok = (fclose(fileHandle) == 0) && ok;
+    free(data);
+    if (!ok || rename(tempPath, path) != 0) {
+        LOGE ("Cannot write pipeline cache %s", path);
+        unlink(tempPath);
+        return -1;
+    }
+    LOGI("Pipeline cache saved %d bytes", (int)size);
+    return 0;
+}
+
+//Creates the swapchain for the window surface, giving its format and size.
+int createSwapchain(struct engine* engine, VkSurfaceKHR surface, VkFormat &format, VkExtent2D &swapChainExtent)
+{
+    VkResult res;
+    uint32_t formatCount;
+    vkGetPhysicalDeviceSurfaceFormatsKHR(engine->physicalDevice, surface, &formatCount, NULL);
+    VkSurfaceFormatKHR formats[formatCount];
+    vkGetPhysicalDeviceSurfaceFormatsKHR(engine->physicalDevice, surface, &formatCount, formats);
+
+    uint32_t presentModeCount;
+    vkGetPhysicalDeviceSurfacePresentModesKHR(engine->physicalDevice, surface, &presentModeCount, NULL);
+    VkPresentModeKHR presentModes[presentModeCount];
+    vkGetPhysicalDeviceSurfacePresentModesKHR(engine->physicalDevice, surface, &presentModeCount, presentModes);
+
+    VkSurfaceCapabilitiesKHR surfCapabilities;
+    res = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(engine->physicalDevice, surface, &surfCapabilities);
+
+    // width and height are either both -1, or both not -1.
+    if (surfCapabilities.currentExtent.width == (uint32_t)-1) {
+        // If the surface size is undefined, the size is set to
+        // the size of the images requested.
+//        swapChainExtent.width = 800;
+//        swapChainExtent.height = 600;
+        LOGE("Swapchain size is (-1, -1)\n");
+        return -1;
+    } else {
+        // If the surface size is defined, the swap chain size must match
+        swapChainExtent = surfCapabilities.currentExtent;
+        LOGI("Swapchain size is (%d, %d)\n", swapChainExtent.width, swapChainExtent.height);
+        engine->width=swapChainExtent.width;
+        engine->height=swapChainExtent.height;
+    }
+
+    // If the format list includes just one entry of VK_FORMAT_UNDEFINED,
+    // the surface has no preferred format.  Otherwise, at least one
+    // supported format will be returned.
+    if (formatCount == 1 && formats[0].format == VK_FORMAT_UNDEFINED) {
+        format = VK_FORMAT_R8G8B8A8_UNORM;
+    } else {
+        assert(formatCount >= 1);
+        format = formats[0].format;
+    }
+    LOGI("Using format %d\n", format);
+
+    uint32_t desiredNumberOfSwapChainImages = surfCapabilities.minImageCount + 1;
+    if ((surfCapabilities.maxImageCount > 0) &&
+        (desiredNumberOfSwapChainImages > surfCapabilities.maxImageCount)) {
+        // Application must settle for fewer images than desired:
+        desiredNumberOfSwapChainImages = surfCapabilities.maxImageCount;
+    }
+    LOGI("Asking for %d SwapChainImages\n", desiredNumberOfSwapChainImages);
+
+    VkSurfaceTransformFlagBitsKHR preTransform;
+    if (surfCapabilities.supportedTransforms &
+        VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR) {
+        preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
+    } else {
+        preTransform = surfCapabilities.currentTransform;
+    }
+    LOGI("Using preTransform %d\n", preTransform);
+
+    VkSwapchainCreateInfoKHR swapCreateInfo;
+    swapCreateInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+    swapCreateInfo.pNext = NULL;
+    swapCreateInfo.surface = surface;
+    swapCreateInfo.minImageCount = desiredNumberOfSwapChainImages;
+    swapCreateInfo.imageFormat = format;
+    swapCreateInfo.imageExtent=swapChainExtent;
+    //swapCreateInfo.imageExtent.width = width; //Should match window size
+    //swapCreateInfo.imageExtent.height = height;
+    swapCreateInfo.preTransform = preTransform;
+    swapCreateInfo.compositeAlpha = VK_COMPOSITE_ALPHA_INHERIT_BIT_KHR;
+    swapCreateInfo.imageArrayLayers = 1;
+    swapCreateInfo.presentMode = VK_PRESENT_MODE_FIFO_KHR;
+    swapCreateInfo.oldSwapchain = VK_NULL_HANDLE;
+    swapCreateInfo.clipped = VK_TRUE;
+    swapCreateInfo.imageColorSpace = VK_COLORSPACE_SRGB_NONLINEAR_KHR;
+    swapCreateInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    swapCreateInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    swapCreateInfo.queueFamilyIndexCount = 0;
+    swapCreateInfo.pQueueFamilyIndices = NULL;
+
+    vkCreateSwapchainKHR(engine->vkDevice, &swapCreateInfo, NULL, &engine->swapchain);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateSwapchainKHR returned error.\n");
+        return -1;
+    }
+    LOGI("Swapchain created");
+    return 0;
+}
+
+//Creates the colour images headless rendering draws to in place of the swapchain images, one per frame in flight.
+int createOffscreenImages(struct engine* engine, VkFormat format, VkExtent2D extent)
+{
+    VkResult res;
+    engine->swapchainImageCount = engine->framesInFlight;
+    engine->swapChainImages = new VkImage[engine->swapchainImageCount];
+    for (uint32_t i = 0; i < engine->swapchainImageCount; i++) {
+        VkImageCreateInfo imageCreateInfo;
+        imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        imageCreateInfo.pNext = NULL;
+        imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+        imageCreateInfo.format = format;
+        imageCreateInfo.extent.width = extent.width;
+        imageCreateInfo.extent.height = extent.height;
+        imageCreateInfo.extent.depth = 1;
+        imageCreateInfo.mipLevels = 1;
+        imageCreateInfo.arrayLayers = 1;
+        imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+        imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        imageCreateInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        imageCreateInfo.queueFamilyIndexCount = 0;
+        imageCreateInfo.pQueueFamilyIndices = NULL;
+        imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        imageCreateInfo.flags = 0;
+        res = vkCreateImage(engine->vkDevice, &imageCreateInfo, NULL, &engine->swapChainImages[i]);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkCreateImage returned error while creating offscreen image.\n");
+            return -1;
+        }
+
+        VkMemoryRequirements memoryRequirements;
+        vkGetImageMemoryRequirements(engine->vkDevice, engine->swapChainImages[i], &memoryRequirements);
+        uint32_t typeBits = memoryRequirements.memoryTypeBits;
+        uint32_t typeIndex;
+        for (typeIndex = 0; typeIndex < engine->physicalDeviceMemoryProperties.memoryTypeCount; typeIndex++) {
+            if ((typeBits & 1) == 1 && (engine->physicalDeviceMemoryProperties.memoryTypes[typeIndex].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+                break;
+            typeBits >>= 1;
+        }
+        if (typeIndex == engine->physicalDeviceMemoryProperties.memoryTypeCount) {
+            LOGE ("Did not find a suitable memory type for the offscreen images.\n");
+            return -1;
+        }
+
+        VkMemoryAllocateInfo memAllocInfo;
+        memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        memAllocInfo.pNext = NULL;
+        memAllocInfo.allocationSize = memoryRequirements.size;
+        memAllocInfo.memoryTypeIndex = typeIndex;
+        VkDeviceMemory imageMemory;
+        res = vkAllocateMemory(engine->vkDevice, &memAllocInfo, NULL, &imageMemory);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkAllocateMemory returned error while creating offscreen image.\n");
+            return -1;
+        }
+        res = vkBindImageMemory(engine->vkDevice, engine->swapChainImages[i], imageMemory, 0);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkBindImageMemory returned error while creating offscreen image. %d\n", res);
+            return -1;
+        }
+    }
+    LOGI("%d offscreen images created (%d, %d)", engine->swapchainImageCount, extent.width, extent.height);
+    return 0;
+}
 
 /**
  * Initialize an EGL context for the current display.
@@ -294,6 +967,8 @@ static int engine_init_display(struct engine* engine) {
 #ifdef NO_SURFACE_EXTENSIONS
     inst_info.enabledExtensionCount = 0;
 #endif
+    if (engine->headless)
+        inst_info.enabledExtensionCount = 0;
     inst_info.ppEnabledExtensionNames = enabledInstanceExtensionNames;
 #ifdef FORCE_VALIDATION
     inst_info.enabledLayerCount = 8;
@@ -334,7 +1009,7 @@ static int engine_init_display(struct engine* engine) {
     }
     engine->physicalDevice=physicalDevices[0];
 
-    VkSurfaceKHR surface;
+    VkSurfaceKHR surface = VK_NULL_HANDLE;
 #ifdef __ANDROID__
     VkAndroidSurfaceCreateInfoKHR instInfo;
     instInfo.sType=VK_STRUCTURE_TYPE_ANDROID_SURFACE_CREATE_INFO_KHR;
@@ -347,20 +1022,23 @@ static int engine_init_display(struct engine* engine) {
         return -1;
     }
 #else
-    VkXcbSurfaceCreateInfoKHR createInfo = {};
-    createInfo.sType = VK_STRUCTURE_TYPE_XCB_SURFACE_CREATE_INFO_KHR;
-    createInfo.pNext = NULL;
-    createInfo.connection = engine->xcbConnection;
-    createInfo.window = engine->window;
-    res = vkCreateXcbSurfaceKHR(engine->vkInstance, &createInfo, NULL, &surface);
-    if (res != VK_SUCCESS) {
-      printf ("vkCreateXcbSurfaceKHR returned error.\n");
-      return -1;
+    if (!engine->headless) {
+        VkXcbSurfaceCreateInfoKHR createInfo = {};
+        createInfo.sType = VK_STRUCTURE_TYPE_XCB_SURFACE_CREATE_INFO_KHR;
+        createInfo.pNext = NULL;
+        createInfo.connection = engine->xcbConnection;
+        createInfo.window = engine->window;
+        res = vkCreateXcbSurfaceKHR(engine->vkInstance, &createInfo, NULL, &surface);
+        if (res != VK_SUCCESS) {
+          printf ("vkCreateXcbSurfaceKHR returned error.\n");
+          return -1;
+        }
     }
 #endif
 
 
-    LOGI ("Vulkan surface created\n");
+    if (surface != VK_NULL_HANDLE)
+        LOGI ("Vulkan surface created\n");
 
     vkGetPhysicalDeviceMemoryProperties(engine->physicalDevice, &engine->physicalDeviceMemoryProperties);
     LOGI ("There are %d memory types.\n", engine->physicalDeviceMemoryProperties.memoryTypeCount);
@@ -386,9 +1064,13 @@ static int engine_init_display(struct engine* engine) {
     for (; i < queueCount; i++) {
         if (queueFamilyProperties[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
             LOGI ("PhysicalDeviceQueueFamily %i has property VK_QUEUE_GRAPHICS_BIT.\n", i);
-            vkGetPhysicalDeviceSurfaceSupportKHR(engine->physicalDevice, i, surface, &supportsPresent);
+            supportsPresent = VK_TRUE; //Nothing is presented when headless.
+            if (!engine->headless)
+                vkGetPhysicalDeviceSurfaceSupportKHR(engine->physicalDevice, i, surface, &supportsPresent);
             if (supportsPresent) {
                 deviceQueueCreateInfo.queueFamilyIndex = i;
+                engine->computeSupported = (queueFamilyProperties[i].queueFlags & VK_QUEUE_COMPUTE_BIT) != 0;
+                engine->timestampValidBits = queueFamilyProperties[i].timestampValidBits;
                 found = 1;
                 break;
             }
@@ -424,8 +1106,21 @@ static int engine_init_display(struct engine* engine) {
 #ifdef NO_SURFACE_EXTENSIONS
     dci.enabledExtensionCount = 0;
 #endif
+    if (engine->headless)
+        dci.enabledExtensionCount = 0;
     dci.ppEnabledExtensionNames = enabledDeviceExtensionNames;
-    dci.pEnabledFeatures = NULL;
+    //The only optional features used are for the layer statistics queries and the A-buffer's fragment shader
+    //stores and atomics.
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(engine->physicalDevice, &supportedFeatures);
+    VkPhysicalDeviceFeatures enabledFeatures = {};
+    enabledFeatures.occlusionQueryPrecise = supportedFeatures.occlusionQueryPrecise;
+    enabledFeatures.pipelineStatisticsQuery = supportedFeatures.pipelineStatisticsQuery;
+    enabledFeatures.fragmentStoresAndAtomics = supportedFeatures.fragmentStoresAndAtomics;
+    engine->occlusionQueryPrecise = supportedFeatures.occlusionQueryPrecise;
+    engine->pipelineStatisticsSupported = supportedFeatures.pipelineStatisticsQuery;
+    engine->fragmentStoresAndAtomics = supportedFeatures.fragmentStoresAndAtomics;
+    dci.pEnabledFeatures = &enabledFeatures;
 #ifdef FORCE_VALIDATION
     dci.enabledLayerCount = 8;
 #else
@@ -445,93 +1140,16 @@ static int engine_init_display(struct engine* engine) {
 
 
 
-    //Setup the swapchain
-    uint32_t formatCount;
-    vkGetPhysicalDeviceSurfaceFormatsKHR(engine->physicalDevice, surface, &formatCount, NULL);
-    VkSurfaceFormatKHR formats[formatCount];
-    vkGetPhysicalDeviceSurfaceFormatsKHR(engine->physicalDevice, surface, &formatCount, formats);
-
-    uint32_t presentModeCount;
-    vkGetPhysicalDeviceSurfacePresentModesKHR(engine->physicalDevice, surface, &presentModeCount, NULL);
-    VkPresentModeKHR presentModes[presentModeCount];
-    vkGetPhysicalDeviceSurfacePresentModesKHR(engine->physicalDevice, surface, &presentModeCount, presentModes);
-
-    VkSurfaceCapabilitiesKHR surfCapabilities;
-    res = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(engine->physicalDevice, surface, &surfCapabilities);
-
-    VkExtent2D swapChainExtent;
-    // width and height are either both -1, or both not -1.
-    if (surfCapabilities.currentExtent.width == (uint32_t)-1) {
-        // If the surface size is undefined, the size is set to
-        // the size of the images requested.
-//        swapChainExtent.width = 800;
-//        swapChainExtent.height = 600;
-        LOGE("Swapchain size is (-1, -1)\n");
-        return -1;
-    } else {
-        // If the surface size is defined, the swap chain size must match
-        swapChainExtent = surfCapabilities.currentExtent;
-        LOGI("Swapchain size is (%d, %d)\n", swapChainExtent.width, swapChainExtent.height);
-        engine->width=swapChainExtent.width;
-        engine->height=swapChainExtent.height;
-    }
-
-    // If the format list includes just one entry of VK_FORMAT_UNDEFINED,
-    // the surface has no preferred format.  Otherwise, at least one
-    // supported format will be returned.
     VkFormat format;
-    if (formatCount == 1 && formats[0].format == VK_FORMAT_UNDEFINED) {
+    VkExtent2D swapChainExtent;
+    if (engine->headless) {
+        //Without a window render to offscreen images of the requested size.
         format = VK_FORMAT_R8G8B8A8_UNORM;
-    } else {
-        assert(formatCount >= 1);
-        format = formats[0].format;
-    }
-    LOGI("Using format %d\n", format);
-
-    uint32_t desiredNumberOfSwapChainImages = surfCapabilities.minImageCount + 1;
-    if ((surfCapabilities.maxImageCount > 0) &&
-        (desiredNumberOfSwapChainImages > surfCapabilities.maxImageCount)) {
-        // Application must settle for fewer images than desired:
-        desiredNumberOfSwapChainImages = surfCapabilities.maxImageCount;
-    }
-    LOGI("Asking for %d SwapChainImages\n", desiredNumberOfSwapChainImages);
-
-    VkSurfaceTransformFlagBitsKHR preTransform;
-    if (surfCapabilities.supportedTransforms &
-        VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR) {
-        preTransform = VK_SURFACE_TRANSFORM_IDENTITY_BIT_KHR;
-    } else {
-        preTransform = surfCapabilities.currentTransform;
+        swapChainExtent.width = engine->width;
+        swapChainExtent.height = engine->height;
     }
-    LOGI("Using preTransform %d\n", preTransform);
-
-    VkSwapchainCreateInfoKHR swapCreateInfo;
-    swapCreateInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
-    swapCreateInfo.pNext = NULL;
-    swapCreateInfo.surface = surface;
-    swapCreateInfo.minImageCount = desiredNumberOfSwapChainImages;
-    swapCreateInfo.imageFormat = format;
-    swapCreateInfo.imageExtent=swapChainExtent;
-    //swapCreateInfo.imageExtent.width = width; //Should match window size
-    //swapCreateInfo.imageExtent.height = height;
-    swapCreateInfo.preTransform = preTransform;
-    swapCreateInfo.compositeAlpha = VK_COMPOSITE_ALPHA_INHERIT_BIT_KHR;
-    swapCreateInfo.imageArrayLayers = 1;
-    swapCreateInfo.presentMode = VK_PRESENT_MODE_FIFO_KHR;
-    swapCreateInfo.oldSwapchain = VK_NULL_HANDLE;
-    swapCreateInfo.clipped = VK_TRUE;
-    swapCreateInfo.imageColorSpace = VK_COLORSPACE_SRGB_NONLINEAR_KHR;
-    swapCreateInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
-    swapCreateInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    swapCreateInfo.queueFamilyIndexCount = 0;
-    swapCreateInfo.pQueueFamilyIndices = NULL;
-
-    vkCreateSwapchainKHR(engine->vkDevice, &swapCreateInfo, NULL, &engine->swapchain);
-    if (res != VK_SUCCESS) {
-        LOGE ("vkCreateSwapchainKHR returned error.\n");
+    else if (createSwapchain(engine, surface, format, swapChainExtent) != 0)
         return -1;
-    }
-    LOGI("Swapchain created");
 
     //Setup Command buffers
     VkCommandPool commandPool;
@@ -551,9 +1169,16 @@ static int engine_init_display(struct engine* engine) {
     commandBufferAllocateInfo.pNext = NULL;
     commandBufferAllocateInfo.commandPool = commandPool;
     commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    commandBufferAllocateInfo.commandBufferCount = 3;
+    if (engine->framesInFlight<1)
+        engine->framesInFlight=1;
+    else if (engine->framesInFlight>MAX_FRAMES_IN_FLIGHT)
+        engine->framesInFlight=MAX_FRAMES_IN_FLIGHT;
+    LOGI("Using %d frames in flight", engine->framesInFlight);
+
+    //One setup command buffer and one render command buffer per frame in flight.
+    commandBufferAllocateInfo.commandBufferCount = 1 + engine->framesInFlight;
 
-    VkCommandBuffer commandBuffers[3];
+    VkCommandBuffer commandBuffers[1 + MAX_FRAMES_IN_FLIGHT];
     res = vkAllocateCommandBuffers(engine->vkDevice, &commandBufferAllocateInfo, commandBuffers);
     if (res != VK_SUCCESS) {
         LOGE ("vkAllocateCommandBuffers returned error.\n");
@@ -561,8 +1186,8 @@ static int engine_init_display(struct engine* engine) {
     }
 
     engine->setupCommandBuffer=commandBuffers[0];
-    engine->renderCommandBuffer[0]=commandBuffers[1];
-    engine->renderCommandBuffer[1]=commandBuffers[2];
+    for (int frame = 0; frame < engine->framesInFlight; frame++)
+        engine->renderCommandBuffer[frame]=commandBuffers[1 + frame];
 
     LOGI("Command buffers created");
 
@@ -580,12 +1205,18 @@ static int engine_init_display(struct engine* engine) {
 
     vkGetDeviceQueue(engine->vkDevice, deviceQueueCreateInfo.queueFamilyIndex, 0, &engine->queue);
 
-    vkGetSwapchainImagesKHR(engine->vkDevice, engine->swapchain, &engine->swapchainImageCount, NULL);
-    engine->swapChainImages = new VkImage[engine->swapchainImageCount];
-    res = vkGetSwapchainImagesKHR(engine->vkDevice, engine->swapchain, &engine->swapchainImageCount, engine->swapChainImages);
-    if (res != VK_SUCCESS) {
-        LOGE ("vkCreateSwapchainKHR returned error.\n");
-        return -1;
+    if (engine->headless) {
+        if (createOffscreenImages(engine, format, swapChainExtent) != 0)
+            return -1;
+    }
+    else {
+        vkGetSwapchainImagesKHR(engine->vkDevice, engine->swapchain, &engine->swapchainImageCount, NULL);
+        engine->swapChainImages = new VkImage[engine->swapchainImageCount];
+        res = vkGetSwapchainImagesKHR(engine->vkDevice, engine->swapchain, &engine->swapchainImageCount, engine->swapChainImages);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkCreateSwapchainKHR returned error.\n");
+            return -1;
+        }
     }
     printf ("swapchainImageCount %d.\n",engine->swapchainImageCount);
 
@@ -612,7 +1243,7 @@ static int engine_init_display(struct engine* engine) {
         VkImageMemoryBarrier imageMemoryBarrier;
         imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
         imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+        imageMemoryBarrier.newLayout = engine->headless ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
         imageMemoryBarrier.pNext = NULL;
         imageMemoryBarrier.image = engine->swapChainImages[i];
         imageMemoryBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -644,16 +1275,26 @@ static int engine_init_display(struct engine* engine) {
     }
     LOGI ("swapchainImageCount %d.\n", engine->swapchainImageCount);
 
-    //Setup the depth buffer:
-    const VkFormat depth_format = VK_FORMAT_D24_UNORM_S8_UINT;
+    //Setup the depth buffer, D24S8 is not available everywhere (e.g. some software implementations) so fall back to other depth formats:
+    const VkFormat depthFormats[] = {VK_FORMAT_D24_UNORM_S8_UINT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D32_SFLOAT, VK_FORMAT_D16_UNORM};
+    VkFormat depth_format = VK_FORMAT_UNDEFINED;
 
     VkImageCreateInfo imageCreateInfo;
     VkFormatProperties props;
-    vkGetPhysicalDeviceFormatProperties(engine->physicalDevice, depth_format, &props);
-    if (! (props.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT)) {
-        LOGE ("depth_format %d Unsupported.\n", depth_format);
+    for (int i = 0; i < 4 && depth_format == VK_FORMAT_UNDEFINED; i++) {
+        vkGetPhysicalDeviceFormatProperties(engine->physicalDevice, depthFormats[i], &props);
+        if (props.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT)
+            depth_format = depthFormats[i];
+    }
+    if (depth_format == VK_FORMAT_UNDEFINED) {
+        LOGE ("No supported depth format.\n");
         return -1;
     }
+    LOGI("Using depth format %d", depth_format);
+    engine->depthHasStencil = depth_format == VK_FORMAT_D24_UNORM_S8_UINT || depth_format == VK_FORMAT_D32_SFLOAT_S8_UINT;
+    VkImageAspectFlags depthAspects = VK_IMAGE_ASPECT_DEPTH_BIT;
+    if (engine->depthHasStencil)
+        depthAspects |= VK_IMAGE_ASPECT_STENCIL_BIT;
 
     imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     imageCreateInfo.pNext = NULL;
@@ -772,7 +1413,7 @@ static int engine_init_display(struct engine* engine) {
         imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
         imageMemoryBarrier.pNext = NULL;
         imageMemoryBarrier.image = engine->depthImage[i];
-        imageMemoryBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+        imageMemoryBarrier.subresourceRange.aspectMask = depthAspects;
         imageMemoryBarrier.subresourceRange.baseMipLevel = 0;
         imageMemoryBarrier.subresourceRange.levelCount = 1;
         imageMemoryBarrier.subresourceRange.baseArrayLayer = 0;
@@ -814,6 +1455,17 @@ static int engine_init_display(struct engine* engine) {
             LOGE ("vkCreateImageView returned error while creating depth buffer. %d\n", res);
             return -1;
         }
+
+        //Input attachments may only read the depth, the depth peel framebuffer needs the stencil too.
+        engine->depthAttachmentView[i] = engine->depthView[i];
+        if (engine->depthHasStencil) {
+            view_info.subresourceRange.aspectMask = depthAspects;
+            res = vkCreateImageView(engine->vkDevice, &view_info, NULL, &engine->depthAttachmentView[i]);
+            if (res != VK_SUCCESS) {
+                LOGE ("vkCreateImageView returned error while creating depth buffer. %d\n", res);
+                return -1;
+            }
+        }
     }
     LOGI("Depth buffers created");
 
@@ -964,6 +1616,8 @@ static int engine_init_display(struct engine* engine) {
         }
         LOGI("Peel image created");
     }
+    if (createAttachmentImage(engine, VK_FORMAT_R8_UNORM, swapChainExtent, &engine->transmittanceView) != 0)
+        return -1;
     res = vkEndCommandBuffer(engine->setupCommandBuffer);
     if (res != VK_SUCCESS) {
         LOGE ("vkEndCommandBuffer returned error %d.\n", res);
@@ -993,171 +1647,34 @@ static int engine_init_display(struct engine* engine) {
         return -1;
     }
 
-    engine->secondaryCommandBuffers=new VkCommandBuffer[engine->swapchainImageCount*(MAX_LAYERS*2+1)];
-    commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
-    commandBufferAllocateInfo.commandBufferCount = engine->swapchainImageCount*(MAX_LAYERS*2+1);
-
-    LOGI ("Creating %d secondary command buffers.\n", engine->swapchainImageCount*(MAX_LAYERS*2+1));
-    res = vkAllocateCommandBuffers(engine->vkDevice, &commandBufferAllocateInfo, engine->secondaryCommandBuffers);
-    if (res != VK_SUCCESS) {
-        LOGE ("vkAllocateCommandBuffers returned error.\n");
-        return -1;
-    }
-
-    //Setup the renderpass:
-    VkAttachmentDescription attachments[4];
-    attachments[0].format = format;
-    attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
-    attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-    attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    attachments[0].initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-    attachments[0].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-    attachments[0].flags = 0;
-    attachments[1].format = depth_format;
-    attachments[1].samples = VK_SAMPLE_COUNT_1_BIT;
-    attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    attachments[1].initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-    attachments[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-    attachments[1].flags = 0;
-    attachments[2].format = format;
-    attachments[2].samples = VK_SAMPLE_COUNT_1_BIT;
-    attachments[2].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    attachments[2].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    attachments[2].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    attachments[2].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    attachments[2].initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-    attachments[2].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-    attachments[2].flags = 0;
-    attachments[3].format = depth_format;
-    attachments[3].samples = VK_SAMPLE_COUNT_1_BIT;
-    attachments[3].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    attachments[3].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    attachments[3].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    attachments[3].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    attachments[3].initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-    attachments[3].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-    attachments[3].flags = 0;
-
-    VkAttachmentReference color_reference;
-    color_reference.attachment = 0;
-    color_reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-
-    VkAttachmentReference depth_attachment_reference[2];
-    depth_attachment_reference[0].attachment = 1;
-    depth_attachment_reference[0].layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-    depth_attachment_reference[1].attachment = 3;
-    depth_attachment_reference[1].layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
-    VkAttachmentReference depth_inputattachment_reference[2];
-    depth_inputattachment_reference[0].attachment = 1;
-    depth_inputattachment_reference[0].layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-    depth_inputattachment_reference[1].attachment = 3;
-    depth_inputattachment_reference[1].layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-    VkAttachmentReference peelcolor_attachment_reference;
-    peelcolor_attachment_reference.attachment = 2;
-    peelcolor_attachment_reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
-    VkAttachmentReference peelcolor_inputattachment_reference;
-    peelcolor_inputattachment_reference.attachment = 2;
-    peelcolor_inputattachment_reference.layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-
-    uint32_t colour_attachment = 0;
-    uint32_t depth_attachment[2] = {1, 3};
-    uint32_t peel_attachment = 2;
-
-    uint subpassCount = MAX_LAYERS*2+1;
-    uint subpassDependencyCount=(subpassCount*(subpassCount-1))/2;
-    VkSubpassDependency subpassDependencies[subpassDependencyCount];
-    VkSubpassDescription subpasses[subpassCount];
-    subpasses[0].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-    subpasses[0].flags = 0;
-    subpasses[0].inputAttachmentCount = 0;
-    subpasses[0].pInputAttachments = NULL;
-    subpasses[0].colorAttachmentCount = 1;
-    subpasses[0].pColorAttachments = &color_reference;
-    subpasses[0].pResolveAttachments = NULL;
-    subpasses[0].pDepthStencilAttachment = &depth_attachment_reference[0];
-    subpasses[0].preserveAttachmentCount = 2;
-    uint32_t PreserveAttachments[2] = {peel_attachment, depth_attachment[1]};
-    subpasses[0].pPreserveAttachments = PreserveAttachments;
-
-    for (int i =0; i<MAX_LAYERS; i++)
-    {
-
-        uint32_t *PreserveAttachments = new uint32_t[2];  //This will leak
-        subpasses[i * 2 + 1].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-        subpasses[i * 2 + 1].flags = 0;
-        subpasses[i * 2 + 1].inputAttachmentCount = (i==0) ? 0 : 1;
-        subpasses[i * 2 + 1].pInputAttachments = &depth_inputattachment_reference[!(i%2)];
-        subpasses[i * 2 + 1].colorAttachmentCount = 1;
-        subpasses[i * 2 + 1].pColorAttachments = &peelcolor_attachment_reference;
-        subpasses[i * 2 + 1].pResolveAttachments = NULL;
-        subpasses[i * 2 + 1].pDepthStencilAttachment = &depth_attachment_reference[i%2];
-        subpasses[i * 2 + 1].preserveAttachmentCount = (i==0) ? 2 : 1;
-        PreserveAttachments[0] = colour_attachment;
-        PreserveAttachments[1] = depth_attachment[!(i%2)];
-        subpasses[i * 2 + 1].pPreserveAttachments = PreserveAttachments;
-
-        subpasses[i * 2 + 2].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-        subpasses[i * 2 + 2].flags = 0;
-        subpasses[i * 2 + 2].inputAttachmentCount = 1;
-        subpasses[i * 2 + 2].pInputAttachments = &peelcolor_inputattachment_reference;
-        subpasses[i * 2 + 2].colorAttachmentCount = 1;
-        subpasses[i * 2 + 2].pColorAttachments = &color_reference;
-        subpasses[i * 2 + 2].pResolveAttachments = NULL;
-        subpasses[i * 2 + 2].pDepthStencilAttachment = NULL;
-        subpasses[i * 2 + 2].preserveAttachmentCount = 3;
-        PreserveAttachments = new uint32_t[3];  //This will leak
-        PreserveAttachments[0] = peel_attachment;
-        PreserveAttachments[1] = depth_attachment[0];
-        PreserveAttachments[2] = depth_attachment[1];
-        subpasses[i * 2 + 2].pPreserveAttachments = PreserveAttachments;
-        LOGI("peel %d subpasses %d and %d pDepthStencilAttachment %d pInputAttachments %d", i, i * 2 + 1, i * 2 + 2, i%2, !(i%2));
-    }
-
-    //For simplisity every subpass will depend on all subpasses before it in the same way:
-    int subpassDependencyIndex=0;
-    for (int subpass=1; subpass<subpassCount; subpass++)
-    {
-        for (int dependantSubpass=0; dependantSubpass<subpass; dependantSubpass++)
-        {
-//            LOGI("Creating subpassDependency %d srcSubpass=%d dstSubpass=%d", subpassDependencyIndex, dependantSubpass, subpass);
-            subpassDependencies[subpassDependencyIndex].srcSubpass = dependantSubpass;
-            subpassDependencies[subpassDependencyIndex].dstSubpass = subpass;
-//            subpassDependencies[subpassDependencyIndex].dstSubpass = (subpass<subpassCount) ? subpass : VK_SUBPASS_EXTERNAL;
-            subpassDependencies[subpassDependencyIndex].srcStageMask = VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT;
-            subpassDependencies[subpassDependencyIndex].dstStageMask = VK_PIPELINE_STAGE_ALL_GRAPHICS_BIT;
-            subpassDependencies[subpassDependencyIndex].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
-            subpassDependencies[subpassDependencyIndex].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
-            subpassDependencies[subpassDependencyIndex].dependencyFlags = 0;
-            subpassDependencyIndex++;
+    //Each frame in flight has its own set of secondary buffers bound to its own uniform slot, used with every
+    //swapchain image. They are allocated from the record pools as they are recorded.
+    engine->secondaryCommandBuffers=new VkCommandBuffer[engine->framesInFlight*SECONDARY_BUFFERS_PER_FRAME];
+    engine->recordPoolCount = engine->workerPool->threadCount();
+    engine->recordPools = new RecordPool[engine->recordPoolCount];
+    commandPoolCreateInfo.flags = 0; //Only ever reset as a whole.
+    for (i = 0; i < (uint32_t)engine->recordPoolCount; i++) {
+        res = vkCreateCommandPool(engine->vkDevice, &commandPoolCreateInfo, NULL, &engine->recordPools[i].commandPool);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkCreateCommandPool returned error.\n");
+            return -1;
         }
+        //A single thread may end up recording every buffer.
+        engine->recordPools[i].commandBuffers = new VkCommandBuffer[engine->framesInFlight*SECONDARY_BUFFERS_PER_FRAME];
+        engine->recordPools[i].allocated = 0;
+        engine->recordPools[i].used = 0;
     }
-    assert(subpassDependencyIndex==subpassDependencyCount);
-
-    LOGI("Creating renderpass %d subpasses %d subpassDependencies", subpassCount, subpassDependencyCount);
-    VkRenderPassCreateInfo rp_info;
-    rp_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-    rp_info.pNext = NULL;
-    rp_info.flags=0;
-    rp_info.attachmentCount = 4;
-    rp_info.pAttachments = attachments;
-    rp_info.subpassCount = subpassCount;
-    rp_info.pSubpasses = subpasses;
-    rp_info.dependencyCount = subpassDependencyCount;
-    rp_info.pDependencies = subpassDependencies;
-    res = vkCreateRenderPass(engine->vkDevice, &rp_info, NULL, &engine->renderPass);
-    if (res != VK_SUCCESS) {
-        LOGE ("vkCreateRenderPass returned error. %d\n", res);
-        return -1;
+    LOGI ("Created %d secondary command pools.\n", engine->recordPoolCount);
+
+    engine->colourFormat = format;
+    engine->depthFormat = depth_format;
+    for (i = 0; i <= MAX_LAYERS; i++) {
+        engine->layerRenderPasses[i] = VK_NULL_HANDLE;
+        engine->layerPipelines[i].created = false;
+        for (int pipeline = 0; pipeline < DEPTH_PEEL_PIPELINE_COUNT; pipeline++)
+            engine->layerPipelines[i].pipelines[pipeline] = VK_NULL_HANDLE;
     }
 
-    LOGI("Renderpass created");
-
     vkGetPhysicalDeviceProperties(engine->physicalDevice, &engine->deviceProperties);
     if (res != VK_SUCCESS) {
         printf ("vkGetPhysicalDeviceProperties returned error %d.\n", res);
@@ -1197,6 +1714,50 @@ static int engine_init_display(struct engine* engine) {
         return -1;
     }
 
+    //The instanced layouts replace the per box model set with the instance storage buffer.
+    VkDescriptorSetLayout instancedSetLayouts[3];
+    instancedSetLayouts[0] = engine->instanceDescriptorSetLayout;
+    instancedSetLayouts[1] = engine->descriptorSetLayouts[1];
+    instancedSetLayouts[2] = engine->descriptorSetLayouts[2];
+
+    pPipelineLayoutCreateInfo.setLayoutCount = 2;
+    pPipelineLayoutCreateInfo.pSetLayouts = instancedSetLayouts;
+
+    res = vkCreatePipelineLayout(engine->vkDevice, &pPipelineLayoutCreateInfo, NULL, &engine->instancedPipelineLayout);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreatePipelineLayout returned error.\n");
+        return -1;
+    }
+
+    pPipelineLayoutCreateInfo.setLayoutCount = 3;
+    res = vkCreatePipelineLayout(engine->vkDevice, &pPipelineLayoutCreateInfo, NULL, &engine->instancedBlendPeelPipelineLayout);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreatePipelineLayout returned error.\n");
+        return -1;
+    }
+
+    //The dynamic offset layouts use a single dynamic uniform buffer for every box's model matrix.
+    VkDescriptorSetLayout dynamicSetLayouts[3];
+    dynamicSetLayouts[0] = engine->dynamicModelDescriptorSetLayout;
+    dynamicSetLayouts[1] = engine->descriptorSetLayouts[1];
+    dynamicSetLayouts[2] = engine->descriptorSetLayouts[2];
+
+    pPipelineLayoutCreateInfo.setLayoutCount = 2;
+    pPipelineLayoutCreateInfo.pSetLayouts = dynamicSetLayouts;
+
+    res = vkCreatePipelineLayout(engine->vkDevice, &pPipelineLayoutCreateInfo, NULL, &engine->dynamicPipelineLayout);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreatePipelineLayout returned error.\n");
+        return -1;
+    }
+
+    pPipelineLayoutCreateInfo.setLayoutCount = 3;
+    res = vkCreatePipelineLayout(engine->vkDevice, &pPipelineLayoutCreateInfo, NULL, &engine->dynamicBlendPeelPipelineLayout);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreatePipelineLayout returned error.\n");
+        return -1;
+    }
+
     LOGI("Pipeline layout created");
 
     //load shaders
@@ -1285,58 +1846,54 @@ static int engine_init_display(struct engine* engine) {
             return -1;
         }
     }
+    {
+        //The instanced vertex shader is optional, without it only the per box draw modes are available.
+        int loaded = loadShaderModule(engine, "shaders/instanced.vert.spv", &engine->instancedVertexShaderModule);
+        if (loaded < 0)
+            return -1;
+        engine->instancingSupported = loaded == 0;
+        if (!engine->instancingSupported)
+            LOGW ("Instanced vertex shader not found, instanced draw mode disabled.\n");
+        if (engine->cpuCulling && !engine->instancingSupported)
+            engine->cpuCulling = false;
+        else if (engine->cpuCulling)
+            engine->drawMode = DRAW_MODE_INSTANCED;
+        if (!engine->instancingSupported && engine->drawMode == DRAW_MODE_INSTANCED)
+            engine->drawMode = DRAW_MODE_DESCRIPTOR_SETS;
+    }
+    if (engine->drawMode == DRAW_MODE_DESCRIPTOR_SETS && setupModelDescriptorSets(engine) != 0)
+        return -1;
     LOGI("Shaders Loaded");
 
-    //Create the framebuffers
-    engine->framebuffers=new VkFramebuffer[engine->swapchainImageCount];
+    //Create the renderpass and framebuffers for the starting layer count, others are created when first used.
+    if (selectLayerRenderPass(engine, engine->layerCount) != 0)
+        return -1;
 
-    for (i = 0; i < engine->swapchainImageCount; i++) {
+    if (setupDualPeel(engine, format, depth_format, swapChainExtent) != 0)
+        return -1;
+    if (setupWeightedBlended(engine, format, depth_format, swapChainExtent) != 0)
+        return -1;
+    if (setupABuffer(engine, format, depth_format, swapChainExtent) != 0)
+        return -1;
+    if (setupSaturationTermination(engine, depth_format) != 0)
+        return -1;
 
-        VkImageView imageViewAttachments[4];
+    //Create Vertex buffers:
+    VkBufferCreateInfo vertexBufferCreateInfo;
+    vertexBufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    vertexBufferCreateInfo.pNext = NULL;
+    vertexBufferCreateInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+    vertexBufferCreateInfo.size = sizeof(vertexData);
+    vertexBufferCreateInfo.queueFamilyIndexCount = 0;
+    vertexBufferCreateInfo.pQueueFamilyIndices = NULL;
+    vertexBufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    vertexBufferCreateInfo.flags = 0;
 
-        //Attach the correct swapchain colourbuffer
-        imageViewAttachments[0] = engine->swapChainViews[i];
-        //We only have one depth buffer which we attach to all framebuffers
-        imageViewAttachments[1] = engine->depthView[0];
-        imageViewAttachments[2] = engine->peelView;
-        imageViewAttachments[3] = engine->depthView[1];
-
-        VkFramebufferCreateInfo fb_info;
-        fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        fb_info.pNext = NULL;
-        fb_info.renderPass = engine->renderPass;
-        fb_info.attachmentCount = 4;
-        fb_info.pAttachments = imageViewAttachments;
-        fb_info.width = swapChainExtent.width;
-        fb_info.height = swapChainExtent.height;
-        fb_info.layers = 1;
-        fb_info.flags = 0;
-
-        res = vkCreateFramebuffer(engine->vkDevice, &fb_info, NULL, &engine->framebuffers[i]);
-        if (res != VK_SUCCESS) {
-            LOGE ("vkCreateFramebuffer returned error %d.\n", res);
-            return -1;
-        }
-    }
-
-    LOGI("%d framebuffers created", engine->swapchainImageCount);
-
-    //Create Vertex buffers:
-    VkBufferCreateInfo vertexBufferCreateInfo;
-    vertexBufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    vertexBufferCreateInfo.pNext = NULL;
-    vertexBufferCreateInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-    vertexBufferCreateInfo.size = sizeof(vertexData);
-    vertexBufferCreateInfo.queueFamilyIndexCount = 0;
-    vertexBufferCreateInfo.pQueueFamilyIndices = NULL;
-    vertexBufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    vertexBufferCreateInfo.flags = 0;
-
-    res = vkCreateBuffer(engine->vkDevice, &vertexBufferCreateInfo, NULL, &engine->vertexBuffer);
-    if (res != VK_SUCCESS) {
-        LOGE ("vkCreateBuffer returned error %d.\n", res);
-        return -1;
-    }
+    res = vkCreateBuffer(engine->vkDevice, &vertexBufferCreateInfo, NULL, &engine->vertexBuffer);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateBuffer returned error %d.\n", res);
+        return -1;
+    }
 
     found = 0;
     vkGetBufferMemoryRequirements(engine->vkDevice, engine->vertexBuffer, &memoryRequirements);
@@ -1401,21 +1958,43 @@ static int engine_init_display(struct engine* engine) {
     engine->vertexInputAttributeDescription[1].format = VK_FORMAT_R32G32B32A32_SFLOAT;
     engine->vertexInputAttributeDescription[1].offset = 16;
 
-    setupTraditionalBlendPipeline(engine);
-    setupPeelPipeline(engine);
-    setupBlendPipeline(engine);
+    setupPipelineCache(engine);
+    setupGpuSimulation(engine);
+    setupGpuCulling(engine);
+    setupPipelines(engine);
 
-    VkSemaphoreCreateInfo presentCompleteSemaphoreCreateInfo;
-    presentCompleteSemaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-    presentCompleteSemaphoreCreateInfo.pNext = NULL;
-    presentCompleteSemaphoreCreateInfo.flags = 0;
+    VkSemaphoreCreateInfo semaphoreCreateInfo;
+    semaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreCreateInfo.pNext = NULL;
+    semaphoreCreateInfo.flags = 0;
 
-    res = vkCreateSemaphore(engine->vkDevice, &presentCompleteSemaphoreCreateInfo, NULL, &engine->presentCompleteSemaphore);
-    if (res != VK_SUCCESS) {
-        printf ("vkCreateSemaphore returned error.\n");
-        return -1;
+    //Fences start signalled so the first wait on each frame slot returns immediately.
+    VkFenceCreateInfo fenceCreateInfo;
+    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fenceCreateInfo.pNext = NULL;
+    fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
+    for (int frame = 0; frame < engine->framesInFlight; frame++) {
+        res = vkCreateSemaphore(engine->vkDevice, &semaphoreCreateInfo, NULL, &engine->imageAcquiredSemaphores[frame]);
+        if (res != VK_SUCCESS) {
+            printf ("vkCreateSemaphore returned error.\n");
+            return -1;
+        }
+        res = vkCreateSemaphore(engine->vkDevice, &semaphoreCreateInfo, NULL, &engine->renderCompleteSemaphores[frame]);
+        if (res != VK_SUCCESS) {
+            printf ("vkCreateSemaphore returned error.\n");
+            return -1;
+        }
+        res = vkCreateFence(engine->vkDevice, &fenceCreateInfo, NULL, &engine->frameFences[frame]);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkCreateFence returned error %d.\n", res);
+            return -1;
+        }
     }
 
+    setupTimestampQueries(engine);
+    if (setupLayerQueries(engine) != 0)
+        return -1;
     createSecondaryBuffers(engine);
 
     engine->vulkanSetupOK=true;
@@ -1435,10 +2014,11 @@ static int engine_init_display(struct engine* engine) {
     return 0;
 }
 
-int setupTraditionalBlendPipeline(struct engine* engine)
+//Creates the traditional blend pipeline used by one draw mode.
+int setupTraditionalBlendPipeline(struct engine* engine, int drawMode)
 {
 
-    LOGI("Setting up trad blend pipeline");
+    LOGI("Setting up trad blend pipeline (%s)", drawModeNames[drawMode]);
 
     VkRect2D scissor;
     scissor.extent.width = engine->width / 2;
@@ -1600,8 +2180,24 @@ int setupTraditionalBlendPipeline(struct engine* engine)
     pipelineInfo.renderPass = engine->renderPass;
     pipelineInfo.subpass = 0;
 
+    //Each draw mode has its own vertex shader input and pipeline layout.
+    VkPipeline *pipeline;
+    switch (drawMode) {
+        case DRAW_MODE_INSTANCED:
+            shaderStages[0].module = engine->instancedVertexShaderModule;
+            pipelineInfo.layout = engine->instancedPipelineLayout;
+            pipeline = &engine->instancedTraditionalBlendPipeline;
+            break;
+        case DRAW_MODE_DYNAMIC_OFFSETS:
+            pipelineInfo.layout = engine->dynamicPipelineLayout;
+            pipeline = &engine->dynamicTraditionalBlendPipeline;
+            break;
+        default:
+            pipeline = &engine->traditionalBlendPipeline;
+    }
+
     VkResult res;
-    res = vkCreateGraphicsPipelines(engine->vkDevice, VK_NULL_HANDLE, 1, &pipelineInfo, NULL, &engine->traditionalBlendPipeline);
+    res = vkCreateGraphicsPipelines(engine->vkDevice, engine->pipelineCache, 1, &pipelineInfo, NULL, pipeline);
     if (res != VK_SUCCESS) {
         LOGE ("vkCreateGraphicsPipelines returned error %d.\n", res);
         return -1;
@@ -1610,9 +2206,11 @@ int setupTraditionalBlendPipeline(struct engine* engine)
 }
 
 
-int setupPeelPipeline(struct engine* engine) {
+//Creates a peel pipeline used by one draw mode. The first peel has no earlier layer to test against so it
+//uses the traditional fragment shader and doesn't need the input attachment set.
+int setupPeelPipeline(struct engine* engine, int drawMode, bool firstPeel) {
 
-    LOGI("Setting up peel pipeline");
+    LOGI("Setting up %speel pipeline (%s)", firstPeel ? "first " : "", drawModeNames[drawMode]);
 
     VkViewport viewport;
     viewport.height = (float) engine->height;
@@ -1710,6 +2308,13 @@ int setupPeelPipeline(struct engine* engine) {
     ds.minDepthBounds = 0;
     ds.maxDepthBounds = 1;
     ds.stencilTestEnable = VK_FALSE;
+    //Later peels skip the pixels saturation termination marked. The compare mask is zero, so the test always
+    //passes, unless the mode is on.
+    if (!firstPeel) {
+        ds.stencilTestEnable = VK_TRUE;
+        ds.back.compareOp = VK_COMPARE_OP_EQUAL;
+        dynamicStateEnables[dynamicState.dynamicStateCount++] = VK_DYNAMIC_STATE_STENCIL_COMPARE_MASK;
+    }
     ds.front = ds.back;
 
     VkPipelineMultisampleStateCreateInfo ms;
@@ -1778,33 +2383,42 @@ int setupPeelPipeline(struct engine* engine) {
     pipelineInfo.renderPass = engine->renderPass;
     pipelineInfo.subpass = 3;
 
-    LOGI("Creating peel pipeline");
-    VkResult res;
-    res = vkCreateGraphicsPipelines(engine->vkDevice, VK_NULL_HANDLE, 1, &pipelineInfo, NULL,
-                                    &engine->peelPipeline);
-    if (res != VK_SUCCESS) {
-        LOGE("vkCreateGraphicsPipelines returned error %d.\n", res);
-        return -1;
+    if (firstPeel) {
+        pipelineInfo.layout = engine->pipelineLayout;
+        pipelineInfo.pStages = firstPeelShaderStages;
+        pipelineInfo.subpass = 1;
     }
 
-    LOGI("Creating first peel pipeline");
-    pipelineInfo.layout = engine->pipelineLayout;
-    pipelineInfo.pStages = firstPeelShaderStages;
-    pipelineInfo.subpass = 1;
+    VkPipeline *pipeline;
+    switch (drawMode) {
+        case DRAW_MODE_INSTANCED:
+            peelShaderStages[0].module = engine->instancedVertexShaderModule;
+            firstPeelShaderStages[0].module = engine->instancedVertexShaderModule;
+            pipelineInfo.layout = firstPeel ? engine->instancedPipelineLayout : engine->instancedBlendPeelPipelineLayout;
+            pipeline = firstPeel ? &engine->instancedFirstPeelPipeline : &engine->instancedPeelPipeline;
+            break;
+        case DRAW_MODE_DYNAMIC_OFFSETS:
+            pipelineInfo.layout = firstPeel ? engine->dynamicPipelineLayout : engine->dynamicBlendPeelPipelineLayout;
+            pipeline = firstPeel ? &engine->dynamicFirstPeelPipeline : &engine->dynamicPeelPipeline;
+            break;
+        default:
+            pipeline = firstPeel ? &engine->firstPeelPipeline : &engine->peelPipeline;
+    }
 
-    res = vkCreateGraphicsPipelines(engine->vkDevice, VK_NULL_HANDLE, 1, &pipelineInfo, NULL,
-                                    &engine->firstPeelPipeline);
+    VkResult res;
+    res = vkCreateGraphicsPipelines(engine->vkDevice, engine->pipelineCache, 1, &pipelineInfo, NULL, pipeline);
     if (res != VK_SUCCESS) {
         LOGE("vkCreateGraphicsPipelines returned error %d.\n", res);
         return -1;
     }
-
     return 0;
 }
 
-int setupBlendPipeline(struct engine* engine) {
+//With writeTransmittance the pipeline for saturation termination is created, its shader also outputs the layer's
+//alpha to multiply the transmittance attachment by one minus it.
+int setupBlendPipeline(struct engine* engine, bool writeTransmittance) {
 
-    LOGI("Setting up blend pipeline");
+    LOGI("Setting up %sblend pipeline", writeTransmittance ? "transmittance " : "");
     VkViewport viewport;
     viewport.height = (float) engine->height;
     viewport.width = (float) engine->width;
@@ -1859,7 +2473,7 @@ int setupBlendPipeline(struct engine* engine) {
     cb.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
     cb.flags = 0;
     cb.pNext = NULL;
-    VkPipelineColorBlendAttachmentState att_state[1];
+    VkPipelineColorBlendAttachmentState att_state[2];
     att_state[0].colorWriteMask = 0xf;
     att_state[0].blendEnable = VK_TRUE;
     att_state[0].alphaBlendOp = VK_BLEND_OP_ADD;
@@ -1868,7 +2482,16 @@ int setupBlendPipeline(struct engine* engine) {
     att_state[0].dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
     att_state[0].srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
     att_state[0].dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
-    cb.attachmentCount = 1;
+    //The transmittance is only written when saturation termination needs it.
+    att_state[1].colorWriteMask = writeTransmittance ? VK_COLOR_COMPONENT_R_BIT : 0;
+    att_state[1].blendEnable = VK_TRUE;
+    att_state[1].alphaBlendOp = VK_BLEND_OP_ADD;
+    att_state[1].colorBlendOp = VK_BLEND_OP_ADD;
+    att_state[1].srcColorBlendFactor = VK_BLEND_FACTOR_ZERO;
+    att_state[1].dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    att_state[1].srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+    att_state[1].dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    cb.attachmentCount = 2;
     cb.pAttachments = att_state;
     cb.logicOpEnable = VK_FALSE;
     cb.logicOp = VK_LOGIC_OP_NO_OP;
@@ -1934,7 +2557,7 @@ int setupBlendPipeline(struct engine* engine) {
     shaderStages[1].flags = 0;
     shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
     shaderStages[1].pName = "main";
-    shaderStages[1].module = engine->shdermodules[5];
+    shaderStages[1].module = writeTransmittance ? engine->saturationShaderModules[1] : engine->shdermodules[5];
 
     VkGraphicsPipelineCreateInfo pipelineInfo;
     pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
@@ -1960,8 +2583,8 @@ int setupBlendPipeline(struct engine* engine) {
     pipelineInfo.subpass = 2;
 
     VkResult res;
-    res = vkCreateGraphicsPipelines(engine->vkDevice, VK_NULL_HANDLE, 1, &pipelineInfo, NULL,
-                                    &engine->blendPipeline);
+    res = vkCreateGraphicsPipelines(engine->vkDevice, engine->pipelineCache, 1, &pipelineInfo, NULL,
+                                    writeTransmittance ? &engine->saturationBlendPipeline : &engine->blendPipeline);
     if (res != VK_SUCCESS) {
         LOGE("vkCreateGraphicsPipelines returned error %d.\n", res);
         return -1;
@@ -1969,111 +2592,3385 @@ int setupBlendPipeline(struct engine* engine) {
     return 0;
 }
 
-int setupUniforms(struct engine* engine)
+//Appends a by region dependency to a render pass's dependency list.
+void addSubpassDependency(VkSubpassDependency *dependencies, uint32_t &count, uint32_t srcSubpass, uint32_t dstSubpass,
+                          VkPipelineStageFlags srcStageMask, VkAccessFlags srcAccessMask,
+                          VkPipelineStageFlags dstStageMask, VkAccessFlags dstAccessMask)
+{
+    dependencies[count].srcSubpass = srcSubpass;
+    dependencies[count].dstSubpass = dstSubpass;
+    dependencies[count].srcStageMask = srcStageMask;
+    dependencies[count].dstStageMask = dstStageMask;
+    dependencies[count].srcAccessMask = srcAccessMask;
+    dependencies[count].dstAccessMask = dstAccessMask;
+    dependencies[count].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+    count++;
+}
+
+//Creates the depth peel render pass for layers layers and its framebuffers: the traditional blend subpass then a
+//peel and a blend subpass per layer. Each subpass only depends on the subpasses that last wrote (or read, where it
+//overwrites) the attachments it uses. Every read is of an input attachment so all the dependencies are by region.
+int createLayerRenderPass(struct engine* engine, int layers)
 {
     VkResult res;
+    VkAttachmentDescription attachments[5];
+    attachments[0].format = engine->colourFormat;
+    attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
+    attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[0].initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attachments[0].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attachments[0].flags = 0;
+    attachments[1].format = engine->depthFormat;
+    attachments[1].samples = VK_SAMPLE_COUNT_1_BIT;
+    attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[1].initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    attachments[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    attachments[1].flags = 0;
+    attachments[2].format = engine->colourFormat;
+    attachments[2].samples = VK_SAMPLE_COUNT_1_BIT;
+    attachments[2].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[2].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[2].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[2].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[2].initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attachments[2].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attachments[2].flags = 0;
+    attachments[3] = attachments[1];
+    //The transmittance starts at one and is multiplied down by each blend subpass.
+    attachments[4].format = VK_FORMAT_R8_UNORM;
+    attachments[4].samples = VK_SAMPLE_COUNT_1_BIT;
+    attachments[4].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachments[4].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[4].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[4].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[4].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    attachments[4].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attachments[4].flags = 0;
 
-    //Create a descriptor pool
-    VkDescriptorPoolSize typeCounts[2];
-    typeCounts[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    typeCounts[0].descriptorCount = MAX_BOXES+3;
-    typeCounts[1].type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
-    typeCounts[1].descriptorCount = 3;
+    VkAttachmentReference color_reference;
+    color_reference.attachment = 0;
+    color_reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    //The blend subpasses write the colour and the transmittance.
+    VkAttachmentReference blend_color_references[2];
+    blend_color_references[0] = color_reference;
+    blend_color_references[1].attachment = 4;
+    blend_color_references[1].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
-    VkDescriptorPoolCreateInfo descriptorPoolInfo;
-    descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    descriptorPoolInfo.flags = 0;
-    descriptorPoolInfo.pNext = NULL;
-    descriptorPoolInfo.maxSets = MAX_BOXES+6;
-    descriptorPoolInfo.poolSizeCount = 2;
-    descriptorPoolInfo.pPoolSizes = typeCounts;
+    VkAttachmentReference depth_attachment_reference[2];
+    depth_attachment_reference[0].attachment = 1;
+    depth_attachment_reference[0].layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth_attachment_reference[1].attachment = 3;
+    depth_attachment_reference[1].layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    //Peels after the first read the previous peel's depth and the transmittance.
+    VkAttachmentReference peel_inputattachment_references[2][2];
+    for (int i = 0; i < 2; i++) {
+        peel_inputattachment_references[i][0].attachment = depth_attachment_reference[i].attachment;
+        peel_inputattachment_references[i][0].layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        peel_inputattachment_references[i][1].attachment = 4;
+        peel_inputattachment_references[i][1].layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    }
 
-    VkDescriptorPool descriptorPool;
-    res = vkCreateDescriptorPool(engine->vkDevice, &descriptorPoolInfo, NULL, &descriptorPool);
+    VkAttachmentReference peelcolor_attachment_reference;
+    peelcolor_attachment_reference.attachment = 2;
+    peelcolor_attachment_reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    VkAttachmentReference peelcolor_inputattachment_reference;
+    peelcolor_inputattachment_reference.attachment = 2;
+    peelcolor_inputattachment_reference.layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    uint32_t colour_attachment = 0;
+    uint32_t depth_attachment[2] = {1, 3};
+    uint32_t peel_attachment = 2;
+
+    uint32_t subpassCount = layers*2+1;
+    VkSubpassDescription subpasses[MAX_LAYERS*2+1];
+    subpasses[0].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpasses[0].flags = 0;
+    subpasses[0].inputAttachmentCount = 0;
+    subpasses[0].pInputAttachments = NULL;
+    subpasses[0].colorAttachmentCount = 1;
+    subpasses[0].pColorAttachments = &color_reference;
+    subpasses[0].pResolveAttachments = NULL;
+    subpasses[0].pDepthStencilAttachment = &depth_attachment_reference[0];
+    subpasses[0].preserveAttachmentCount = 2;
+    uint32_t tradPreserveAttachments[2] = {peel_attachment, depth_attachment[1]};
+    subpasses[0].pPreserveAttachments = tradPreserveAttachments;
+
+    uint32_t peelPreserveAttachments[2][2];
+    uint32_t blendPreserveAttachments[3] = {peel_attachment, depth_attachment[0], depth_attachment[1]};
+    for (int i = 0; i < 2; i++) {
+        peelPreserveAttachments[i][0] = colour_attachment;
+        peelPreserveAttachments[i][1] = depth_attachment[!i];
+    }
+    for (int i = 0; i < layers; i++)
+    {
+        subpasses[i * 2 + 1].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+        subpasses[i * 2 + 1].flags = 0;
+        subpasses[i * 2 + 1].inputAttachmentCount = (i==0) ? 0 : 2;
+        subpasses[i * 2 + 1].pInputAttachments = peel_inputattachment_references[!(i%2)];
+        subpasses[i * 2 + 1].colorAttachmentCount = 1;
+        subpasses[i * 2 + 1].pColorAttachments = &peelcolor_attachment_reference;
+        subpasses[i * 2 + 1].pResolveAttachments = NULL;
+        subpasses[i * 2 + 1].pDepthStencilAttachment = &depth_attachment_reference[i%2];
+        subpasses[i * 2 + 1].preserveAttachmentCount = (i==0) ? 2 : 1;
+        subpasses[i * 2 + 1].pPreserveAttachments = peelPreserveAttachments[i%2];
+
+        subpasses[i * 2 + 2].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+        subpasses[i * 2 + 2].flags = 0;
+        subpasses[i * 2 + 2].inputAttachmentCount = 1;
+        subpasses[i * 2 + 2].pInputAttachments = &peelcolor_inputattachment_reference;
+        subpasses[i * 2 + 2].colorAttachmentCount = 2;
+        subpasses[i * 2 + 2].pColorAttachments = blend_color_references;
+        subpasses[i * 2 + 2].pResolveAttachments = NULL;
+        subpasses[i * 2 + 2].pDepthStencilAttachment = NULL;
+        subpasses[i * 2 + 2].preserveAttachmentCount = 3;
+        subpasses[i * 2 + 2].pPreserveAttachments = blendPreserveAttachments;
+    }
+
+    const VkPipelineStageFlags depthStages = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    const VkPipelineStageFlags colourStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    const VkPipelineStageFlags inputStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    const VkAccessFlags depthAccess = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    const VkAccessFlags colourAccess = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    VkSubpassDependency subpassDependencies[MAX_LAYERS*5];
+    uint32_t subpassDependencyCount = 0;
+    //The first peel reuses the traditional blend's depth buffer and the first blend blends over its colour.
+    addSubpassDependency(subpassDependencies, subpassDependencyCount, 0, 1,
+                         depthStages, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, depthStages, depthAccess);
+    addSubpassDependency(subpassDependencies, subpassDependencyCount, 0, 2,
+                         colourStage, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, colourStage, colourAccess);
+    for (int i = 0; i < layers; i++) {
+        uint32_t peel = i*2+1;
+        uint32_t blend = i*2+2;
+        //The blend reads the peeled colour, then writes the transmittance the peel may have read.
+        addSubpassDependency(subpassDependencies, subpassDependencyCount, peel, blend,
+                             colourStage | inputStage, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                             inputStage | colourStage, VK_ACCESS_INPUT_ATTACHMENT_READ_BIT | colourAccess);
+        if (i == 0)
+            continue;
+        //The peel overwrites the peel colour the last blend read and reads the transmittance it wrote.
+        addSubpassDependency(subpassDependencies, subpassDependencyCount, blend-2, peel,
+                             inputStage | colourStage, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                             inputStage | colourStage, VK_ACCESS_INPUT_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+        //It reads the last peel's depth and overwrites the depth buffer the last peel read.
+        addSubpassDependency(subpassDependencies, subpassDependencyCount, peel-2, peel,
+                             depthStages | inputStage, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+                             inputStage | depthStages, VK_ACCESS_INPUT_ATTACHMENT_READ_BIT | depthAccess);
+        //Blends accumulate in order.
+        addSubpassDependency(subpassDependencies, subpassDependencyCount, blend-2, blend,
+                             colourStage, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, colourStage, colourAccess);
+        //The peel before last wrote the depth buffer this peel clears.
+        if (i > 1)
+            addSubpassDependency(subpassDependencies, subpassDependencyCount, peel-4, peel,
+                                 depthStages, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, depthStages, depthAccess);
+    }
+
+    LOGI("Creating %d layer renderpass %d subpasses %d subpassDependencies", layers, subpassCount, subpassDependencyCount);
+    VkRenderPassCreateInfo rp_info;
+    rp_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    rp_info.pNext = NULL;
+    rp_info.flags=0;
+    rp_info.attachmentCount = 5;
+    rp_info.pAttachments = attachments;
+    rp_info.subpassCount = subpassCount;
+    rp_info.pSubpasses = subpasses;
+    rp_info.dependencyCount = subpassDependencyCount;
+    rp_info.pDependencies = subpassDependencies;
+    res = vkCreateRenderPass(engine->vkDevice, &rp_info, NULL, &engine->layerRenderPasses[layers]);
     if (res != VK_SUCCESS) {
-        printf ("vkCreateDescriptorPool returned error %d.\n", res);
+        LOGE ("vkCreateRenderPass returned error. %d\n", res);
         return -1;
     }
 
-    printf ("minUniformBufferOffsetAlignment %d.\n", (int)engine->deviceProperties.limits.minUniformBufferOffsetAlignment);
-    engine->modelBufferValsOffset = sizeof(float)*16;
-    if (engine->modelBufferValsOffset < engine->deviceProperties.limits.minUniformBufferOffsetAlignment)
-        engine->modelBufferValsOffset = engine->deviceProperties.limits.minUniformBufferOffsetAlignment;
-    printf ("modelBufferValsOffset %d.\n", engine->modelBufferValsOffset);
+    engine->layerFramebuffers[layers]=new VkFramebuffer[engine->swapchainImageCount];
+    for (uint32_t i = 0; i < engine->swapchainImageCount; i++) {
 
-    VkBufferCreateInfo uniformBufferCreateInfo;
-    uniformBufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    uniformBufferCreateInfo.pNext = NULL;
-    uniformBufferCreateInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-    uniformBufferCreateInfo.size = engine->modelBufferValsOffset*(MAX_BOXES+3); //Enough to store MAX_BOXES+3 matricies.
-    uniformBufferCreateInfo.queueFamilyIndexCount = 0;
-    uniformBufferCreateInfo.pQueueFamilyIndices = NULL;
-    uniformBufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    uniformBufferCreateInfo.flags = 0;
+        VkImageView imageViewAttachments[5];
 
-    VkBuffer uniformBuffer;
-    res = vkCreateBuffer(engine->vkDevice, &uniformBufferCreateInfo, NULL, &uniformBuffer);
+        //Attach the correct swapchain colourbuffer
+        imageViewAttachments[0] = engine->swapChainViews[i];
+        //We only have one depth buffer which we attach to all framebuffers
+        imageViewAttachments[1] = engine->depthAttachmentView[0];
+        imageViewAttachments[2] = engine->peelView;
+        imageViewAttachments[3] = engine->depthAttachmentView[1];
+        imageViewAttachments[4] = engine->transmittanceView;
+
+        VkFramebufferCreateInfo fb_info;
+        fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        fb_info.pNext = NULL;
+        fb_info.renderPass = engine->layerRenderPasses[layers];
+        fb_info.attachmentCount = 5;
+        fb_info.pAttachments = imageViewAttachments;
+        fb_info.width = engine->width;
+        fb_info.height = engine->height;
+        fb_info.layers = 1;
+        fb_info.flags = 0;
+
+        res = vkCreateFramebuffer(engine->vkDevice, &fb_info, NULL, &engine->layerFramebuffers[layers][i]);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkCreateFramebuffer returned error %d.\n", res);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//Makes the render pass for layers layers the current depth peel render pass, creating it the first time.
+int selectLayerRenderPass(struct engine* engine, int layers)
+{
+    if (engine->layerRenderPasses[layers] == VK_NULL_HANDLE && createLayerRenderPass(engine, layers) != 0)
+        return -1;
+    engine->renderPass = engine->layerRenderPasses[layers];
+    engine->framebuffers = engine->layerFramebuffers[layers];
+    engine->renderPassLayers = layers;
+    return 0;
+}
+
+//Creates a device local colour image that can be used as an input attachment and returns its view.
+int createAttachmentImage(struct engine* engine, VkFormat format, VkExtent2D extent, VkImageView *view)
+{
+    VkResult res;
+    VkImageCreateInfo imageCreateInfo;
+    imageCreateInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    imageCreateInfo.pNext = NULL;
+    imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageCreateInfo.format = format;
+    imageCreateInfo.extent.width = extent.width;
+    imageCreateInfo.extent.height = extent.height;
+    imageCreateInfo.extent.depth = 1;
+    imageCreateInfo.mipLevels = 1;
+    imageCreateInfo.arrayLayers = 1;
+    imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    imageCreateInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT;
+    imageCreateInfo.queueFamilyIndexCount = 0;
+    imageCreateInfo.pQueueFamilyIndices = NULL;
+    imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageCreateInfo.flags = 0;
+    VkImage image;
+    res = vkCreateImage(engine->vkDevice, &imageCreateInfo, NULL, &image);
     if (res != VK_SUCCESS) {
-        LOGE ("vkCreateBuffer returned error %d.\n", res);
+        LOGE ("vkCreateImage returned error while creating attachment image.\n");
         return -1;
     }
 
     VkMemoryRequirements memoryRequirements;
-    vkGetBufferMemoryRequirements(engine->vkDevice, uniformBuffer, &memoryRequirements);
-    uint8_t found = 0;
+    vkGetImageMemoryRequirements(engine->vkDevice, image, &memoryRequirements);
     uint32_t typeBits = memoryRequirements.memoryTypeBits;
-    LOGI("Uniform memory types %d", typeBits);
-    VkFlags requirements_mask = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
     uint32_t typeIndex;
     for (typeIndex = 0; typeIndex < engine->physicalDeviceMemoryProperties.memoryTypeCount; typeIndex++) {
-        if ((typeBits & 1) == 1)//Check last bit;
-        {
-            if ((engine->physicalDeviceMemoryProperties.memoryTypes[typeIndex].propertyFlags & requirements_mask) == requirements_mask)
-            {
-                found=1;
-                break;
-            }
-        }
+        if ((typeBits & 1) == 1 && (engine->physicalDeviceMemoryProperties.memoryTypes[typeIndex].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT))
+            break;
         typeBits >>= 1;
     }
-
-    if (!found)
-    {
-        LOGE ("Did not find a suitable memory type.\n");
+    if (typeIndex == engine->physicalDeviceMemoryProperties.memoryTypeCount) {
+        LOGE ("Did not find a suitable memory type for the attachment image.\n");
         return -1;
-    }else
-        LOGI ("Using memory type %d.\n", typeIndex);
+    }
 
     VkMemoryAllocateInfo memAllocInfo;
     memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
     memAllocInfo.pNext = NULL;
     memAllocInfo.allocationSize = memoryRequirements.size;
     memAllocInfo.memoryTypeIndex = typeIndex;
-    //
-    VkDeviceMemory uniformMemory;
-    res = vkAllocateMemory(engine->vkDevice, &memAllocInfo, NULL, &uniformMemory);
+    VkDeviceMemory imageMemory;
+    res = vkAllocateMemory(engine->vkDevice, &memAllocInfo, NULL, &imageMemory);
     if (res != VK_SUCCESS) {
-        LOGE ("vkCreateBuffer returned error %d.\n", res);
+        LOGE ("vkAllocateMemory returned error while creating attachment image.\n");
         return -1;
     }
-
-    res = vkMapMemory(engine->vkDevice, uniformMemory, 0, memoryRequirements.size, 0, (void **)&engine->uniformMappedMemory);
+    res = vkBindImageMemory(engine->vkDevice, image, imageMemory, 0);
     if (res != VK_SUCCESS) {
-        LOGE ("vkMapMemory returned error %d.\n", res);
+        LOGE ("vkBindImageMemory returned error while creating attachment image. %d\n", res);
         return -1;
     }
 
-    res = vkBindBufferMemory(engine->vkDevice, uniformBuffer, uniformMemory, 0);
+    VkImageViewCreateInfo view_info;
+    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    view_info.pNext = NULL;
+    view_info.image = image;
+    view_info.format = format;
+    view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    view_info.components.r = VK_COMPONENT_SWIZZLE_R;
+    view_info.components.g = VK_COMPONENT_SWIZZLE_G;
+    view_info.components.b = VK_COMPONENT_SWIZZLE_B;
+    view_info.components.a = VK_COMPONENT_SWIZZLE_A;
+    view_info.subresourceRange.baseMipLevel = 0;
+    view_info.subresourceRange.levelCount = 1;
+    view_info.subresourceRange.baseArrayLayer = 0;
+    view_info.subresourceRange.layerCount = 1;
+    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    view_info.flags = 0;
+    res = vkCreateImageView(engine->vkDevice, &view_info, NULL, view);
     if (res != VK_SUCCESS) {
-        LOGE ("vkBindBufferMemory returned error %d.\n", res);
+        LOGE ("vkCreateImageView returned error while creating attachment image. %d\n", res);
         return -1;
     }
+    return 0;
+}
 
-    engine->descriptorSetLayouts = new VkDescriptorSetLayout[3];
+//Dual depth peeling keeps the nearest and furthest unpeeled depths of each pixel in a two channel float
+//attachment (the nearest negated so both can use MAX blending). Each geometry pass peels the fragments at
+//both ends of the range, the front one is blended under the colour buffer straight away and the back one
+//over a back accumulator that is blended under the colour buffer at the end.
+//The mode is disabled if the device can't blend R32G32_SFLOAT or the shaders are missing.
+int setupDualPeel(struct engine* engine, VkFormat format, VkFormat depthFormat, VkExtent2D extent)
+{
+    VkResult res;
+    engine->dualPeelSupported = false;
 
-    for (int i = 0; i <3; i++) {
-        VkDescriptorSetLayoutBinding layout_bindings[1];
-        layout_bindings[0].binding = 0;
+    VkFormatProperties props;
+    vkGetPhysicalDeviceFormatProperties(engine->physicalDevice, VK_FORMAT_R32G32_SFLOAT, &props);
+    if (!(props.optimalTilingFeatures & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BLEND_BIT)) {
+        LOGW ("VK_FORMAT_R32G32_SFLOAT can't be blended, dual depth peeling disabled.\n");
+        if (engine->oitMode == OIT_MODE_DUAL_PEEL)
+            engine->oitMode = OIT_MODE_DEPTH_PEEL;
+        return 0;
+    }
+
+    const char *shaderFiles[3] = {"shaders/dual_init.frag.spv", "shaders/dual_peel.frag.spv", "shaders/dual_composite.frag.spv"};
+    for (int i = 0; i < 3; i++) {
+        int loaded = loadShaderModule(engine, shaderFiles[i], &engine->dualShaderModules[i]);
+        if (loaded < 0)
+            return -1;
+        if (loaded > 0) {
+            LOGW ("%s not found, dual depth peeling disabled.\n", shaderFiles[i]);
+            if (engine->oitMode == OIT_MODE_DUAL_PEEL)
+                engine->oitMode = OIT_MODE_DEPTH_PEEL;
+            return 0;
+        }
+    }
+
+    //The attachments: the swapchain image and traditional blend depth buffer shared with the depth peel render
+    //pass, the depth range ping-pong pair, the front and back layer of the current pass and the back accumulator.
+    const uint32_t colourAttachment = 0;
+    const uint32_t depthAttachment = 1;
+    const uint32_t depthRangeAttachments[2] = {2, 3};
+    const uint32_t frontAttachment = 4;
+    const uint32_t backAttachment = 5;
+    const uint32_t backAccumulationAttachment = 6;
+    const int attachmentCount = 7;
+
+    VkImageView views[attachmentCount];
+    for (int i = 0; i < 2; i++)
+        if (createAttachmentImage(engine, VK_FORMAT_R32G32_SFLOAT, extent, &views[depthRangeAttachments[i]]) != 0)
+            return -1;
+    if (createAttachmentImage(engine, format, extent, &views[frontAttachment]) != 0 ||
+        createAttachmentImage(engine, format, extent, &views[backAttachment]) != 0 ||
+        createAttachmentImage(engine, format, extent, &views[backAccumulationAttachment]) != 0)
+        return -1;
+
+    VkAttachmentDescription attachments[attachmentCount];
+    for (int i = 0; i < attachmentCount; i++) {
+        attachments[i].format = format;
+        attachments[i].samples = VK_SAMPLE_COUNT_1_BIT;
+        attachments[i].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        attachments[i].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        attachments[i].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        attachments[i].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        attachments[i].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        attachments[i].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        attachments[i].flags = 0;
+    }
+    attachments[colourAttachment].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    attachments[colourAttachment].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    attachments[colourAttachment].initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attachments[depthAttachment].format = depthFormat;
+    attachments[depthAttachment].initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    attachments[depthAttachment].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    attachments[depthRangeAttachments[0]].format = VK_FORMAT_R32G32_SFLOAT;
+    attachments[depthRangeAttachments[1]].format = VK_FORMAT_R32G32_SFLOAT;
+    attachments[backAccumulationAttachment].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+
+    VkAttachmentReference colour_reference = {colourAttachment, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+    VkAttachmentReference depth_reference = {depthAttachment, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
+    VkAttachmentReference depthrange_reference[2];
+    VkAttachmentReference depthrange_inputattachment_reference[2];
+    for (int i = 0; i < 2; i++) {
+        depthrange_reference[i].attachment = depthRangeAttachments[i];
+        depthrange_reference[i].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        depthrange_inputattachment_reference[i].attachment = depthRangeAttachments[i];
+        depthrange_inputattachment_reference[i].layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    }
+    //The peel writes the next depth range, the front layer and the back layer.
+    VkAttachmentReference peel_references[2][3];
+    for (int i = 0; i < 2; i++) {
+        peel_references[i][0] = depthrange_reference[!i];
+        peel_references[i][1].attachment = frontAttachment;
+        peel_references[i][1].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        peel_references[i][2].attachment = backAttachment;
+        peel_references[i][2].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    }
+    VkAttachmentReference front_inputattachment_reference = {frontAttachment, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+    VkAttachmentReference back_inputattachment_reference = {backAttachment, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+    VkAttachmentReference backaccumulation_reference = {backAccumulationAttachment, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+    VkAttachmentReference backaccumulation_inputattachment_reference = {backAccumulationAttachment, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+
+    VkSubpassDescription subpasses[DUAL_PEEL_SUBPASS_COUNT];
+    for (int subpass = 0; subpass < DUAL_PEEL_SUBPASS_COUNT; subpass++) {
+        subpasses[subpass].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+        subpasses[subpass].flags = 0;
+        subpasses[subpass].inputAttachmentCount = 0;
+        subpasses[subpass].pInputAttachments = NULL;
+        subpasses[subpass].colorAttachmentCount = 1;
+        subpasses[subpass].pColorAttachments = &colour_reference;
+        subpasses[subpass].pResolveAttachments = NULL;
+        subpasses[subpass].pDepthStencilAttachment = NULL;
+    }
+    subpasses[0].pDepthStencilAttachment = &depth_reference;
+    subpasses[1].pColorAttachments = &depthrange_reference[0];
+    for (int pass = 0; pass < DUAL_PEEL_PASSES; pass++) {
+        VkSubpassDescription *peel = &subpasses[2+pass*3];
+        peel->inputAttachmentCount = 1;
+        peel->pInputAttachments = &depthrange_inputattachment_reference[pass%2];
+        peel->colorAttachmentCount = 3;
+        peel->pColorAttachments = peel_references[pass%2];
+        VkSubpassDescription *frontBlend = &subpasses[3+pass*3];
+        frontBlend->inputAttachmentCount = 1;
+        frontBlend->pInputAttachments = &front_inputattachment_reference;
+        VkSubpassDescription *backBlend = &subpasses[4+pass*3];
+        backBlend->inputAttachmentCount = 1;
+        backBlend->pInputAttachments = &back_inputattachment_reference;
+        backBlend->pColorAttachments = &backaccumulation_reference;
+    }
+    subpasses[DUAL_PEEL_SUBPASS_COUNT-1].inputAttachmentCount = 1;
+    subpasses[DUAL_PEEL_SUBPASS_COUNT-1].pInputAttachments = &backaccumulation_inputattachment_reference;
+
+    //Every subpass preserves the attachments it doesn't use.
+    uint32_t preserveAttachments[DUAL_PEEL_SUBPASS_COUNT][attachmentCount];
+    for (int subpass = 0; subpass < DUAL_PEEL_SUBPASS_COUNT; subpass++) {
+        uint32_t count = 0;
+        for (uint32_t attachment = 0; attachment < attachmentCount; attachment++) {
+            bool used = subpasses[subpass].pDepthStencilAttachment && subpasses[subpass].pDepthStencilAttachment->attachment == attachment;
+            for (uint32_t i = 0; i < subpasses[subpass].inputAttachmentCount; i++)
+                used |= subpasses[subpass].pInputAttachments[i].attachment == attachment;
+            for (uint32_t i = 0; i < subpasses[subpass].colorAttachmentCount; i++)
+                used |= subpasses[subpass].pColorAttachments[i].attachment == attachment;
+            if (!used)
+                preserveAttachments[subpass][count++] = attachment;
+        }
+        subpasses[subpass].preserveAttachmentCount = count;
+        subpasses[subpass].pPreserveAttachments = preserveAttachments[subpass];
+    }
+
+    //Each subpass only depends on the subpasses that last wrote (or read, where it overwrites) the attachments it
+    //uses. As in the depth peel render pass every read is of an input attachment so all the dependencies are by region.
+    const VkPipelineStageFlags colourStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    const VkPipelineStageFlags inputStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    const VkAccessFlags colourAccess = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    VkSubpassDependency subpassDependencies[DUAL_PEEL_PASSES*7+4];
+    uint32_t subpassDependencyCount = 0;
+    //The first front blend blends over the traditional blend's colour and the first peel reads the initial depth range.
+    addSubpassDependency(subpassDependencies, subpassDependencyCount, 0, 3,
+                         colourStage, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, colourStage, colourAccess);
+    addSubpassDependency(subpassDependencies, subpassDependencyCount, 1, 2,
+                         colourStage, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, inputStage, VK_ACCESS_INPUT_ATTACHMENT_READ_BIT);
+    for (uint32_t pass = 0; pass < DUAL_PEEL_PASSES; pass++) {
+        uint32_t peel = 2+pass*3;
+        uint32_t frontBlend = 3+pass*3;
+        uint32_t backBlend = 4+pass*3;
+        //The blends read the layers the peel wrote.
+        addSubpassDependency(subpassDependencies, subpassDependencyCount, peel, frontBlend,
+                             colourStage, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, inputStage, VK_ACCESS_INPUT_ATTACHMENT_READ_BIT);
+        addSubpassDependency(subpassDependencies, subpassDependencyCount, peel, backBlend,
+                             colourStage, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, inputStage, VK_ACCESS_INPUT_ATTACHMENT_READ_BIT);
+        if (pass == 0)
+            continue;
+        //The peel reads the depth range the last peel wrote and overwrites the one it read.
+        addSubpassDependency(subpassDependencies, subpassDependencyCount, peel-3, peel,
+                             inputStage | colourStage, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                             inputStage | colourStage, VK_ACCESS_INPUT_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+        //It overwrites the layers the last blends read.
+        addSubpassDependency(subpassDependencies, subpassDependencyCount, frontBlend-3, peel,
+                             inputStage, 0, colourStage, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+        addSubpassDependency(subpassDependencies, subpassDependencyCount, backBlend-3, peel,
+                             inputStage, 0, colourStage, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT);
+        //Blends accumulate in order.
+        addSubpassDependency(subpassDependencies, subpassDependencyCount, frontBlend-3, frontBlend,
+                             colourStage, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, colourStage, colourAccess);
+        addSubpassDependency(subpassDependencies, subpassDependencyCount, backBlend-3, backBlend,
+                             colourStage, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, colourStage, colourAccess);
+    }
+    //The composite reads the back accumulator and blends over the front layers.
+    addSubpassDependency(subpassDependencies, subpassDependencyCount, DUAL_PEEL_SUBPASS_COUNT-3, DUAL_PEEL_SUBPASS_COUNT-1,
+                         colourStage, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, colourStage, colourAccess);
+    addSubpassDependency(subpassDependencies, subpassDependencyCount, DUAL_PEEL_SUBPASS_COUNT-2, DUAL_PEEL_SUBPASS_COUNT-1,
+                         colourStage, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, inputStage, VK_ACCESS_INPUT_ATTACHMENT_READ_BIT);
+
+    LOGI("Creating dual depth peel renderpass %d subpasses %d subpassDependencies", DUAL_PEEL_SUBPASS_COUNT, subpassDependencyCount);
+    VkRenderPassCreateInfo rp_info;
+    rp_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    rp_info.pNext = NULL;
+    rp_info.flags=0;
+    rp_info.attachmentCount = attachmentCount;
+    rp_info.pAttachments = attachments;
+    rp_info.subpassCount = DUAL_PEEL_SUBPASS_COUNT;
+    rp_info.pSubpasses = subpasses;
+    rp_info.dependencyCount = subpassDependencyCount;
+    rp_info.pDependencies = subpassDependencies;
+    res = vkCreateRenderPass(engine->vkDevice, &rp_info, NULL, &engine->dualPeelRenderPass);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateRenderPass returned error. %d\n", res);
+        return -1;
+    }
+
+    engine->dualPeelFramebuffers=new VkFramebuffer[engine->swapchainImageCount];
+    for (uint32_t i = 0; i < engine->swapchainImageCount; i++) {
+        views[colourAttachment] = engine->swapChainViews[i];
+        views[depthAttachment] = engine->depthAttachmentView[0];
+
+        VkFramebufferCreateInfo fb_info;
+        fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        fb_info.pNext = NULL;
+        fb_info.renderPass = engine->dualPeelRenderPass;
+        fb_info.attachmentCount = attachmentCount;
+        fb_info.pAttachments = views;
+        fb_info.width = extent.width;
+        fb_info.height = extent.height;
+        fb_info.layers = 1;
+        fb_info.flags = 0;
+
+        res = vkCreateFramebuffer(engine->vkDevice, &fb_info, NULL, &engine->dualPeelFramebuffers[i]);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkCreateFramebuffer returned error %d.\n", res);
+            return -1;
+        }
+    }
+
+    //One input attachment set for each depth range, the front layer, the back layer and the back accumulator.
+    VkDescriptorPoolSize typeCounts[1];
+    typeCounts[0].type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+    typeCounts[0].descriptorCount = 5;
+
+    VkDescriptorPoolCreateInfo descriptorPoolInfo;
+    descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolInfo.flags = 0;
+    descriptorPoolInfo.pNext = NULL;
+    descriptorPoolInfo.maxSets = 5;
+    descriptorPoolInfo.poolSizeCount = 1;
+    descriptorPoolInfo.pPoolSizes = typeCounts;
+
+    VkDescriptorPool descriptorPool;
+    res = vkCreateDescriptorPool(engine->vkDevice, &descriptorPoolInfo, NULL, &descriptorPool);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateDescriptorPool returned error %d.\n", res);
+        return -1;
+    }
+
+    VkDescriptorSetLayout setLayouts[5];
+    VkDescriptorSet descriptorSets[5];
+    for (int i = 0; i < 5; i++)
+        setLayouts[i] = engine->descriptorSetLayouts[2];
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.pNext = NULL;
+    descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = 5;
+    descriptorSetAllocateInfo.pSetLayouts = setLayouts;
+    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, descriptorSets);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkAllocateDescriptorSets returned error %d.\n", res);
+        return -1;
+    }
+    engine->dualDepthDescriptorSets[0] = descriptorSets[0];
+    engine->dualDepthDescriptorSets[1] = descriptorSets[1];
+    engine->dualFrontDescriptorSet = descriptorSets[2];
+    engine->dualBackDescriptorSet = descriptorSets[3];
+    engine->dualBackAccumulationDescriptorSet = descriptorSets[4];
+
+    const uint32_t setAttachments[5] = {depthRangeAttachments[0], depthRangeAttachments[1], frontAttachment, backAttachment, backAccumulationAttachment};
+    VkDescriptorImageInfo imageInfo[5];
+    VkWriteDescriptorSet writes[5];
+    for (int i = 0; i < 5; i++) {
+        imageInfo[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        imageInfo[i].imageView = views[setAttachments[i]];
+        imageInfo[i].sampler = VK_NULL_HANDLE;
+        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[i].pNext = NULL;
+        writes[i].dstSet = descriptorSets[i];
+        writes[i].descriptorCount = 1;
+        writes[i].descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+        writes[i].pImageInfo = &imageInfo[i];
+        writes[i].dstArrayElement = 0;
+        writes[i].dstBinding = 0;
+    }
+    vkUpdateDescriptorSets(engine->vkDevice, 5, writes, 0, NULL);
+
+    engine->dualPeelSupported = true;
+    LOGI("Dual depth peeling available, %d geometry passes for %d layers", DUAL_PEEL_PASSES, MAX_LAYERS);
+    return 0;
+}
+
+//Creates one of the dual depth peel pipelines. The geometry stages (traditional blend, init and peel) are
+//created for one draw mode, the full screen blend stages are shared by all of them.
+int setupDualPeelPipeline(struct engine* engine, int drawMode, int stage)
+{
+    bool geometry = stage == DUAL_PEEL_STAGE_TRADITIONAL_BLEND || stage == DUAL_PEEL_STAGE_INIT || stage == DUAL_PEEL_STAGE_PEEL;
+    const char *stageNames[] = {"trad blend", "init", "peel", "front blend", "back blend", "composite"};
+    if (geometry)
+        LOGI("Setting up dual depth peel %s pipeline (%s)", stageNames[stage], drawModeNames[drawMode]);
+    else
+        LOGI("Setting up dual depth peel %s pipeline", stageNames[stage]);
+
+    //The traditional blend draws to the left half, as in the depth peel render pass.
+    VkRect2D scissor;
+    scissor.extent.width = engine->width / 2;
+    scissor.extent.height = engine->height;
+    scissor.offset.x = 0;
+    scissor.offset.y = 0;
+
+    VkViewport viewport;
+    viewport.height = (float) engine->height;
+    viewport.width = (float) engine->width;
+    viewport.minDepth = (float) 0.0f;
+    viewport.maxDepth = (float) 1.0f;
+    viewport.x = 0;
+    viewport.y = 0;
+
+    VkDynamicState dynamicStateEnables[VK_DYNAMIC_STATE_RANGE_SIZE];
+    VkPipelineDynamicStateCreateInfo dynamicState;
+    memset(dynamicStateEnables, 0, sizeof dynamicStateEnables);
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.flags = 0;
+    dynamicState.pNext = NULL;
+    dynamicState.pDynamicStates = dynamicStateEnables;
+    dynamicState.dynamicStateCount = 0;
+
+    VkPipelineVertexInputStateCreateInfo vi;
+    vi.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vi.pNext = NULL;
+    vi.flags = 0;
+    vi.vertexBindingDescriptionCount = 1;
+    vi.pVertexBindingDescriptions = &engine->vertexInputBindingDescription;
+    vi.vertexAttributeDescriptionCount = geometry ? 2 : 1;
+    vi.pVertexAttributeDescriptions = engine->vertexInputAttributeDescription;
+
+    VkPipelineInputAssemblyStateCreateInfo ia;
+    ia.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    ia.pNext = NULL;
+    ia.flags = 0;
+    ia.primitiveRestartEnable = VK_FALSE;
+    ia.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+    VkPipelineRasterizationStateCreateInfo rs;
+    rs.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rs.pNext = NULL;
+    rs.flags = 0;
+    rs.polygonMode = VK_POLYGON_MODE_FILL;
+    rs.cullMode = geometry ? VK_CULL_MODE_NONE : VK_CULL_MODE_BACK_BIT;
+    rs.frontFace = VK_FRONT_FACE_CLOCKWISE;
+    rs.depthClampEnable = VK_TRUE;
+    rs.rasterizerDiscardEnable = VK_FALSE;
+    rs.depthBiasEnable = VK_FALSE;
+    rs.depthBiasConstantFactor = 0;
+    rs.depthBiasClamp = 0;
+    rs.depthBiasSlopeFactor = 0;
+    rs.lineWidth = 1;
+
+    //The init and peel stages MAX blend every target, the other stages blend a single layer.
+    VkPipelineColorBlendAttachmentState att_state[3];
+    for (int i = 0; i < 3; i++) {
+        att_state[i].colorWriteMask = 0xf;
+        att_state[i].blendEnable = VK_TRUE;
+        att_state[i].alphaBlendOp = VK_BLEND_OP_MAX;
+        att_state[i].colorBlendOp = VK_BLEND_OP_MAX;
+        att_state[i].srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+        att_state[i].dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+        att_state[i].srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+        att_state[i].dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    }
+    switch (stage) {
+        case DUAL_PEEL_STAGE_TRADITIONAL_BLEND:
+            att_state[0].alphaBlendOp = VK_BLEND_OP_ADD;
+            att_state[0].colorBlendOp = VK_BLEND_OP_ADD;
+            att_state[0].srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+            att_state[0].dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+            att_state[0].srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+            att_state[0].dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+            break;
+        case DUAL_PEEL_STAGE_FRONT_BLEND:
+        case DUAL_PEEL_STAGE_COMPOSITE:
+            //Under the colour buffer, whose alpha holds the transmittance of what is already there.
+            att_state[0].alphaBlendOp = VK_BLEND_OP_ADD;
+            att_state[0].colorBlendOp = VK_BLEND_OP_ADD;
+            att_state[0].srcColorBlendFactor = VK_BLEND_FACTOR_DST_ALPHA;
+            att_state[0].dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+            att_state[0].srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+            att_state[0].dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+            break;
+        case DUAL_PEEL_STAGE_BACK_BLEND:
+            //Over the back layers, the layer is premultiplied by blend.frag.
+            att_state[0].alphaBlendOp = VK_BLEND_OP_ADD;
+            att_state[0].colorBlendOp = VK_BLEND_OP_ADD;
+            att_state[0].srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+            att_state[0].dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+            att_state[0].srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+            att_state[0].dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+            break;
+    }
+
+    VkPipelineColorBlendStateCreateInfo cb;
+    cb.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    cb.flags = 0;
+    cb.pNext = NULL;
+    cb.attachmentCount = (stage == DUAL_PEEL_STAGE_PEEL) ? 3 : 1;
+    cb.pAttachments = att_state;
+    cb.logicOpEnable = VK_FALSE;
+    cb.logicOp = VK_LOGIC_OP_NO_OP;
+    cb.blendConstants[0] = 1.0f;
+    cb.blendConstants[1] = 1.0f;
+    cb.blendConstants[2] = 1.0f;
+    cb.blendConstants[3] = 1.0f;
+
+    VkPipelineViewportStateCreateInfo vp = {};
+    vp.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    vp.pNext = NULL;
+    vp.flags = 0;
+    vp.viewportCount = 1;
+    vp.pViewports = &viewport;
+    vp.scissorCount = 1;
+    if (stage == DUAL_PEEL_STAGE_TRADITIONAL_BLEND)
+        vp.pScissors = &scissor;
+    else
+        dynamicStateEnables[dynamicState.dynamicStateCount++] = VK_DYNAMIC_STATE_SCISSOR;
+
+    //Only the traditional blend has a depth buffer, the peels keep their depths in the depth range attachments.
+    VkPipelineDepthStencilStateCreateInfo ds;
+    ds.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    ds.pNext = NULL;
+    ds.flags = 0;
+    ds.depthTestEnable = VK_FALSE;
+    ds.depthWriteEnable = (stage == DUAL_PEEL_STAGE_TRADITIONAL_BLEND) ? VK_TRUE : VK_FALSE;
+    ds.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+    ds.depthBoundsTestEnable = VK_FALSE;
+    ds.stencilTestEnable = VK_FALSE;
+    ds.back.failOp = VK_STENCIL_OP_KEEP;
+    ds.back.passOp = VK_STENCIL_OP_KEEP;
+    ds.back.compareOp = VK_COMPARE_OP_ALWAYS;
+    ds.back.compareMask = 0;
+    ds.back.reference = 0;
+    ds.back.depthFailOp = VK_STENCIL_OP_KEEP;
+    ds.back.writeMask = 0;
+    ds.minDepthBounds = 0;
+    ds.maxDepthBounds = 0;
+    ds.front = ds.back;
+
+    VkPipelineMultisampleStateCreateInfo ms;
+    ms.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    ms.pNext = NULL;
+    ms.flags = 0;
+    ms.pSampleMask = NULL;
+    ms.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    ms.sampleShadingEnable = VK_FALSE;
+    ms.alphaToCoverageEnable = VK_FALSE;
+    ms.alphaToOneEnable = VK_FALSE;
+    ms.minSampleShading = 0.0;
+
+    VkPipelineShaderStageCreateInfo shaderStages[2];
+    shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[0].pNext = NULL;
+    shaderStages[0].pSpecializationInfo = NULL;
+    shaderStages[0].flags = 0;
+    shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    shaderStages[0].pName = "main";
+    shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[1].pNext = NULL;
+    shaderStages[1].pSpecializationInfo = NULL;
+    shaderStages[1].flags = 0;
+    shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    shaderStages[1].pName = "main";
+
+    VkGraphicsPipelineCreateInfo pipelineInfo;
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.pNext = NULL;
+    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+    pipelineInfo.basePipelineIndex = 0;
+    pipelineInfo.flags = 0;
+    pipelineInfo.pVertexInputState = &vi;
+    pipelineInfo.pInputAssemblyState = &ia;
+    pipelineInfo.pRasterizationState = &rs;
+    pipelineInfo.pColorBlendState = &cb;
+    pipelineInfo.pTessellationState = NULL;
+    pipelineInfo.pMultisampleState = &ms;
+    pipelineInfo.pDynamicState = &dynamicState;
+    if (dynamicState.dynamicStateCount==0)
+        pipelineInfo.pDynamicState=NULL;
+    pipelineInfo.pViewportState = &vp;
+    pipelineInfo.pDepthStencilState = &ds;
+    pipelineInfo.pStages = shaderStages;
+    pipelineInfo.stageCount = 2;
+    pipelineInfo.renderPass = engine->dualPeelRenderPass;
+
+    //The geometry stages use the draw mode's vertex shader and layouts.
+    VkShaderModule vertexShaderModule = engine->shdermodules[2];
+    VkPipelineLayout pipelineLayout = engine->pipelineLayout;
+    VkPipelineLayout blendPeelPipelineLayout = engine->blendPeelPipelineLayout;
+    switch (drawMode) {
+        case DRAW_MODE_INSTANCED:
+            vertexShaderModule = engine->instancedVertexShaderModule;
+            pipelineLayout = engine->instancedPipelineLayout;
+            blendPeelPipelineLayout = engine->instancedBlendPeelPipelineLayout;
+            break;
+        case DRAW_MODE_DYNAMIC_OFFSETS:
+            pipelineLayout = engine->dynamicPipelineLayout;
+            blendPeelPipelineLayout = engine->dynamicBlendPeelPipelineLayout;
+            break;
+    }
+
+    VkPipeline *pipeline;
+    switch (stage) {
+        case DUAL_PEEL_STAGE_TRADITIONAL_BLEND:
+            shaderStages[0].module = (drawMode == DRAW_MODE_INSTANCED) ? vertexShaderModule : engine->shdermodules[0];
+            shaderStages[1].module = engine->shdermodules[1];
+            pipelineInfo.layout = pipelineLayout;
+            pipelineInfo.subpass = 0;
+            pipeline = &engine->dualTraditionalBlendPipelines[drawMode];
+            break;
+        case DUAL_PEEL_STAGE_INIT:
+            shaderStages[0].module = vertexShaderModule;
+            shaderStages[1].module = engine->dualShaderModules[0];
+            pipelineInfo.layout = pipelineLayout;
+            pipelineInfo.subpass = 1;
+            pipeline = &engine->dualInitPipelines[drawMode];
+            break;
+        case DUAL_PEEL_STAGE_PEEL:
+            shaderStages[0].module = vertexShaderModule;
+            shaderStages[1].module = engine->dualShaderModules[1];
+            pipelineInfo.layout = blendPeelPipelineLayout;
+            pipelineInfo.subpass = 2;
+            pipeline = &engine->dualPeelPipelines[drawMode];
+            break;
+        case DUAL_PEEL_STAGE_FRONT_BLEND:
+            shaderStages[0].module = engine->shdermodules[4];
+            shaderStages[1].module = engine->shdermodules[5];
+            pipelineInfo.layout = engine->blendPeelPipelineLayout;
+            pipelineInfo.subpass = 3;
+            pipeline = &engine->dualFrontBlendPipeline;
+            break;
+        case DUAL_PEEL_STAGE_BACK_BLEND:
+            shaderStages[0].module = engine->shdermodules[4];
+            shaderStages[1].module = engine->shdermodules[5];
+            pipelineInfo.layout = engine->blendPeelPipelineLayout;
+            pipelineInfo.subpass = 4;
+            pipeline = &engine->dualBackBlendPipeline;
+            break;
+        default:
+            shaderStages[0].module = engine->shdermodules[4];
+            shaderStages[1].module = engine->dualShaderModules[2];
+            pipelineInfo.layout = engine->blendPeelPipelineLayout;
+            pipelineInfo.subpass = DUAL_PEEL_SUBPASS_COUNT-1;
+            pipeline = &engine->dualCompositePipeline;
+    }
+
+    VkResult res;
+    res = vkCreateGraphicsPipelines(engine->vkDevice, engine->pipelineCache, 1, &pipelineInfo, NULL, pipeline);
+    if (res != VK_SUCCESS) {
+        LOGE("vkCreateGraphicsPipelines returned error %d.\n", res);
+        return -1;
+    }
+    return 0;
+}
+
+//Weighted blended OIT draws every box once, summing weighted premultiplied colours into an RGBA16F accumulation
+//and the product of 1-alpha into an R16F revealage, then resolves them to an average colour in a full screen
+//subpass. It is an approximation but needs one geometry pass whatever the depth complexity.
+//The mode is disabled if either format can't be blended or the shaders are missing.
+int setupWeightedBlended(struct engine* engine, VkFormat format, VkFormat depthFormat, VkExtent2D extent)
+{
+    VkResult res;
+    engine->weightedBlendedSupported = false;
+
+    const VkFormat accumulationFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
+    const VkFormat revealageFormat = VK_FORMAT_R16_SFLOAT;
+    VkFormatProperties accumulationProps, revealageProps;
+    vkGetPhysicalDeviceFormatProperties(engine->physicalDevice, accumulationFormat, &accumulationProps);
+    vkGetPhysicalDeviceFormatProperties(engine->physicalDevice, revealageFormat, &revealageProps);
+    if (!(accumulationProps.optimalTilingFeatures & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BLEND_BIT) ||
+        !(revealageProps.optimalTilingFeatures & VK_FORMAT_FEATURE_COLOR_ATTACHMENT_BLEND_BIT)) {
+        LOGW ("16 bit float formats can't be blended, weighted blended OIT disabled.\n");
+        if (engine->oitMode == OIT_MODE_WEIGHTED_BLENDED)
+            engine->oitMode = OIT_MODE_DEPTH_PEEL;
+        return 0;
+    }
+
+    const char *shaderFiles[2] = {"shaders/weighted_accumulate.frag.spv", "shaders/weighted_resolve.frag.spv"};
+    for (int i = 0; i < 2; i++) {
+        int loaded = loadShaderModule(engine, shaderFiles[i], &engine->weightedBlendedShaderModules[i]);
+        if (loaded < 0)
+            return -1;
+        if (loaded > 0) {
+            LOGW ("%s not found, weighted blended OIT disabled.\n", shaderFiles[i]);
+            if (engine->oitMode == OIT_MODE_WEIGHTED_BLENDED)
+                engine->oitMode = OIT_MODE_DEPTH_PEEL;
+            return 0;
+        }
+    }
+
+    //The attachments: the swapchain image and traditional blend depth buffer shared with the depth peel render
+    //pass, then the accumulation and revealage.
+    const uint32_t colourAttachment = 0;
+    const uint32_t depthAttachment = 1;
+    const uint32_t accumulationAttachment = 2;
+    const uint32_t revealageAttachment = 3;
+    const int attachmentCount = 4;
+
+    VkImageView views[attachmentCount];
+    if (createAttachmentImage(engine, accumulationFormat, extent, &views[accumulationAttachment]) != 0 ||
+        createAttachmentImage(engine, revealageFormat, extent, &views[revealageAttachment]) != 0)
+        return -1;
+
+    VkAttachmentDescription attachments[attachmentCount];
+    for (int i = 0; i < attachmentCount; i++) {
+        attachments[i].samples = VK_SAMPLE_COUNT_1_BIT;
+        attachments[i].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        attachments[i].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        attachments[i].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        attachments[i].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        attachments[i].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        attachments[i].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        attachments[i].flags = 0;
+    }
+    attachments[colourAttachment].format = format;
+    attachments[colourAttachment].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    attachments[colourAttachment].initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attachments[depthAttachment].format = depthFormat;
+    attachments[depthAttachment].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[depthAttachment].initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    attachments[depthAttachment].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    attachments[accumulationAttachment].format = accumulationFormat;
+    attachments[revealageAttachment].format = revealageFormat;
+
+    VkAttachmentReference colour_reference = {colourAttachment, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+    VkAttachmentReference depth_reference = {depthAttachment, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
+    VkAttachmentReference accumulate_references[2];
+    accumulate_references[0].attachment = accumulationAttachment;
+    accumulate_references[0].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    accumulate_references[1].attachment = revealageAttachment;
+    accumulate_references[1].layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    VkAttachmentReference resolve_inputattachment_references[2];
+    resolve_inputattachment_references[0].attachment = accumulationAttachment;
+    resolve_inputattachment_references[0].layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    resolve_inputattachment_references[1].attachment = revealageAttachment;
+    resolve_inputattachment_references[1].layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    const uint32_t subpassCount = 3;
+    VkSubpassDescription subpasses[subpassCount];
+    for (uint32_t subpass = 0; subpass < subpassCount; subpass++) {
+        subpasses[subpass].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+        subpasses[subpass].flags = 0;
+        subpasses[subpass].inputAttachmentCount = 0;
+        subpasses[subpass].pInputAttachments = NULL;
+        subpasses[subpass].colorAttachmentCount = 1;
+        subpasses[subpass].pColorAttachments = &colour_reference;
+        subpasses[subpass].pResolveAttachments = NULL;
+        subpasses[subpass].pDepthStencilAttachment = NULL;
+        subpasses[subpass].preserveAttachmentCount = 0;
+        subpasses[subpass].pPreserveAttachments = NULL;
+    }
+    subpasses[0].pDepthStencilAttachment = &depth_reference;
+    //The accumulation doesn't touch the colour buffer the traditional blend wrote.
+    subpasses[1].colorAttachmentCount = 2;
+    subpasses[1].pColorAttachments = accumulate_references;
+    subpasses[1].preserveAttachmentCount = 1;
+    subpasses[1].pPreserveAttachments = &colourAttachment;
+    subpasses[2].inputAttachmentCount = 2;
+    subpasses[2].pInputAttachments = resolve_inputattachment_references;
+
+    //The resolve reads what both earlier subpasses wrote.
+    VkSubpassDependency subpassDependencies[2];
+    for (int i = 0; i < 2; i++) {
+        subpassDependencies[i].srcSubpass = i;
+        subpassDependencies[i].dstSubpass = 2;
+        subpassDependencies[i].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        subpassDependencies[i].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        subpassDependencies[i].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        subpassDependencies[i].dstAccessMask = VK_ACCESS_INPUT_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        subpassDependencies[i].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+    }
+
+    VkRenderPassCreateInfo rp_info;
+    rp_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    rp_info.pNext = NULL;
+    rp_info.flags=0;
+    rp_info.attachmentCount = attachmentCount;
+    rp_info.pAttachments = attachments;
+    rp_info.subpassCount = subpassCount;
+    rp_info.pSubpasses = subpasses;
+    rp_info.dependencyCount = 2;
+    rp_info.pDependencies = subpassDependencies;
+    res = vkCreateRenderPass(engine->vkDevice, &rp_info, NULL, &engine->weightedBlendedRenderPass);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateRenderPass returned error. %d\n", res);
+        return -1;
+    }
+
+    engine->weightedBlendedFramebuffers=new VkFramebuffer[engine->swapchainImageCount];
+    for (uint32_t i = 0; i < engine->swapchainImageCount; i++) {
+        views[colourAttachment] = engine->swapChainViews[i];
+        views[depthAttachment] = engine->depthAttachmentView[0];
+
+        VkFramebufferCreateInfo fb_info;
+        fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        fb_info.pNext = NULL;
+        fb_info.renderPass = engine->weightedBlendedRenderPass;
+        fb_info.attachmentCount = attachmentCount;
+        fb_info.pAttachments = views;
+        fb_info.width = extent.width;
+        fb_info.height = extent.height;
+        fb_info.layers = 1;
+        fb_info.flags = 0;
+
+        res = vkCreateFramebuffer(engine->vkDevice, &fb_info, NULL, &engine->weightedBlendedFramebuffers[i]);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkCreateFramebuffer returned error %d.\n", res);
+            return -1;
+        }
+    }
+
+    //The resolve reads the accumulation as set 2 and the revealage as set 3, both use the input attachment layout.
+    VkDescriptorSetLayout resolveSetLayouts[4];
+    resolveSetLayouts[0] = engine->descriptorSetLayouts[0];
+    resolveSetLayouts[1] = engine->descriptorSetLayouts[1];
+    resolveSetLayouts[2] = engine->descriptorSetLayouts[2];
+    resolveSetLayouts[3] = engine->descriptorSetLayouts[2];
+
+    VkPipelineLayoutCreateInfo pPipelineLayoutCreateInfo;
+    pPipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pPipelineLayoutCreateInfo.flags = 0;
+    pPipelineLayoutCreateInfo.pNext = NULL;
+    pPipelineLayoutCreateInfo.pushConstantRangeCount = 0;
+    pPipelineLayoutCreateInfo.pPushConstantRanges = NULL;
+    pPipelineLayoutCreateInfo.setLayoutCount = 4;
+    pPipelineLayoutCreateInfo.pSetLayouts = resolveSetLayouts;
+    res = vkCreatePipelineLayout(engine->vkDevice, &pPipelineLayoutCreateInfo, NULL, &engine->weightedBlendedResolvePipelineLayout);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreatePipelineLayout returned error.\n");
+        return -1;
+    }
+
+    VkDescriptorPoolSize typeCounts[1];
+    typeCounts[0].type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+    typeCounts[0].descriptorCount = 2;
+
+    VkDescriptorPoolCreateInfo descriptorPoolInfo;
+    descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolInfo.flags = 0;
+    descriptorPoolInfo.pNext = NULL;
+    descriptorPoolInfo.maxSets = 2;
+    descriptorPoolInfo.poolSizeCount = 1;
+    descriptorPoolInfo.pPoolSizes = typeCounts;
+
+    VkDescriptorPool descriptorPool;
+    res = vkCreateDescriptorPool(engine->vkDevice, &descriptorPoolInfo, NULL, &descriptorPool);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateDescriptorPool returned error %d.\n", res);
+        return -1;
+    }
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.pNext = NULL;
+    descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = 2;
+    descriptorSetAllocateInfo.pSetLayouts = &resolveSetLayouts[2];
+    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, engine->weightedBlendedDescriptorSets);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkAllocateDescriptorSets returned error %d.\n", res);
+        return -1;
+    }
+
+    VkDescriptorImageInfo imageInfo[2];
+    VkWriteDescriptorSet writes[2];
+    for (int i = 0; i < 2; i++) {
+        imageInfo[i].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        imageInfo[i].imageView = views[accumulationAttachment+i];
+        imageInfo[i].sampler = VK_NULL_HANDLE;
+        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[i].pNext = NULL;
+        writes[i].dstSet = engine->weightedBlendedDescriptorSets[i];
+        writes[i].descriptorCount = 1;
+        writes[i].descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+        writes[i].pImageInfo = &imageInfo[i];
+        writes[i].dstArrayElement = 0;
+        writes[i].dstBinding = 0;
+    }
+    vkUpdateDescriptorSets(engine->vkDevice, 2, writes, 0, NULL);
+
+    engine->weightedBlendedSupported = true;
+    LOGI("Weighted blended OIT available");
+    return 0;
+}
+
+//Creates one of the weighted blended pipelines. The traditional blend and accumulate stages are created for one
+//draw mode, the resolve is shared by all of them.
+int setupWeightedBlendedPipeline(struct engine* engine, int drawMode, int stage)
+{
+    const char *stageNames[] = {"trad blend", "accumulate", "resolve"};
+    if (stage == WEIGHTED_BLENDED_STAGE_RESOLVE)
+        LOGI("Setting up weighted blended %s pipeline", stageNames[stage]);
+    else
+        LOGI("Setting up weighted blended %s pipeline (%s)", stageNames[stage], drawModeNames[drawMode]);
+
+    //The traditional blend draws to the left half, as in the depth peel render pass.
+    VkRect2D scissor;
+    scissor.extent.width = engine->width / 2;
+    scissor.extent.height = engine->height;
+    scissor.offset.x = 0;
+    scissor.offset.y = 0;
+
+    VkViewport viewport;
+    viewport.height = (float) engine->height;
+    viewport.width = (float) engine->width;
+    viewport.minDepth = (float) 0.0f;
+    viewport.maxDepth = (float) 1.0f;
+    viewport.x = 0;
+    viewport.y = 0;
+
+    VkDynamicState dynamicStateEnables[VK_DYNAMIC_STATE_RANGE_SIZE];
+    VkPipelineDynamicStateCreateInfo dynamicState;
+    memset(dynamicStateEnables, 0, sizeof dynamicStateEnables);
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.flags = 0;
+    dynamicState.pNext = NULL;
+    dynamicState.pDynamicStates = dynamicStateEnables;
+    dynamicState.dynamicStateCount = 0;
+
+    VkPipelineVertexInputStateCreateInfo vi;
+    vi.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vi.pNext = NULL;
+    vi.flags = 0;
+    vi.vertexBindingDescriptionCount = 1;
+    vi.pVertexBindingDescriptions = &engine->vertexInputBindingDescription;
+    vi.vertexAttributeDescriptionCount = (stage == WEIGHTED_BLENDED_STAGE_RESOLVE) ? 1 : 2;
+    vi.pVertexAttributeDescriptions = engine->vertexInputAttributeDescription;
+
+    VkPipelineInputAssemblyStateCreateInfo ia;
+    ia.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    ia.pNext = NULL;
+    ia.flags = 0;
+    ia.primitiveRestartEnable = VK_FALSE;
+    ia.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+    VkPipelineRasterizationStateCreateInfo rs;
+    rs.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rs.pNext = NULL;
+    rs.flags = 0;
+    rs.polygonMode = VK_POLYGON_MODE_FILL;
+    rs.cullMode = (stage == WEIGHTED_BLENDED_STAGE_RESOLVE) ? VK_CULL_MODE_BACK_BIT : VK_CULL_MODE_NONE;
+    rs.frontFace = VK_FRONT_FACE_CLOCKWISE;
+    rs.depthClampEnable = VK_TRUE;
+    rs.rasterizerDiscardEnable = VK_FALSE;
+    rs.depthBiasEnable = VK_FALSE;
+    rs.depthBiasConstantFactor = 0;
+    rs.depthBiasClamp = 0;
+    rs.depthBiasSlopeFactor = 0;
+    rs.lineWidth = 1;
+
+    VkPipelineColorBlendAttachmentState att_state[2];
+    for (int i = 0; i < 2; i++) {
+        att_state[i].colorWriteMask = 0xf;
+        att_state[i].blendEnable = VK_TRUE;
+        att_state[i].alphaBlendOp = VK_BLEND_OP_ADD;
+        att_state[i].colorBlendOp = VK_BLEND_OP_ADD;
+    }
+    switch (stage) {
+        case WEIGHTED_BLENDED_STAGE_TRADITIONAL_BLEND:
+            att_state[0].srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+            att_state[0].dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+            att_state[0].srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+            att_state[0].dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+            break;
+        case WEIGHTED_BLENDED_STAGE_ACCUMULATE:
+            //The accumulation is a plain sum, the revealage is multiplied by 1-alpha.
+            att_state[0].srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+            att_state[0].dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+            att_state[0].srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+            att_state[0].dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+            att_state[1].srcColorBlendFactor = VK_BLEND_FACTOR_ZERO;
+            att_state[1].dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_COLOR;
+            att_state[1].srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+            att_state[1].dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+            att_state[1].colorWriteMask = VK_COLOR_COMPONENT_R_BIT;
+            break;
+        default:
+            //Under the colour buffer, as the depth peel blend does.
+            att_state[0].srcColorBlendFactor = VK_BLEND_FACTOR_DST_ALPHA;
+            att_state[0].dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+            att_state[0].srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+            att_state[0].dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    }
+
+    VkPipelineColorBlendStateCreateInfo cb;
+    cb.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    cb.flags = 0;
+    cb.pNext = NULL;
+    cb.attachmentCount = (stage == WEIGHTED_BLENDED_STAGE_ACCUMULATE) ? 2 : 1;
+    cb.pAttachments = att_state;
+    cb.logicOpEnable = VK_FALSE;
+    cb.logicOp = VK_LOGIC_OP_NO_OP;
+    cb.blendConstants[0] = 1.0f;
+    cb.blendConstants[1] = 1.0f;
+    cb.blendConstants[2] = 1.0f;
+    cb.blendConstants[3] = 1.0f;
+
+    VkPipelineViewportStateCreateInfo vp = {};
+    vp.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    vp.pNext = NULL;
+    vp.flags = 0;
+    vp.viewportCount = 1;
+    vp.pViewports = &viewport;
+    vp.scissorCount = 1;
+    if (stage == WEIGHTED_BLENDED_STAGE_TRADITIONAL_BLEND)
+        vp.pScissors = &scissor;
+    else
+        dynamicStateEnables[dynamicState.dynamicStateCount++] = VK_DYNAMIC_STATE_SCISSOR;
+
+    VkPipelineDepthStencilStateCreateInfo ds;
+    ds.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    ds.pNext = NULL;
+    ds.flags = 0;
+    ds.depthTestEnable = VK_FALSE;
+    ds.depthWriteEnable = (stage == WEIGHTED_BLENDED_STAGE_TRADITIONAL_BLEND) ? VK_TRUE : VK_FALSE;
+    ds.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+    ds.depthBoundsTestEnable = VK_FALSE;
+    ds.stencilTestEnable = VK_FALSE;
+    ds.back.failOp = VK_STENCIL_OP_KEEP;
+    ds.back.passOp = VK_STENCIL_OP_KEEP;
+    ds.back.compareOp = VK_COMPARE_OP_ALWAYS;
+    ds.back.compareMask = 0;
+    ds.back.reference = 0;
+    ds.back.depthFailOp = VK_STENCIL_OP_KEEP;
+    ds.back.writeMask = 0;
+    ds.minDepthBounds = 0;
+    ds.maxDepthBounds = 0;
+    ds.front = ds.back;
+
+    VkPipelineMultisampleStateCreateInfo ms;
+    ms.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    ms.pNext = NULL;
+    ms.flags = 0;
+    ms.pSampleMask = NULL;
+    ms.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    ms.sampleShadingEnable = VK_FALSE;
+    ms.alphaToCoverageEnable = VK_FALSE;
+    ms.alphaToOneEnable = VK_FALSE;
+    ms.minSampleShading = 0.0;
+
+    VkPipelineShaderStageCreateInfo shaderStages[2];
+    shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[0].pNext = NULL;
+    shaderStages[0].pSpecializationInfo = NULL;
+    shaderStages[0].flags = 0;
+    shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    shaderStages[0].pName = "main";
+    shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[1].pNext = NULL;
+    shaderStages[1].pSpecializationInfo = NULL;
+    shaderStages[1].flags = 0;
+    shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    shaderStages[1].pName = "main";
+
+    VkGraphicsPipelineCreateInfo pipelineInfo;
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.pNext = NULL;
+    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+    pipelineInfo.basePipelineIndex = 0;
+    pipelineInfo.flags = 0;
+    pipelineInfo.pVertexInputState = &vi;
+    pipelineInfo.pInputAssemblyState = &ia;
+    pipelineInfo.pRasterizationState = &rs;
+    pipelineInfo.pColorBlendState = &cb;
+    pipelineInfo.pTessellationState = NULL;
+    pipelineInfo.pMultisampleState = &ms;
+    pipelineInfo.pDynamicState = &dynamicState;
+    if (dynamicState.dynamicStateCount==0)
+        pipelineInfo.pDynamicState=NULL;
+    pipelineInfo.pViewportState = &vp;
+    pipelineInfo.pDepthStencilState = &ds;
+    pipelineInfo.pStages = shaderStages;
+    pipelineInfo.stageCount = 2;
+    pipelineInfo.renderPass = engine->weightedBlendedRenderPass;
+    pipelineInfo.subpass = stage;
+
+    VkShaderModule vertexShaderModule = engine->shdermodules[2];
+    VkPipelineLayout pipelineLayout = engine->pipelineLayout;
+    switch (drawMode) {
+        case DRAW_MODE_INSTANCED:
+            vertexShaderModule = engine->instancedVertexShaderModule;
+            pipelineLayout = engine->instancedPipelineLayout;
+            break;
+        case DRAW_MODE_DYNAMIC_OFFSETS:
+            pipelineLayout = engine->dynamicPipelineLayout;
+            break;
+    }
+
+    VkPipeline *pipeline;
+    switch (stage) {
+        case WEIGHTED_BLENDED_STAGE_TRADITIONAL_BLEND:
+            shaderStages[0].module = (drawMode == DRAW_MODE_INSTANCED) ? vertexShaderModule : engine->shdermodules[0];
+            shaderStages[1].module = engine->shdermodules[1];
+            pipelineInfo.layout = pipelineLayout;
+            pipeline = &engine->weightedBlendedTraditionalBlendPipelines[drawMode];
+            break;
+        case WEIGHTED_BLENDED_STAGE_ACCUMULATE:
+            shaderStages[0].module = vertexShaderModule;
+            shaderStages[1].module = engine->weightedBlendedShaderModules[0];
+            pipelineInfo.layout = pipelineLayout;
+            pipeline = &engine->weightedBlendedAccumulatePipelines[drawMode];
+            break;
+        default:
+            shaderStages[0].module = engine->shdermodules[4];
+            shaderStages[1].module = engine->weightedBlendedShaderModules[1];
+            pipelineInfo.layout = engine->weightedBlendedResolvePipelineLayout;
+            pipeline = &engine->weightedBlendedResolvePipeline;
+    }
+
+    VkResult res;
+    res = vkCreateGraphicsPipelines(engine->vkDevice, engine->pipelineCache, 1, &pipelineInfo, NULL, pipeline);
+    if (res != VK_SUCCESS) {
+        LOGE("vkCreateGraphicsPipelines returned error %d.\n", res);
+        return -1;
+    }
+    return 0;
+}
+
+//The A-buffer draws every box once, appending each fragment to a linked list per pixel held in a storage buffer
+//pool, then a full screen subpass sorts each pixel's list by depth and blends it under the image. It is exact
+//whatever the depth complexity but the pool has a fixed size: fragments past its end are dropped, counted and
+//reported (--abuffer-nodes on Linux sets the size).
+//The mode is disabled if the device can't store from fragment shaders or the shaders are missing.
+int setupABuffer(struct engine* engine, VkFormat format, VkFormat depthFormat, VkExtent2D extent)
+{
+    VkResult res;
+    engine->abufferSupported = false;
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++)
+        engine->abufferCountPending[frame] = false;
+    resetABufferStats(engine);
+
+    if (!engine->fragmentStoresAndAtomics) {
+        LOGW ("Fragment shader stores and atomics are not supported, A-buffer disabled.\n");
+        if (engine->oitMode == OIT_MODE_ABUFFER)
+            engine->oitMode = OIT_MODE_DEPTH_PEEL;
+        return 0;
+    }
+
+    const char *shaderFiles[2] = {"shaders/abuffer_build.frag.spv", "shaders/abuffer_resolve.frag.spv"};
+    for (int i = 0; i < 2; i++) {
+        int loaded = loadShaderModule(engine, shaderFiles[i], &engine->abufferShaderModules[i]);
+        if (loaded < 0)
+            return -1;
+        if (loaded > 0) {
+            LOGW ("%s not found, A-buffer disabled.\n", shaderFiles[i]);
+            if (engine->oitMode == OIT_MODE_ABUFFER)
+                engine->oitMode = OIT_MODE_DEPTH_PEEL;
+            return 0;
+        }
+    }
+
+    //The pool can't be larger than a storage buffer binding can address.
+    uint64_t capacity = engine->abufferCapacity;
+    if (capacity == 0)
+        capacity = (uint64_t)extent.width*extent.height*ABUFFER_DEFAULT_NODES_PER_PIXEL;
+    uint64_t maxCapacity = engine->deviceProperties.limits.maxStorageBufferRange/ABUFFER_NODE_SIZE;
+    if (capacity > maxCapacity) {
+        LOGW ("%llu A-buffer nodes exceed the storage buffer range, using %llu.\n",
+              (unsigned long long)capacity, (unsigned long long)maxCapacity);
+        capacity = maxCapacity;
+    }
+    engine->abufferCapacity = (uint32_t)capacity;
+    engine->abufferWidth = extent.width;
+
+    //The heads and counter are reset with transfer commands each frame, the count is then copied to the host
+    //visible readback buffer so the atomics stay in device local memory.
+    VkDeviceSize headSize = sizeof(uint32_t)*extent.width*extent.height;
+    VkDeviceSize nodeSize = (VkDeviceSize)ABUFFER_NODE_SIZE*engine->abufferCapacity;
+    VkDeviceSize counterSize = sizeof(uint32_t)*4;
+    VkBuffer nodeBuffer;
+    VkDeviceMemory headMemory, nodeMemory, counterMemory, readbackMemory;
+    if (createBuffer(engine, headSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &engine->abufferHeadBuffer, &headMemory) != 0)
+        return -1;
+    if (createBuffer(engine, nodeSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &nodeBuffer, &nodeMemory) != 0)
+        return -1;
+    if (createBuffer(engine, counterSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &engine->abufferCounterBuffer, &counterMemory) != 0)
+        return -1;
+    if (createBuffer(engine, sizeof(uint32_t)*MAX_FRAMES_IN_FLIGHT, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &engine->abufferReadbackBuffer, &readbackMemory) != 0)
+        return -1;
+
+    res = vkMapMemory(engine->vkDevice, readbackMemory, 0, VK_WHOLE_SIZE, 0, (void **)&engine->abufferReadbackMappedMemory);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkMapMemory returned error %d.\n", res);
+        return -1;
+    }
+
+    //The attachments: the swapchain image and traditional blend depth buffer shared with the depth peel render
+    //pass. The lists live in storage buffers so the build subpass has no attachments at all.
+    const uint32_t colourAttachment = 0;
+    const uint32_t depthAttachment = 1;
+    const int attachmentCount = 2;
+
+    VkAttachmentDescription attachments[attachmentCount];
+    for (int i = 0; i < attachmentCount; i++) {
+        attachments[i].samples = VK_SAMPLE_COUNT_1_BIT;
+        attachments[i].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        attachments[i].storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        attachments[i].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+        attachments[i].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        attachments[i].flags = 0;
+    }
+    attachments[colourAttachment].format = format;
+    attachments[colourAttachment].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    attachments[colourAttachment].initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attachments[colourAttachment].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    attachments[depthAttachment].format = depthFormat;
+    attachments[depthAttachment].loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    attachments[depthAttachment].initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    attachments[depthAttachment].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentReference colour_reference = {colourAttachment, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+    VkAttachmentReference depth_reference = {depthAttachment, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL};
+
+    const uint32_t subpassCount = 3;
+    VkSubpassDescription subpasses[subpassCount];
+    for (uint32_t subpass = 0; subpass < subpassCount; subpass++) {
+        subpasses[subpass].pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+        subpasses[subpass].flags = 0;
+        subpasses[subpass].inputAttachmentCount = 0;
+        subpasses[subpass].pInputAttachments = NULL;
+        subpasses[subpass].colorAttachmentCount = 1;
+        subpasses[subpass].pColorAttachments = &colour_reference;
+        subpasses[subpass].pResolveAttachments = NULL;
+        subpasses[subpass].pDepthStencilAttachment = NULL;
+        subpasses[subpass].preserveAttachmentCount = 0;
+        subpasses[subpass].pPreserveAttachments = NULL;
+    }
+    subpasses[0].pDepthStencilAttachment = &depth_reference;
+    subpasses[1].colorAttachmentCount = 0;
+    subpasses[1].pColorAttachments = NULL;
+    subpasses[1].preserveAttachmentCount = 1;
+    subpasses[1].pPreserveAttachments = &colourAttachment;
+
+    //The resolve blends over the traditional blend's colour and reads the lists the build wrote. A pixel's nodes
+    //can be anywhere in the pool so the second dependency isn't by region.
+    VkSubpassDependency subpassDependencies[2];
+    subpassDependencies[0].srcSubpass = 0;
+    subpassDependencies[0].dstSubpass = 2;
+    subpassDependencies[0].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    subpassDependencies[0].dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    subpassDependencies[0].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    subpassDependencies[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    subpassDependencies[0].dependencyFlags = VK_DEPENDENCY_BY_REGION_BIT;
+    subpassDependencies[1].srcSubpass = 1;
+    subpassDependencies[1].dstSubpass = 2;
+    subpassDependencies[1].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    subpassDependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    subpassDependencies[1].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    subpassDependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    subpassDependencies[1].dependencyFlags = 0;
+
+    VkRenderPassCreateInfo rp_info;
+    rp_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    rp_info.pNext = NULL;
+    rp_info.flags=0;
+    rp_info.attachmentCount = attachmentCount;
+    rp_info.pAttachments = attachments;
+    rp_info.subpassCount = subpassCount;
+    rp_info.pSubpasses = subpasses;
+    rp_info.dependencyCount = 2;
+    rp_info.pDependencies = subpassDependencies;
+    res = vkCreateRenderPass(engine->vkDevice, &rp_info, NULL, &engine->abufferRenderPass);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateRenderPass returned error. %d\n", res);
+        return -1;
+    }
+
+    engine->abufferFramebuffers=new VkFramebuffer[engine->swapchainImageCount];
+    for (uint32_t i = 0; i < engine->swapchainImageCount; i++) {
+        VkImageView views[attachmentCount];
+        views[colourAttachment] = engine->swapChainViews[i];
+        views[depthAttachment] = engine->depthAttachmentView[0];
+
+        VkFramebufferCreateInfo fb_info;
+        fb_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        fb_info.pNext = NULL;
+        fb_info.renderPass = engine->abufferRenderPass;
+        fb_info.attachmentCount = attachmentCount;
+        fb_info.pAttachments = views;
+        fb_info.width = extent.width;
+        fb_info.height = extent.height;
+        fb_info.layers = 1;
+        fb_info.flags = 0;
+
+        res = vkCreateFramebuffer(engine->vkDevice, &fb_info, NULL, &engine->abufferFramebuffers[i]);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkCreateFramebuffer returned error %d.\n", res);
+            return -1;
+        }
+    }
+
+    //The heads, nodes and counter are set 2 of the build and resolve pipelines.
+    VkDescriptorSetLayoutBinding layout_bindings[3];
+    for (int i = 0; i < 3; i++) {
+        layout_bindings[i].binding = i;
+        layout_bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        layout_bindings[i].descriptorCount = 1;
+        layout_bindings[i].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+        layout_bindings[i].pImmutableSamplers = NULL;
+    }
+
+    VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo;
+    descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptorSetLayoutCreateInfo.flags = 0;
+    descriptorSetLayoutCreateInfo.pNext = NULL;
+    descriptorSetLayoutCreateInfo.bindingCount = 3;
+    descriptorSetLayoutCreateInfo.pBindings = layout_bindings;
+
+    VkDescriptorSetLayout abufferDescriptorSetLayout;
+    res = vkCreateDescriptorSetLayout(engine->vkDevice, &descriptorSetLayoutCreateInfo, NULL, &abufferDescriptorSetLayout);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateDescriptorSetLayout returned error.\n");
+        return -1;
+    }
+
+    //Each draw mode's model set then the scene set, as in its own pipeline layout.
+    VkDescriptorSetLayout modelSetLayouts[DRAW_MODE_COUNT];
+    modelSetLayouts[DRAW_MODE_DESCRIPTOR_SETS] = engine->descriptorSetLayouts[0];
+    modelSetLayouts[DRAW_MODE_INSTANCED] = engine->instanceDescriptorSetLayout;
+    modelSetLayouts[DRAW_MODE_DYNAMIC_OFFSETS] = engine->dynamicModelDescriptorSetLayout;
+    for (int drawMode = 0; drawMode < DRAW_MODE_COUNT; drawMode++) {
+        VkDescriptorSetLayout setLayouts[3];
+        setLayouts[0] = modelSetLayouts[drawMode];
+        setLayouts[1] = engine->descriptorSetLayouts[1];
+        setLayouts[2] = abufferDescriptorSetLayout;
+
+        VkPipelineLayoutCreateInfo pPipelineLayoutCreateInfo;
+        pPipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+        pPipelineLayoutCreateInfo.flags = 0;
+        pPipelineLayoutCreateInfo.pNext = NULL;
+        pPipelineLayoutCreateInfo.pushConstantRangeCount = 0;
+        pPipelineLayoutCreateInfo.pPushConstantRanges = NULL;
+        pPipelineLayoutCreateInfo.setLayoutCount = 3;
+        pPipelineLayoutCreateInfo.pSetLayouts = setLayouts;
+        res = vkCreatePipelineLayout(engine->vkDevice, &pPipelineLayoutCreateInfo, NULL, &engine->abufferPipelineLayouts[drawMode]);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkCreatePipelineLayout returned error.\n");
+            return -1;
+        }
+    }
+
+    VkDescriptorPoolSize typeCounts[1];
+    typeCounts[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    typeCounts[0].descriptorCount = 3;
+
+    VkDescriptorPoolCreateInfo descriptorPoolInfo;
+    descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolInfo.flags = 0;
+    descriptorPoolInfo.pNext = NULL;
+    descriptorPoolInfo.maxSets = 1;
+    descriptorPoolInfo.poolSizeCount = 1;
+    descriptorPoolInfo.pPoolSizes = typeCounts;
+
+    VkDescriptorPool descriptorPool;
+    res = vkCreateDescriptorPool(engine->vkDevice, &descriptorPoolInfo, NULL, &descriptorPool);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateDescriptorPool returned error %d.\n", res);
+        return -1;
+    }
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.pNext = NULL;
+    descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = 1;
+    descriptorSetAllocateInfo.pSetLayouts = &abufferDescriptorSetLayout;
+    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, &engine->abufferDescriptorSet);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkAllocateDescriptorSets returned error %d.\n", res);
+        return -1;
+    }
+
+    VkDescriptorBufferInfo bufferInfo[3];
+    bufferInfo[0].buffer = engine->abufferHeadBuffer;
+    bufferInfo[0].offset = 0;
+    bufferInfo[0].range = headSize;
+    bufferInfo[1].buffer = nodeBuffer;
+    bufferInfo[1].offset = 0;
+    bufferInfo[1].range = nodeSize;
+    bufferInfo[2].buffer = engine->abufferCounterBuffer;
+    bufferInfo[2].offset = 0;
+    bufferInfo[2].range = counterSize;
+
+    VkWriteDescriptorSet writes[3];
+    for (int i = 0; i < 3; i++) {
+        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[i].pNext = NULL;
+        writes[i].dstSet = engine->abufferDescriptorSet;
+        writes[i].descriptorCount = 1;
+        writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writes[i].pBufferInfo = &bufferInfo[i];
+        writes[i].dstArrayElement = 0;
+        writes[i].dstBinding = i;
+    }
+    vkUpdateDescriptorSets(engine->vkDevice, 3, writes, 0, NULL);
+
+    engine->abufferSupported = true;
+    LOGI("A-buffer available, %u nodes (%.1f MB)", engine->abufferCapacity, nodeSize/(1024.0*1024.0));
+    return 0;
+}
+
+//Creates one of the A-buffer pipelines. The traditional blend and build stages are created for one draw mode, the
+//resolve is shared by all of them.
+int setupABufferPipeline(struct engine* engine, int drawMode, int stage)
+{
+    const char *stageNames[] = {"trad blend", "build", "resolve"};
+    if (stage == ABUFFER_STAGE_RESOLVE)
+        LOGI("Setting up A-buffer %s pipeline", stageNames[stage]);
+    else
+        LOGI("Setting up A-buffer %s pipeline (%s)", stageNames[stage], drawModeNames[drawMode]);
+
+    //The traditional blend draws to the left half, as in the depth peel render pass.
+    VkRect2D scissor;
+    scissor.extent.width = engine->width / 2;
+    scissor.extent.height = engine->height;
+    scissor.offset.x = 0;
+    scissor.offset.y = 0;
+
+    VkViewport viewport;
+    viewport.height = (float) engine->height;
+    viewport.width = (float) engine->width;
+    viewport.minDepth = (float) 0.0f;
+    viewport.maxDepth = (float) 1.0f;
+    viewport.x = 0;
+    viewport.y = 0;
+
+    VkDynamicState dynamicStateEnables[VK_DYNAMIC_STATE_RANGE_SIZE];
+    VkPipelineDynamicStateCreateInfo dynamicState;
+    memset(dynamicStateEnables, 0, sizeof dynamicStateEnables);
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.flags = 0;
+    dynamicState.pNext = NULL;
+    dynamicState.pDynamicStates = dynamicStateEnables;
+    dynamicState.dynamicStateCount = 0;
+
+    VkPipelineVertexInputStateCreateInfo vi;
+    vi.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vi.pNext = NULL;
+    vi.flags = 0;
+    vi.vertexBindingDescriptionCount = 1;
+    vi.pVertexBindingDescriptions = &engine->vertexInputBindingDescription;
+    vi.vertexAttributeDescriptionCount = (stage == ABUFFER_STAGE_RESOLVE) ? 1 : 2;
+    vi.pVertexAttributeDescriptions = engine->vertexInputAttributeDescription;
+
+    VkPipelineInputAssemblyStateCreateInfo ia;
+    ia.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    ia.pNext = NULL;
+    ia.flags = 0;
+    ia.primitiveRestartEnable = VK_FALSE;
+    ia.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+    VkPipelineRasterizationStateCreateInfo rs;
+    rs.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rs.pNext = NULL;
+    rs.flags = 0;
+    rs.polygonMode = VK_POLYGON_MODE_FILL;
+    rs.cullMode = (stage == ABUFFER_STAGE_RESOLVE) ? VK_CULL_MODE_BACK_BIT : VK_CULL_MODE_NONE;
+    rs.frontFace = VK_FRONT_FACE_CLOCKWISE;
+    rs.depthClampEnable = VK_TRUE;
+    rs.rasterizerDiscardEnable = VK_FALSE;
+    rs.depthBiasEnable = VK_FALSE;
+    rs.depthBiasConstantFactor = 0;
+    rs.depthBiasClamp = 0;
+    rs.depthBiasSlopeFactor = 0;
+    rs.lineWidth = 1;
+
+    VkPipelineColorBlendAttachmentState att_state[1];
+    att_state[0].colorWriteMask = 0xf;
+    att_state[0].blendEnable = VK_TRUE;
+    att_state[0].alphaBlendOp = VK_BLEND_OP_ADD;
+    att_state[0].colorBlendOp = VK_BLEND_OP_ADD;
+    switch (stage) {
+        case ABUFFER_STAGE_TRADITIONAL_BLEND:
+            att_state[0].srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+            att_state[0].dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+            att_state[0].srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+            att_state[0].dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+            break;
+        default:
+            //Under the colour buffer, as the depth peel blend does.
+            att_state[0].srcColorBlendFactor = VK_BLEND_FACTOR_DST_ALPHA;
+            att_state[0].dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+            att_state[0].srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+            att_state[0].dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    }
+
+    VkPipelineColorBlendStateCreateInfo cb;
+    cb.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    cb.flags = 0;
+    cb.pNext = NULL;
+    cb.attachmentCount = (stage == ABUFFER_STAGE_BUILD) ? 0 : 1; //The build only writes to the storage buffers.
+    cb.pAttachments = att_state;
+    cb.logicOpEnable = VK_FALSE;
+    cb.logicOp = VK_LOGIC_OP_NO_OP;
+    cb.blendConstants[0] = 1.0f;
+    cb.blendConstants[1] = 1.0f;
+    cb.blendConstants[2] = 1.0f;
+    cb.blendConstants[3] = 1.0f;
+
+    VkPipelineViewportStateCreateInfo vp = {};
+    vp.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    vp.pNext = NULL;
+    vp.flags = 0;
+    vp.viewportCount = 1;
+    vp.pViewports = &viewport;
+    vp.scissorCount = 1;
+    if (stage == ABUFFER_STAGE_TRADITIONAL_BLEND)
+        vp.pScissors = &scissor;
+    else
+        dynamicStateEnables[dynamicState.dynamicStateCount++] = VK_DYNAMIC_STATE_SCISSOR;
+
+    VkPipelineDepthStencilStateCreateInfo ds;
+    ds.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    ds.pNext = NULL;
+    ds.flags = 0;
+    ds.depthTestEnable = VK_FALSE;
+    ds.depthWriteEnable = (stage == ABUFFER_STAGE_TRADITIONAL_BLEND) ? VK_TRUE : VK_FALSE;
+    ds.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+    ds.depthBoundsTestEnable = VK_FALSE;
+    ds.stencilTestEnable = VK_FALSE;
+    ds.back.failOp = VK_STENCIL_OP_KEEP;
+    ds.back.passOp = VK_STENCIL_OP_KEEP;
+    ds.back.compareOp = VK_COMPARE_OP_ALWAYS;
+    ds.back.compareMask = 0;
+    ds.back.reference = 0;
+    ds.back.depthFailOp = VK_STENCIL_OP_KEEP;
+    ds.back.writeMask = 0;
+    ds.minDepthBounds = 0;
+    ds.maxDepthBounds = 0;
+    ds.front = ds.back;
+
+    VkPipelineMultisampleStateCreateInfo ms;
+    ms.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    ms.pNext = NULL;
+    ms.flags = 0;
+    ms.pSampleMask = NULL;
+    ms.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    ms.sampleShadingEnable = VK_FALSE;
+    ms.alphaToCoverageEnable = VK_FALSE;
+    ms.alphaToOneEnable = VK_FALSE;
+    ms.minSampleShading = 0.0;
+
+    VkPipelineShaderStageCreateInfo shaderStages[2];
+    shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[0].pNext = NULL;
+    shaderStages[0].pSpecializationInfo = NULL;
+    shaderStages[0].flags = 0;
+    shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    shaderStages[0].pName = "main";
+    shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[1].pNext = NULL;
+    shaderStages[1].pSpecializationInfo = NULL;
+    shaderStages[1].flags = 0;
+    shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    shaderStages[1].pName = "main";
+
+    VkGraphicsPipelineCreateInfo pipelineInfo;
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.pNext = NULL;
+    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+    pipelineInfo.basePipelineIndex = 0;
+    pipelineInfo.flags = 0;
+    pipelineInfo.pVertexInputState = &vi;
+    pipelineInfo.pInputAssemblyState = &ia;
+    pipelineInfo.pRasterizationState = &rs;
+    pipelineInfo.pColorBlendState = &cb;
+    pipelineInfo.pTessellationState = NULL;
+    pipelineInfo.pMultisampleState = &ms;
+    pipelineInfo.pDynamicState = &dynamicState;
+    if (dynamicState.dynamicStateCount==0)
+        pipelineInfo.pDynamicState=NULL;
+    pipelineInfo.pViewportState = &vp;
+    pipelineInfo.pDepthStencilState = &ds;
+    pipelineInfo.pStages = shaderStages;
+    pipelineInfo.stageCount = 2;
+    pipelineInfo.renderPass = engine->abufferRenderPass;
+    pipelineInfo.subpass = stage;
+
+    VkShaderModule vertexShaderModule = engine->shdermodules[2];
+    VkPipelineLayout pipelineLayout = engine->pipelineLayout;
+    switch (drawMode) {
+        case DRAW_MODE_INSTANCED:
+            vertexShaderModule = engine->instancedVertexShaderModule;
+            pipelineLayout = engine->instancedPipelineLayout;
+            break;
+        case DRAW_MODE_DYNAMIC_OFFSETS:
+            pipelineLayout = engine->dynamicPipelineLayout;
+            break;
+    }
+
+    VkPipeline *pipeline;
+    switch (stage) {
+        case ABUFFER_STAGE_TRADITIONAL_BLEND:
+            shaderStages[0].module = (drawMode == DRAW_MODE_INSTANCED) ? vertexShaderModule : engine->shdermodules[0];
+            shaderStages[1].module = engine->shdermodules[1];
+            pipelineInfo.layout = pipelineLayout;
+            pipeline = &engine->abufferTraditionalBlendPipelines[drawMode];
+            break;
+        case ABUFFER_STAGE_BUILD:
+            shaderStages[0].module = vertexShaderModule;
+            shaderStages[1].module = engine->abufferShaderModules[0];
+            pipelineInfo.layout = engine->abufferPipelineLayouts[drawMode];
+            pipeline = &engine->abufferBuildPipelines[drawMode];
+            break;
+        default:
+            shaderStages[0].module = engine->shdermodules[4];
+            shaderStages[1].module = engine->abufferShaderModules[1];
+            pipelineInfo.layout = engine->abufferPipelineLayouts[DRAW_MODE_DESCRIPTOR_SETS];
+            pipeline = &engine->abufferResolvePipeline;
+    }
+
+    VkResult res;
+    res = vkCreateGraphicsPipelines(engine->vkDevice, engine->pipelineCache, 1, &pipelineInfo, NULL, pipeline);
+    if (res != VK_SUCCESS) {
+        LOGE("vkCreateGraphicsPipelines returned error %d.\n", res);
+        return -1;
+    }
+    return 0;
+}
+
+//Saturation termination stops peeling pixels that deeper layers can't change. Each blend subpass multiplies a
+//transmittance attachment by one minus the layer's alpha, then every peel after the first starts by drawing a
+//full screen mark that sets the stencil of pixels the previous peel found nothing at or that let almost no
+//light through. The peel's stencil test then rejects those pixels before the peel shader runs.
+//The mode is disabled if the depth format has no stencil or the shaders are missing.
+int setupSaturationTermination(struct engine* engine, VkFormat depthFormat)
+{
+    VkResult res;
+    engine->saturationSupported = false;
+
+    if (!engine->depthHasStencil) {
+        LOGW ("Depth format %d has no stencil, saturation termination disabled.\n", depthFormat);
+        engine->saturationTermination = false;
+        return 0;
+    }
+
+    const char *shaderFiles[2] = {"shaders/saturation_mark.frag.spv", "shaders/saturation_blend.frag.spv"};
+    for (int i = 0; i < 2; i++) {
+        int loaded = loadShaderModule(engine, shaderFiles[i], &engine->saturationShaderModules[i]);
+        if (loaded < 0)
+            return -1;
+        if (loaded > 0) {
+            LOGW ("%s not found, saturation termination disabled.\n", shaderFiles[i]);
+            engine->saturationTermination = false;
+            return 0;
+        }
+    }
+
+    //The mark reads the previous peel's depth as set 2 and the transmittance as set 3.
+    VkDescriptorSetLayout markSetLayouts[4];
+    markSetLayouts[0] = engine->descriptorSetLayouts[0];
+    markSetLayouts[1] = engine->descriptorSetLayouts[1];
+    markSetLayouts[2] = engine->descriptorSetLayouts[2];
+    markSetLayouts[3] = engine->descriptorSetLayouts[2];
+
+    VkPipelineLayoutCreateInfo pPipelineLayoutCreateInfo;
+    pPipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pPipelineLayoutCreateInfo.flags = 0;
+    pPipelineLayoutCreateInfo.pNext = NULL;
+    pPipelineLayoutCreateInfo.pushConstantRangeCount = 0;
+    pPipelineLayoutCreateInfo.pPushConstantRanges = NULL;
+    pPipelineLayoutCreateInfo.setLayoutCount = 4;
+    pPipelineLayoutCreateInfo.pSetLayouts = markSetLayouts;
+    res = vkCreatePipelineLayout(engine->vkDevice, &pPipelineLayoutCreateInfo, NULL, &engine->saturationMarkPipelineLayout);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreatePipelineLayout returned error.\n");
+        return -1;
+    }
+
+    VkDescriptorPoolSize typeCounts[1];
+    typeCounts[0].type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+    typeCounts[0].descriptorCount = 1;
+
+    VkDescriptorPoolCreateInfo descriptorPoolInfo;
+    descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolInfo.flags = 0;
+    descriptorPoolInfo.pNext = NULL;
+    descriptorPoolInfo.maxSets = 1;
+    descriptorPoolInfo.poolSizeCount = 1;
+    descriptorPoolInfo.pPoolSizes = typeCounts;
+
+    VkDescriptorPool descriptorPool;
+    res = vkCreateDescriptorPool(engine->vkDevice, &descriptorPoolInfo, NULL, &descriptorPool);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateDescriptorPool returned error %d.\n", res);
+        return -1;
+    }
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.pNext = NULL;
+    descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = 1;
+    descriptorSetAllocateInfo.pSetLayouts = &markSetLayouts[3];
+    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, &engine->transmittanceDescriptorSet);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkAllocateDescriptorSets returned error %d.\n", res);
+        return -1;
+    }
+
+    VkDescriptorImageInfo imageInfo;
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    imageInfo.imageView = engine->transmittanceView;
+    imageInfo.sampler = VK_NULL_HANDLE;
+    VkWriteDescriptorSet write;
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.pNext = NULL;
+    write.dstSet = engine->transmittanceDescriptorSet;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+    write.pImageInfo = &imageInfo;
+    write.dstArrayElement = 0;
+    write.dstBinding = 0;
+    vkUpdateDescriptorSets(engine->vkDevice, 1, &write, 0, NULL);
+
+    engine->saturationSupported = true;
+    LOGI("Saturation termination available");
+    return 0;
+}
+
+//Creates the pipeline drawing the saturation termination mark at the start of the peels after the first. It
+//writes only the stencil, which the peel's clear has just zeroed.
+int setupSaturationMarkPipeline(struct engine* engine)
+{
+    LOGI("Setting up saturation mark pipeline");
+
+    VkViewport viewport;
+    viewport.height = (float) engine->height;
+    viewport.width = (float) engine->width;
+    viewport.minDepth = (float) 0.0f;
+    viewport.maxDepth = (float) 1.0f;
+    viewport.x = 0;
+    viewport.y = 0;
+
+    VkDynamicState dynamicStateEnables[VK_DYNAMIC_STATE_RANGE_SIZE];
+    VkPipelineDynamicStateCreateInfo dynamicState;
+    memset(dynamicStateEnables, 0, sizeof dynamicStateEnables);
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.flags = 0;
+    dynamicState.pNext = NULL;
+    dynamicState.pDynamicStates = dynamicStateEnables;
+    dynamicState.dynamicStateCount = 0;
+    dynamicStateEnables[dynamicState.dynamicStateCount++] = VK_DYNAMIC_STATE_SCISSOR;
+
+    VkPipelineVertexInputStateCreateInfo vi;
+    vi.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vi.pNext = NULL;
+    vi.flags = 0;
+    vi.vertexBindingDescriptionCount = 1;
+    vi.pVertexBindingDescriptions = &engine->vertexInputBindingDescription;
+    vi.vertexAttributeDescriptionCount = 1;
+    vi.pVertexAttributeDescriptions = engine->vertexInputAttributeDescription;
+
+    VkPipelineInputAssemblyStateCreateInfo ia;
+    ia.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    ia.pNext = NULL;
+    ia.flags = 0;
+    ia.primitiveRestartEnable = VK_FALSE;
+    ia.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+    VkPipelineRasterizationStateCreateInfo rs;
+    rs.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rs.pNext = NULL;
+    rs.flags = 0;
+    rs.polygonMode = VK_POLYGON_MODE_FILL;
+    rs.cullMode = VK_CULL_MODE_BACK_BIT;
+    rs.frontFace = VK_FRONT_FACE_CLOCKWISE;
+    rs.depthClampEnable = VK_TRUE;
+    rs.rasterizerDiscardEnable = VK_FALSE;
+    rs.depthBiasEnable = VK_FALSE;
+    rs.depthBiasConstantFactor = 0;
+    rs.depthBiasClamp = 0;
+    rs.depthBiasSlopeFactor = 0;
+    rs.lineWidth = 1;
+
+    //The peel colour is left alone.
+    VkPipelineColorBlendStateCreateInfo cb;
+    cb.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    cb.flags = 0;
+    cb.pNext = NULL;
+    VkPipelineColorBlendAttachmentState att_state[1] = {};
+    att_state[0].colorWriteMask = 0;
+    att_state[0].blendEnable = VK_FALSE;
+    cb.attachmentCount = 1;
+    cb.pAttachments = att_state;
+    cb.logicOpEnable = VK_FALSE;
+    cb.logicOp = VK_LOGIC_OP_NO_OP;
+    cb.blendConstants[0] = 1.0f;
+    cb.blendConstants[1] = 1.0f;
+    cb.blendConstants[2] = 1.0f;
+    cb.blendConstants[3] = 1.0f;
+
+    VkPipelineViewportStateCreateInfo vp = {};
+    vp.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    vp.pNext = NULL;
+    vp.flags = 0;
+    vp.viewportCount = 1;
+    vp.pViewports = &viewport;
+    vp.scissorCount = 1;
+
+    VkPipelineDepthStencilStateCreateInfo ds;
+    ds.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    ds.pNext = NULL;
+    ds.flags = 0;
+    ds.depthTestEnable = VK_FALSE;
+    ds.depthWriteEnable = VK_FALSE;
+    ds.depthCompareOp = VK_COMPARE_OP_ALWAYS;
+    ds.depthBoundsTestEnable = VK_FALSE;
+    ds.stencilTestEnable = VK_TRUE;
+    ds.back.failOp = VK_STENCIL_OP_KEEP;
+    ds.back.passOp = VK_STENCIL_OP_REPLACE;
+    ds.back.compareOp = VK_COMPARE_OP_ALWAYS;
+    ds.back.compareMask = 1;
+    ds.back.reference = 1;
+    ds.back.depthFailOp = VK_STENCIL_OP_KEEP;
+    ds.back.writeMask = 1;
+    ds.minDepthBounds = 0;
+    ds.maxDepthBounds = 1;
+    ds.front = ds.back;
+
+    VkPipelineMultisampleStateCreateInfo ms;
+    ms.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    ms.pNext = NULL;
+    ms.flags = 0;
+    ms.pSampleMask = NULL;
+    ms.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    ms.sampleShadingEnable = VK_FALSE;
+    ms.alphaToCoverageEnable = VK_FALSE;
+    ms.alphaToOneEnable = VK_FALSE;
+    ms.minSampleShading = 0.0;
+
+    VkPipelineShaderStageCreateInfo shaderStages[2];
+    shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[0].pNext = NULL;
+    shaderStages[0].pSpecializationInfo = NULL;
+    shaderStages[0].flags = 0;
+    shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    shaderStages[0].pName = "main";
+    shaderStages[0].module = engine->shdermodules[4];
+    shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStages[1].pNext = NULL;
+    shaderStages[1].pSpecializationInfo = NULL;
+    shaderStages[1].flags = 0;
+    shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    shaderStages[1].pName = "main";
+    shaderStages[1].module = engine->saturationShaderModules[0];
+
+    VkGraphicsPipelineCreateInfo pipelineInfo;
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.pNext = NULL;
+    pipelineInfo.layout = engine->saturationMarkPipelineLayout;
+    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+    pipelineInfo.basePipelineIndex = 0;
+    pipelineInfo.flags = 0;
+    pipelineInfo.pVertexInputState = &vi;
+    pipelineInfo.pInputAssemblyState = &ia;
+    pipelineInfo.pRasterizationState = &rs;
+    pipelineInfo.pColorBlendState = &cb;
+    pipelineInfo.pTessellationState = NULL;
+    pipelineInfo.pMultisampleState = &ms;
+    pipelineInfo.pDynamicState = &dynamicState;
+    pipelineInfo.pViewportState = &vp;
+    pipelineInfo.pDepthStencilState = &ds;
+    pipelineInfo.pStages = shaderStages;
+    pipelineInfo.stageCount = 2;
+    pipelineInfo.renderPass = engine->renderPass;
+    pipelineInfo.subpass = 3;
+
+    VkResult res;
+    res = vkCreateGraphicsPipelines(engine->vkDevice, engine->pipelineCache, 1, &pipelineInfo, NULL, &engine->saturationMarkPipeline);
+    if (res != VK_SUCCESS) {
+        LOGE("vkCreateGraphicsPipelines returned error %d.\n", res);
+        return -1;
+    }
+    return 0;
+}
+
+//Every pipeline is an independent job so several can be compiled at once on different threads.
+enum PipelineJobType {
+    PIPELINE_JOB_TRADITIONAL_BLEND,
+    PIPELINE_JOB_FIRST_PEEL,
+    PIPELINE_JOB_PEEL,
+    PIPELINE_JOB_BLEND,
+    PIPELINE_JOB_SIMULATION,
+    PIPELINE_JOB_DUAL_PEEL,
+    PIPELINE_JOB_WEIGHTED_BLENDED,
+    PIPELINE_JOB_ABUFFER,
+    PIPELINE_JOB_SATURATION_BLEND,
+    PIPELINE_JOB_SATURATION_MARK,
+    PIPELINE_JOB_CULL
+};
+
+struct PipelineJob {
+    PipelineJobType type;
+    int drawMode;
+    int stage; //For the dual depth peel, weighted blended and A-buffer jobs.
+};
+
+int runPipelineJob(struct engine* engine, const PipelineJob &job)
+{
+    switch (job.type) {
+        case PIPELINE_JOB_TRADITIONAL_BLEND:
+            return setupTraditionalBlendPipeline(engine, job.drawMode);
+        case PIPELINE_JOB_FIRST_PEEL:
+            return setupPeelPipeline(engine, job.drawMode, true);
+        case PIPELINE_JOB_PEEL:
+            return setupPeelPipeline(engine, job.drawMode, false);
+        case PIPELINE_JOB_BLEND:
+            return setupBlendPipeline(engine, false);
+        case PIPELINE_JOB_SIMULATION:
+            return setupSimulationPipeline(engine);
+        case PIPELINE_JOB_DUAL_PEEL:
+            return setupDualPeelPipeline(engine, job.drawMode, job.stage);
+        case PIPELINE_JOB_WEIGHTED_BLENDED:
+            return setupWeightedBlendedPipeline(engine, job.drawMode, job.stage);
+        case PIPELINE_JOB_ABUFFER:
+            return setupABufferPipeline(engine, job.drawMode, job.stage);
+        case PIPELINE_JOB_SATURATION_BLEND:
+            return setupBlendPipeline(engine, true);
+        case PIPELINE_JOB_SATURATION_MARK:
+            return setupSaturationMarkPipeline(engine);
+        case PIPELINE_JOB_CULL:
+            return setupCullPipeline(engine);
+    }
+    return -1;
+}
+
+//Adds the jobs for the pipelines used in the current depth peel render pass. Peels after the first and the
+//saturation mark are drawn from subpass 3 on, which a one layer render pass doesn't have.
+void addDepthPeelPipelineJobs(struct engine* engine, std::vector<PipelineJob> &firstFrameJobs, std::vector<PipelineJob> &laterJobs)
+{
+    for (int drawMode = 0; drawMode < DRAW_MODE_COUNT; drawMode++) {
+        if (drawMode == DRAW_MODE_INSTANCED && !engine->instancingSupported)
+            continue;
+        std::vector<PipelineJob> &jobs = (drawMode == engine->drawMode) ? firstFrameJobs : laterJobs;
+        PipelineJob traditionalBlendJob = {PIPELINE_JOB_TRADITIONAL_BLEND, drawMode};
+        PipelineJob firstPeelJob = {PIPELINE_JOB_FIRST_PEEL, drawMode};
+        PipelineJob peelJob = {PIPELINE_JOB_PEEL, drawMode};
+        jobs.push_back(traditionalBlendJob);
+        jobs.push_back(firstPeelJob);
+        if (engine->renderPassLayers > 1)
+            jobs.push_back(peelJob);
+    }
+    PipelineJob blendJob = {PIPELINE_JOB_BLEND, 0};
+    firstFrameJobs.push_back(blendJob);
+    if (engine->saturationSupported) {
+        std::vector<PipelineJob> &jobs = engine->saturationTermination ? firstFrameJobs : laterJobs;
+        PipelineJob saturationBlendJob = {PIPELINE_JOB_SATURATION_BLEND, 0};
+        PipelineJob saturationMarkJob = {PIPELINE_JOB_SATURATION_MARK, 0};
+        jobs.push_back(saturationBlendJob);
+        if (engine->renderPassLayers > 1)
+            jobs.push_back(saturationMarkJob);
+    }
+}
+
+//Creates the pipelines the first frame needs across the worker pool and starts a background thread for the
+//pipelines of the other draw modes, waitForPipelines must be called before any of those are used.
+void setupPipelines(struct engine* engine)
+{
+    std::vector<PipelineJob> firstFrameJobs;
+    std::vector<PipelineJob> laterJobs;
+    addDepthPeelPipelineJobs(engine, firstFrameJobs, laterJobs);
+    if (engine->dualPeelSupported) {
+        bool dualPeelFirst = engine->oitMode == OIT_MODE_DUAL_PEEL;
+        for (int drawMode = 0; drawMode < DRAW_MODE_COUNT; drawMode++) {
+            if (drawMode == DRAW_MODE_INSTANCED && !engine->instancingSupported)
+                continue;
+            std::vector<PipelineJob> &jobs = (dualPeelFirst && drawMode == engine->drawMode) ? firstFrameJobs : laterJobs;
+            for (int stage = DUAL_PEEL_STAGE_TRADITIONAL_BLEND; stage <= DUAL_PEEL_STAGE_PEEL; stage++) {
+                PipelineJob dualPeelJob = {PIPELINE_JOB_DUAL_PEEL, drawMode, stage};
+                jobs.push_back(dualPeelJob);
+            }
+        }
+        for (int stage = DUAL_PEEL_STAGE_FRONT_BLEND; stage <= DUAL_PEEL_STAGE_COMPOSITE; stage++) {
+            PipelineJob dualPeelJob = {PIPELINE_JOB_DUAL_PEEL, 0, stage};
+            (dualPeelFirst ? firstFrameJobs : laterJobs).push_back(dualPeelJob);
+        }
+    }
+    if (engine->weightedBlendedSupported) {
+        bool weightedBlendedFirst = engine->oitMode == OIT_MODE_WEIGHTED_BLENDED;
+        for (int drawMode = 0; drawMode < DRAW_MODE_COUNT; drawMode++) {
+            if (drawMode == DRAW_MODE_INSTANCED && !engine->instancingSupported)
+                continue;
+            std::vector<PipelineJob> &jobs = (weightedBlendedFirst && drawMode == engine->drawMode) ? firstFrameJobs : laterJobs;
+            for (int stage = WEIGHTED_BLENDED_STAGE_TRADITIONAL_BLEND; stage <= WEIGHTED_BLENDED_STAGE_ACCUMULATE; stage++) {
+                PipelineJob weightedBlendedJob = {PIPELINE_JOB_WEIGHTED_BLENDED, drawMode, stage};
+                jobs.push_back(weightedBlendedJob);
+            }
+        }
+        PipelineJob resolveJob = {PIPELINE_JOB_WEIGHTED_BLENDED, 0, WEIGHTED_BLENDED_STAGE_RESOLVE};
+        (weightedBlendedFirst ? firstFrameJobs : laterJobs).push_back(resolveJob);
+    }
+    if (engine->abufferSupported) {
+        bool abufferFirst = engine->oitMode == OIT_MODE_ABUFFER;
+        for (int drawMode = 0; drawMode < DRAW_MODE_COUNT; drawMode++) {
+            if (drawMode == DRAW_MODE_INSTANCED && !engine->instancingSupported)
+                continue;
+            std::vector<PipelineJob> &jobs = (abufferFirst && drawMode == engine->drawMode) ? firstFrameJobs : laterJobs;
+            for (int stage = ABUFFER_STAGE_TRADITIONAL_BLEND; stage <= ABUFFER_STAGE_BUILD; stage++) {
+                PipelineJob abufferJob = {PIPELINE_JOB_ABUFFER, drawMode, stage};
+                jobs.push_back(abufferJob);
+            }
+        }
+        PipelineJob resolveJob = {PIPELINE_JOB_ABUFFER, 0, ABUFFER_STAGE_RESOLVE};
+        (abufferFirst ? firstFrameJobs : laterJobs).push_back(resolveJob);
+    }
+    if (engine->gpuSimulationSupported) {
+        PipelineJob simulationJob = {PIPELINE_JOB_SIMULATION, 0};
+        (engine->gpuSimulation ? firstFrameJobs : laterJobs).push_back(simulationJob);
+    }
+    if (engine->gpuCullingSupported) {
+        PipelineJob cullJob = {PIPELINE_JOB_CULL, 0};
+        (engine->gpuCulling ? firstFrameJobs : laterJobs).push_back(cullJob);
+    }
+
+    std::vector<unsigned long> jobTimes(firstFrameJobs.size());
+    std::function<void(int, int, int)> runJobs = [&](int begin, int end, int worker) {
+        for (int i = begin; i < end; i++) {
+            btClock jobClock;
+            runPipelineJob(engine, firstFrameJobs[i]);
+            jobTimes[i] = jobClock.getTimeMicroseconds();
+        }
+    };
+    btClock clock;
+    engine->workerPool->parallelFor(firstFrameJobs.size(), 1, runJobs);
+    unsigned long wallTime = clock.getTimeMicroseconds();
+    unsigned long serialTime = 0;
+    for (size_t i = 0; i < jobTimes.size(); i++)
+        serialTime += jobTimes[i];
+    LOGI("Created %d first frame pipelines in %.1f ms on %d threads, %.1f ms one at a time (%.1f ms saved)",
+         (int)firstFrameJobs.size(), wallTime/1000.0f, engine->workerPool->threadCount(),
+         serialTime/1000.0f, ((long)serialTime-(long)wallTime)/1000.0f);
+
+    //The worker pool belongs to the simulation once frames start, so the rest get a thread of their own.
+    if (!laterJobs.empty())
+        engine->pipelineThread = new std::thread([engine, laterJobs]() {
+            btClock clock;
+            for (size_t i = 0; i < laterJobs.size(); i++)
+                runPipelineJob(engine, laterJobs[i]);
+            LOGI("Created %d more pipelines in the background in %.1f ms", (int)laterJobs.size(), clock.getTimeMicroseconds()/1000.0f);
+        });
+}
+
+//Waits for the background pipelines, after this every pipeline can be used.
+void waitForPipelines(struct engine* engine)
+{
+    if (engine->pipelineThread) {
+        engine->pipelineThread->join();
+        delete engine->pipelineThread;
+        engine->pipelineThread = NULL;
+    }
+}
+
+//Pipelines are only compatible with render passes with the same subpasses and dependencies, so each depth peel
+//render pass has its own depth peel pipelines. These are the engine fields holding those of the current one.
+void depthPeelPipelineFields(struct engine* engine, VkPipeline *pipelines[DEPTH_PEEL_PIPELINE_COUNT])
+{
+    VkPipeline *fields[DEPTH_PEEL_PIPELINE_COUNT] = {
+            &engine->traditionalBlendPipeline, &engine->firstPeelPipeline, &engine->peelPipeline,
+            &engine->instancedTraditionalBlendPipeline, &engine->instancedFirstPeelPipeline, &engine->instancedPeelPipeline,
+            &engine->dynamicTraditionalBlendPipeline, &engine->dynamicFirstPeelPipeline, &engine->dynamicPeelPipeline,
+            &engine->blendPipeline, &engine->saturationBlendPipeline, &engine->saturationMarkPipeline};
+    for (int i = 0; i < DEPTH_PEEL_PIPELINE_COUNT; i++)
+        pipelines[i] = fields[i];
+}
+
+//Switches depth peeling to the render pass for layers layers. The current pipelines are kept for when the layer
+//count comes back and those for the new render pass are only built the first time it is used.
+int switchLayerRenderPass(struct engine* engine, int layers)
+{
+    waitForPipelines(engine);
+    int previousLayers = engine->renderPassLayers;
+    if (selectLayerRenderPass(engine, layers) != 0)
+        return -1;
+    VkPipeline *pipelines[DEPTH_PEEL_PIPELINE_COUNT];
+    depthPeelPipelineFields(engine, pipelines);
+    struct LayerPipelines *previous = &engine->layerPipelines[previousLayers];
+    struct LayerPipelines *next = &engine->layerPipelines[layers];
+    for (int i = 0; i < DEPTH_PEEL_PIPELINE_COUNT; i++) {
+        previous->pipelines[i] = *pipelines[i];
+        *pipelines[i] = next->pipelines[i];
+    }
+    previous->created = true;
+    if (next->created) {
+        LOGI("Switched to the %d layer renderpass, reused its pipelines", layers);
+        return 0;
+    }
+    std::vector<PipelineJob> jobs;
+    addDepthPeelPipelineJobs(engine, jobs, jobs);
+    btClock clock;
+    std::function<void(int, int, int)> runJobs = [&](int begin, int end, int worker) {
+        for (int i = begin; i < end; i++)
+            runPipelineJob(engine, jobs[i]);
+    };
+    engine->workerPool->parallelFor(jobs.size(), 1, runJobs);
+    LOGI("Switched to the %d layer renderpass, created %d pipelines in %.1f ms", layers, (int)jobs.size(), clock.getTimeMicroseconds()/1000.0f);
+    return 0;
+}
+
+//The optional GPU simulation keeps the box state in device local memory. A compute dispatch at the start of
+//each frame moves the boxes and writes their model matrices for the instanced pipelines to read.
+int setupGpuSimulation(struct engine* engine)
+{
+    VkResult res;
+    engine->gpuSimulationSupported = false;
+    if (!engine->instancingSupported || !engine->computeSupported) {
+        LOGW ("GPU simulation needs instanced drawing and a compute capable queue, GPU simulation disabled.\n");
+        engine->gpuSimulation = false;
+        return 0;
+    }
+
+    int loaded = loadShaderModule(engine, "shaders/simulate.comp.spv", &engine->simulationShaderModule);
+    if (loaded < 0)
+        return -1;
+    if (loaded > 0) {
+        LOGW ("Simulation compute shader not found, GPU simulation disabled.\n");
+        engine->gpuSimulation = false;
+        return 0;
+    }
+
+    //Each box's state is 32 bytes, see Simulation::writeState.
+    VkDeviceSize stateSize = sizeof(float)*8*engine->boxCapacity;
+    VkDeviceSize instanceSize = sizeof(float)*16*engine->boxCapacity;
+    VkDeviceMemory stateMemory;
+    if (createBuffer(engine, stateSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &engine->simulationStateBuffer, &stateMemory) != 0)
+        return -1;
+
+    VkDeviceMemory instanceMemory;
+    if (createBuffer(engine, instanceSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &engine->simulationInstanceBuffer, &instanceMemory) != 0)
+        return -1;
+
+    //The state is copied through the staging buffer each time the simulation moves between the CPU and GPU.
+    VkDeviceMemory stagingMemory;
+    if (createBuffer(engine, stateSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &engine->simulationStagingBuffer, &stagingMemory) != 0)
+        return -1;
+
+    res = vkMapMemory(engine->vkDevice, stagingMemory, 0, VK_WHOLE_SIZE, 0, (void **)&engine->simulationStagingMappedMemory);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkMapMemory returned error %d.\n", res);
+        return -1;
+    }
+
+    VkDescriptorSetLayoutBinding layout_bindings[2];
+    for (int i = 0; i < 2; i++) {
+        layout_bindings[i].binding = i;
+        layout_bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        layout_bindings[i].descriptorCount = 1;
+        layout_bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        layout_bindings[i].pImmutableSamplers = NULL;
+    }
+
+    VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo;
+    descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptorSetLayoutCreateInfo.flags = 0;
+    descriptorSetLayoutCreateInfo.pNext = NULL;
+    descriptorSetLayoutCreateInfo.bindingCount = 2;
+    descriptorSetLayoutCreateInfo.pBindings = layout_bindings;
+
+    VkDescriptorSetLayout simulationDescriptorSetLayout;
+    res = vkCreateDescriptorSetLayout(engine->vkDevice, &descriptorSetLayoutCreateInfo, NULL, &simulationDescriptorSetLayout);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateDescriptorSetLayout returned error.\n");
+        return -1;
+    }
+
+    //A pool for the compute set and an instance set that points the instanced pipelines at the device local matrices.
+    VkDescriptorPoolSize typeCounts[1];
+    typeCounts[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    typeCounts[0].descriptorCount = 3;
+
+    VkDescriptorPoolCreateInfo descriptorPoolInfo;
+    descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolInfo.flags = 0;
+    descriptorPoolInfo.pNext = NULL;
+    descriptorPoolInfo.maxSets = 2;
+    descriptorPoolInfo.poolSizeCount = 1;
+    descriptorPoolInfo.pPoolSizes = typeCounts;
+
+    VkDescriptorPool descriptorPool;
+    res = vkCreateDescriptorPool(engine->vkDevice, &descriptorPoolInfo, NULL, &descriptorPool);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateDescriptorPool returned error %d.\n", res);
+        return -1;
+    }
+
+    VkDescriptorSetLayout setLayouts[2];
+    setLayouts[0] = simulationDescriptorSetLayout;
+    setLayouts[1] = engine->instanceDescriptorSetLayout;
+    VkDescriptorSet descriptorSets[2];
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.pNext = NULL;
+    descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = 2;
+    descriptorSetAllocateInfo.pSetLayouts = setLayouts;
+    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, descriptorSets);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkAllocateDescriptorSets returned error %d.\n", res);
+        return -1;
+    }
+    engine->simulationDescriptorSet = descriptorSets[0];
+    engine->simulationInstanceDescriptorSet = descriptorSets[1];
+
+    VkDescriptorBufferInfo bufferInfo[2];
+    bufferInfo[0].buffer = engine->simulationStateBuffer;
+    bufferInfo[0].offset = 0;
+    bufferInfo[0].range = stateSize;
+    bufferInfo[1].buffer = engine->simulationInstanceBuffer;
+    bufferInfo[1].offset = 0;
+    bufferInfo[1].range = instanceSize;
+
+    VkWriteDescriptorSet writes[3];
+    for (int i = 0; i < 3; i++) {
+        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[i].pNext = NULL;
+        writes[i].dstSet = (i<2) ? engine->simulationDescriptorSet : engine->simulationInstanceDescriptorSet;
+        writes[i].descriptorCount = 1;
+        writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writes[i].pBufferInfo = (i==0) ? &bufferInfo[0] : &bufferInfo[1];
+        writes[i].dstArrayElement = 0;
+        writes[i].dstBinding = (i==1) ? 1 : 0;
+    }
+    vkUpdateDescriptorSets(engine->vkDevice, 3, writes, 0, NULL);
+
+    //Push constants: box count, seed and whether to advance the boxes.
+    VkPushConstantRange pushConstantRange;
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(uint32_t)*3;
+
+    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo;
+    pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutCreateInfo.flags = 0;
+    pipelineLayoutCreateInfo.pNext = NULL;
+    pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+    pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+    pipelineLayoutCreateInfo.setLayoutCount = 1;
+    pipelineLayoutCreateInfo.pSetLayouts = &simulationDescriptorSetLayout;
+    res = vkCreatePipelineLayout(engine->vkDevice, &pipelineLayoutCreateInfo, NULL, &engine->simulationPipelineLayout);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreatePipelineLayout returned error.\n");
+        return -1;
+    }
+
+    engine->gpuSimulationSupported = true;
+    if (engine->gpuSimulation) {
+        engine->drawMode = DRAW_MODE_INSTANCED;
+        engine->gpuSimulationUploadRequired = true;
+    }
+    LOGI("GPU simulation available");
+    return 0;
+}
+
+//Creates the compute pipeline for the GPU simulation, setupGpuSimulation must have found the shader.
+int setupSimulationPipeline(struct engine* engine)
+{
+    LOGI("Setting up simulation pipeline");
+    VkResult res;
+    VkComputePipelineCreateInfo pipelineInfo;
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.pNext = NULL;
+    pipelineInfo.flags = 0;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.pNext = NULL;
+    pipelineInfo.stage.flags = 0;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = engine->simulationShaderModule;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.stage.pSpecializationInfo = NULL;
+    pipelineInfo.layout = engine->simulationPipelineLayout;
+    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+    pipelineInfo.basePipelineIndex = 0;
+    res = vkCreateComputePipelines(engine->vkDevice, engine->pipelineCache, 1, &pipelineInfo, NULL, &engine->simulationPipeline);
+    if (res != VK_SUCCESS) {
+        LOGE("vkCreateComputePipelines returned error %d.\n", res);
+        return -1;
+    }
+    return 0;
+}
+
+//Records the simulation dispatch, it must come before the render pass that draws the boxes.
+void recordGpuSimulation(struct engine* engine, VkCommandBuffer commandBuffer)
+{
+    VkMemoryBarrier memoryBarrier;
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.pNext = NULL;
+
+    if (engine->gpuSimulationUploadRequired) {
+        engine->simulation->writeState(engine->simulationStagingMappedMemory, engine->boxCapacity);
+        VkBufferCopy region;
+        region.srcOffset = 0;
+        region.dstOffset = 0;
+        region.size = sizeof(float)*8*engine->boxCapacity;
+        vkCmdCopyBuffer(commandBuffer, engine->simulationStagingBuffer, engine->simulationStateBuffer, 1, &region);
+        engine->gpuSimulationUploadRequired = false;
+    }
+
+    //The state written by the last dispatch (or the upload) is read here, and the matrices must not be
+    //overwritten while an earlier frame's vertex shaders are still reading them.
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer,
+                         VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, NULL, 0, NULL);
+
+    uint32_t constants[3];
+    constants[0] = engine->boxCount;
+    constants[1] = engine->seed;
+    constants[2] = engine->simulation->paused ? 0 : 1;
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, engine->simulationPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, engine->simulationPipelineLayout, 0, 1,
+                            &engine->simulationDescriptorSet, 0, NULL);
+    vkCmdPushConstants(commandBuffer, engine->simulationPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), constants);
+    vkCmdDispatch(commandBuffer, (engine->boxCount + 63) / 64, 1, 1);
+
+    //The vertex shaders read the matrices the dispatch wrote.
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                         0, 1, &memoryBarrier, 0, NULL, 0, NULL);
+}
+
+//Optional GPU frustum culling for the instanced draw mode. A compute dispatch before the render pass tests each
+//box against the frustum and copies the matrices of the visible ones into a compacted device local slot, counting
+//them into the instance count of an indirect draw. Every geometry subpass draws from that slot, so a culled box is
+//skipped by all of the peels rather than just one.
+int setupGpuCulling(struct engine* engine)
+{
+    VkResult res;
+    engine->gpuCullingSupported = false;
+    if (!engine->instancingSupported || !engine->computeSupported) {
+        LOGW ("GPU culling needs instanced drawing and a compute capable queue, GPU culling disabled.\n");
+        engine->gpuCulling = false;
+        return 0;
+    }
+
+    int loaded = loadShaderModule(engine, "shaders/cull.comp.spv", &engine->cullShaderModule);
+    if (loaded < 0)
+        return -1;
+    if (loaded > 0) {
+        LOGW ("Culling compute shader not found, GPU culling disabled.\n");
+        engine->gpuCulling = false;
+        return 0;
+    }
+
+    //The culled matrices use the same slots as the CPU instance buffer.
+    VkBuffer culledInstanceBuffer;
+    VkDeviceMemory culledInstanceMemory;
+    if (createBuffer(engine, engine->instanceSlotSize*engine->framesInFlight, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &culledInstanceBuffer, &culledInstanceMemory) != 0)
+        return -1;
+
+    //One draw command per frame slot, each bound as a storage buffer so its slots must be suitably aligned.
+    engine->culledIndirectSlotSize = sizeof(VkDrawIndirectCommand);
+    VkDeviceSize storageAlignment = engine->deviceProperties.limits.minStorageBufferOffsetAlignment;
+    if (storageAlignment > 1)
+        engine->culledIndirectSlotSize = (engine->culledIndirectSlotSize + storageAlignment - 1) / storageAlignment * storageAlignment;
+    VkDeviceMemory culledIndirectMemory;
+    if (createBuffer(engine, engine->culledIndirectSlotSize*engine->framesInFlight,
+                     VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &engine->culledIndirectBuffer, &culledIndirectMemory) != 0)
+        return -1;
+
+    //A visible count per workgroup of 64 boxes, which the prefix sum pass turns into offsets.
+    VkDeviceSize groupOffsetsRange = sizeof(uint32_t)*((engine->boxCapacity + 63) / 64);
+    VkDeviceSize groupOffsetsSlotSize = groupOffsetsRange;
+    if (storageAlignment > 1)
+        groupOffsetsSlotSize = (groupOffsetsSlotSize + storageAlignment - 1) / storageAlignment * storageAlignment;
+    VkBuffer groupOffsetsBuffer;
+    VkDeviceMemory groupOffsetsMemory;
+    if (createBuffer(engine, groupOffsetsSlotSize*engine->framesInFlight, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &groupOffsetsBuffer, &groupOffsetsMemory) != 0)
+        return -1;
+
+    //The source matrices, the culled matrices, the draw command and the workgroup offsets.
+    VkDescriptorSetLayoutBinding layout_bindings[4];
+    for (int i = 0; i < 4; i++) {
+        layout_bindings[i].binding = i;
+        layout_bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        layout_bindings[i].descriptorCount = 1;
+        layout_bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        layout_bindings[i].pImmutableSamplers = NULL;
+    }
+
+    VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo;
+    descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    descriptorSetLayoutCreateInfo.flags = 0;
+    descriptorSetLayoutCreateInfo.pNext = NULL;
+    descriptorSetLayoutCreateInfo.bindingCount = 4;
+    descriptorSetLayoutCreateInfo.pBindings = layout_bindings;
+
+    VkDescriptorSetLayout cullDescriptorSetLayout;
+    res = vkCreateDescriptorSetLayout(engine->vkDevice, &descriptorSetLayoutCreateInfo, NULL, &cullDescriptorSetLayout);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateDescriptorSetLayout returned error.\n");
+        return -1;
+    }
+
+    //Per frame slot a compute set for each simulation and an instance set for the culled matrices.
+    int sourceCount = engine->gpuSimulationSupported ? 2 : 1;
+    VkDescriptorPoolSize typeCounts[1];
+    typeCounts[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    typeCounts[0].descriptorCount = (4*sourceCount + 1)*engine->framesInFlight;
+
+    VkDescriptorPoolCreateInfo descriptorPoolInfo;
+    descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolInfo.flags = 0;
+    descriptorPoolInfo.pNext = NULL;
+    descriptorPoolInfo.maxSets = (sourceCount + 1)*engine->framesInFlight;
+    descriptorPoolInfo.poolSizeCount = 1;
+    descriptorPoolInfo.pPoolSizes = typeCounts;
+
+    VkDescriptorPool descriptorPool;
+    res = vkCreateDescriptorPool(engine->vkDevice, &descriptorPoolInfo, NULL, &descriptorPool);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateDescriptorPool returned error %d.\n", res);
+        return -1;
+    }
+
+    VkDescriptorSetLayout setLayouts[MAX_FRAMES_IN_FLIGHT];
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.pNext = NULL;
+    descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = engine->framesInFlight;
+    descriptorSetAllocateInfo.pSetLayouts = setLayouts;
+    for (int source = 0; source < sourceCount; source++) {
+        for (int frame = 0; frame < engine->framesInFlight; frame++)
+            setLayouts[frame] = cullDescriptorSetLayout;
+        res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, engine->cullDescriptorSets[source]);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkAllocateDescriptorSets returned error %d.\n", res);
+            return -1;
+        }
+    }
+    for (int frame = 0; frame < engine->framesInFlight; frame++)
+        setLayouts[frame] = engine->instanceDescriptorSetLayout;
+    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, engine->culledInstanceDescriptorSets);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkAllocateDescriptorSets returned error %d.\n", res);
+        return -1;
+    }
+
+    for (int frame = 0; frame < engine->framesInFlight; frame++) {
+        //Source matrices from the CPU slot and the GPU simulation, then the culled slot, the draw command and the offsets.
+        VkDescriptorBufferInfo bufferInfo[5];
+        bufferInfo[0].buffer = engine->instanceBuffer;
+        bufferInfo[0].offset = engine->instanceSlotSize*frame;
+        bufferInfo[0].range = sizeof(float)*16*engine->boxCapacity;
+        bufferInfo[1].buffer = engine->gpuSimulationSupported ? engine->simulationInstanceBuffer : VK_NULL_HANDLE;
+        bufferInfo[1].offset = 0;
+        bufferInfo[1].range = sizeof(float)*16*engine->boxCapacity;
+        bufferInfo[2].buffer = culledInstanceBuffer;
+        bufferInfo[2].offset = engine->instanceSlotSize*frame;
+        bufferInfo[2].range = sizeof(float)*16*engine->boxCapacity;
+        bufferInfo[3].buffer = engine->culledIndirectBuffer;
+        bufferInfo[3].offset = engine->culledIndirectSlotSize*frame;
+        bufferInfo[3].range = sizeof(VkDrawIndirectCommand);
+        bufferInfo[4].buffer = groupOffsetsBuffer;
+        bufferInfo[4].offset = groupOffsetsSlotSize*frame;
+        bufferInfo[4].range = groupOffsetsRange;
+
+        VkWriteDescriptorSet writes[9];
+        int writeCount = 0;
+        for (int source = 0; source < sourceCount; source++) {
+            for (int binding = 0; binding < 4; binding++) {
+                writes[writeCount].dstSet = engine->cullDescriptorSets[source][frame];
+                writes[writeCount].pBufferInfo = (binding==0) ? &bufferInfo[source] : &bufferInfo[binding+1];
+                writes[writeCount].dstBinding = binding;
+                writeCount++;
+            }
+        }
+        writes[writeCount].dstSet = engine->culledInstanceDescriptorSets[frame];
+        writes[writeCount].pBufferInfo = &bufferInfo[2];
+        writes[writeCount].dstBinding = 0;
+        writeCount++;
+        for (int i = 0; i < writeCount; i++) {
+            writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            writes[i].pNext = NULL;
+            writes[i].descriptorCount = 1;
+            writes[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            writes[i].dstArrayElement = 0;
+        }
+        vkUpdateDescriptorSets(engine->vkDevice, writeCount, writes, 0, NULL);
+    }
+
+    //Push constants: the projection matrix, the box count and the pass.
+    VkPushConstantRange pushConstantRange;
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(float)*16 + sizeof(uint32_t)*2;
+
+    VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo;
+    pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutCreateInfo.flags = 0;
+    pipelineLayoutCreateInfo.pNext = NULL;
+    pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+    pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+    pipelineLayoutCreateInfo.setLayoutCount = 1;
+    pipelineLayoutCreateInfo.pSetLayouts = &cullDescriptorSetLayout;
+    res = vkCreatePipelineLayout(engine->vkDevice, &pipelineLayoutCreateInfo, NULL, &engine->cullPipelineLayout);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreatePipelineLayout returned error.\n");
+        return -1;
+    }
+
+    engine->gpuCullingSupported = true;
+    if (engine->gpuCulling) {
+        engine->drawMode = DRAW_MODE_INSTANCED;
+        engine->cpuCulling = false;
+    }
+    LOGI("GPU culling available");
+    return 0;
+}
+
+//Creates the compute pipeline for GPU culling, setupGpuCulling must have found the shader.
+int setupCullPipeline(struct engine* engine)
+{
+    LOGI("Setting up culling pipeline");
+    VkResult res;
+    VkComputePipelineCreateInfo pipelineInfo;
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.pNext = NULL;
+    pipelineInfo.flags = 0;
+    pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipelineInfo.stage.pNext = NULL;
+    pipelineInfo.stage.flags = 0;
+    pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineInfo.stage.module = engine->cullShaderModule;
+    pipelineInfo.stage.pName = "main";
+    pipelineInfo.stage.pSpecializationInfo = NULL;
+    pipelineInfo.layout = engine->cullPipelineLayout;
+    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+    pipelineInfo.basePipelineIndex = 0;
+    res = vkCreateComputePipelines(engine->vkDevice, engine->pipelineCache, 1, &pipelineInfo, NULL, &engine->cullPipeline);
+    if (res != VK_SUCCESS) {
+        LOGE("vkCreateComputePipelines returned error %d.\n", res);
+        return -1;
+    }
+    return 0;
+}
+
+//Records the culling dispatches for a frame slot, after the simulation and before the render pass. The visible
+//boxes are counted per workgroup, the counts are turned into offsets, then each workgroup writes its boxes from its
+//offset. Unlike an atomic counter this keeps the boxes in order, which the traditional blend needs to not flicker.
+void recordGpuCulling(struct engine* engine, VkCommandBuffer commandBuffer, int frame)
+{
+    //The GPU simulation's matrices are read here.
+    VkMemoryBarrier memoryBarrier;
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.pNext = NULL;
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, NULL, 0, NULL);
+
+    //The same projection as updateUniforms, then the box count. The pass is pushed before each dispatch.
+    float constants[17];
+    perspective_matrix(0.7853 /* 45deg */, (float)engine->width/(float)engine->height, 0.1f, 50.0f, constants);
+    uint32_t boxCount = engine->boxCount;
+    memcpy(&constants[16], &boxCount, sizeof(boxCount));
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, engine->cullPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, engine->cullPipelineLayout, 0, 1,
+                            &engine->cullDescriptorSets[engine->gpuSimulation ? 1 : 0][frame], 0, NULL);
+    vkCmdPushConstants(commandBuffer, engine->cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), constants);
+    uint32_t groupCount = (engine->boxCount + 63) / 64;
+    for (uint32_t pass = 0; pass < 3; pass++) { //Count, prefix sum and scatter.
+        //Each pass reads what the last one wrote.
+        if (pass > 0)
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, NULL, 0, NULL);
+        vkCmdPushConstants(commandBuffer, engine->cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+                           sizeof(constants), sizeof(pass), &pass);
+        vkCmdDispatch(commandBuffer, (pass == 1) ? 1 : groupCount, 1, 1);
+    }
+
+    //The draws read the instance count and the vertex shaders the compacted matrices.
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                         0, 1, &memoryBarrier, 0, NULL, 0, NULL);
+}
+
+//Copies the GPU simulation's state back into the CPU simulation. This waits for the queue to go idle so is
+//only used when switching back to the CPU.
+int readGpuSimulation(struct engine* engine)
+{
+    VkResult res;
+    res = vkQueueWaitIdle(engine->queue);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkQueueWaitIdle returned error %d.\n", res);
+        return -1;
+    }
+
+    VkCommandBufferBeginInfo commandBufferBeginInfo = {};
+    commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    commandBufferBeginInfo.pNext = NULL;
+    commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    commandBufferBeginInfo.pInheritanceInfo = NULL;
+    res = vkBeginCommandBuffer(engine->setupCommandBuffer, &commandBufferBeginInfo);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkBeginCommandBuffer returned error.\n");
+        return -1;
+    }
+
+    //The last dispatch's writes must be visible to the copy.
+    VkMemoryBarrier memoryBarrier;
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.pNext = NULL;
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(engine->setupCommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 1, &memoryBarrier, 0, NULL, 0, NULL);
+
+    VkBufferCopy region;
+    region.srcOffset = 0;
+    region.dstOffset = 0;
+    region.size = sizeof(float)*8*engine->boxCapacity;
+    vkCmdCopyBuffer(engine->setupCommandBuffer, engine->simulationStateBuffer, engine->simulationStagingBuffer, 1, &region);
+
+    memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(engine->setupCommandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                         0, 1, &memoryBarrier, 0, NULL, 0, NULL);
+
+    res = vkEndCommandBuffer(engine->setupCommandBuffer);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkEndCommandBuffer returned error %d.\n", res);
+        return -1;
+    }
+
+    VkSubmitInfo submitInfo[1];
+    submitInfo[0].pNext = NULL;
+    submitInfo[0].sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo[0].waitSemaphoreCount = 0;
+    submitInfo[0].pWaitSemaphores = NULL;
+    submitInfo[0].pWaitDstStageMask = NULL;
+    submitInfo[0].commandBufferCount = 1;
+    submitInfo[0].pCommandBuffers = &engine->setupCommandBuffer;
+    submitInfo[0].signalSemaphoreCount = 0;
+    submitInfo[0].pSignalSemaphores = NULL;
+
+    res = vkQueueSubmit(engine->queue, 1, submitInfo, VK_NULL_HANDLE);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkQueueSubmit returned error %d.\n", res);
+        return -1;
+    }
+
+    res = vkQueueWaitIdle(engine->queue);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkQueueWaitIdle returned error %d.\n", res);
+        return -1;
+    }
+
+    engine->simulation->readState(engine->simulationStagingMappedMemory, engine->boxCapacity);
+    return 0;
+}
+
+//Creates a timestamp query pool with TIMESTAMP_QUERY_COUNT queries for each frame slot. GPU timing is left
+//disabled if the queue can't write timestamps.
+int setupTimestampQueries(struct engine* engine)
+{
+    engine->timestampsSupported = false;
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++)
+        engine->timestampsPending[frame] = false;
+    resetGpuTimes(engine);
+
+    if (engine->timestampValidBits == 0) {
+        LOGI("The queue does not support timestamps, GPU timing disabled.");
+        return 0;
+    }
+
+    VkQueryPoolCreateInfo queryPoolCreateInfo;
+    queryPoolCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolCreateInfo.pNext = NULL;
+    queryPoolCreateInfo.flags = 0;
+    queryPoolCreateInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolCreateInfo.queryCount = TIMESTAMP_QUERY_COUNT*engine->framesInFlight;
+    queryPoolCreateInfo.pipelineStatistics = 0;
+    VkResult res = vkCreateQueryPool(engine->vkDevice, &queryPoolCreateInfo, NULL, &engine->timestampQueryPool);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateQueryPool returned error %d.\n", res);
+        return -1;
+    }
+    engine->timestampsSupported = true;
+    LOGI("GPU timing enabled (%d valid timestamp bits, %f ns per tick)", engine->timestampValidBits,
+         engine->deviceProperties.limits.timestampPeriod);
+    return 0;
+}
+
+//The primary buffer's subpasses only execute secondary buffers so the timestamps are written from within them.
+void writeTimestamp(struct engine* engine, VkCommandBuffer commandBuffer, VkPipelineStageFlagBits stage, int frame, int query)
+{
+    if (engine->timestampsSupported)
+        vkCmdWriteTimestamp(commandBuffer, stage, engine->timestampQueryPool, frame*TIMESTAMP_QUERY_COUNT + query);
+}
+
+//Adds the timestamps from the last frame that used this slot to the totals. The slot's fence has signalled
+//so this doesn't wait. Buffers that weren't executed (the traditional blend without splitscreen, layers past
+//the layer count, blends of undisplayed layers) leave their queries unavailable and are skipped.
+void readTimestamps(struct engine* engine, int frame)
+{
+    if (!engine->timestampsSupported || !engine->timestampsPending[frame])
+        return;
+    engine->timestampsPending[frame] = false;
+
+    uint64_t results[TIMESTAMP_QUERY_COUNT][2]; //Each timestamp is followed by its availability.
+    VkResult res = vkGetQueryPoolResults(engine->vkDevice, engine->timestampQueryPool, frame*TIMESTAMP_QUERY_COUNT,
+                                         TIMESTAMP_QUERY_COUNT, sizeof(results), results, sizeof(results[0]),
+                                         VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+    if (res != VK_SUCCESS && res != VK_NOT_READY) {
+        LOGE ("vkGetQueryPoolResults returned error %d.\n", res);
+        return;
+    }
+
+    uint64_t mask = engine->timestampValidBits >= 64 ? ~0ULL : (1ULL << engine->timestampValidBits) - 1;
+    double msPerTick = engine->deviceProperties.limits.timestampPeriod/1000000.0;
+    //The queries are in submission order so a range is from its first to last available timestamp.
+    for (int range = 0; range < MAX_LAYERS+2; range++) {
+        int first, last;
+        if (range == 0) {
+            first = 0;
+            last = 1;
+        } else if (range <= MAX_LAYERS) {
+            first = 2+(range-1)*4;
+            last = first+3;
+        } else {
+            first = 0;
+            last = TIMESTAMP_QUERY_COUNT-1;
+        }
+        while (first <= last && !results[first][1])
+            first++;
+        while (last > first && !results[last][1])
+            last--;
+        if (last <= first)
+            continue;
+        engine->gpuTimeTotals[range] += ((results[last][0] - results[first][0]) & mask)*msPerTick;
+        engine->gpuTimeSamples[range]++;
+    }
+}
+
+void resetGpuTimes(struct engine* engine)
+{
+    for (int range = 0; range < MAX_LAYERS+2; range++) {
+        engine->gpuTimeTotals[range] = 0;
+        engine->gpuTimeSamples[range] = 0;
+    }
+}
+
+//Logs the mean GPU milliseconds for the traditional blend, each peel/blend layer (or the passes of the other
+//techniques) and the whole frame.
+void reportGpuTimes(struct engine* engine)
+{
+    if (!engine->timestampsSupported)
+        return;
+    char text[512];
+    int length = snprintf(text, sizeof(text), "GPU ms:");
+    for (int range = 0; range < MAX_LAYERS+2 && length < (int)sizeof(text); range++) {
+        if (engine->gpuTimeSamples[range] == 0)
+            continue;
+        double ms = engine->gpuTimeTotals[range]/engine->gpuTimeSamples[range];
+        if (range == 0)
+            length += snprintf(text + length, sizeof(text) - length, " trad %.3f", ms);
+        else if (range <= MAX_LAYERS)
+            length += snprintf(text + length, sizeof(text) - length, " %s%d %.3f",
+                               (engine->oitMode == OIT_MODE_DEPTH_PEEL) ? "layer" : "pass", range-1, ms);
+        else
+            length += snprintf(text + length, sizeof(text) - length, " frame %.3f", ms);
+    }
+    LOGI("%s", text);
+    resetGpuTimes(engine);
+}
+
+//Creates the occlusion query pool and, where the device supports them, the pipeline statistics query pool with
+//LAYER_QUERY_COUNT queries for each frame slot.
+int setupLayerQueries(struct engine* engine)
+{
+    for (int frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+        engine->layerStatsPending[frame] = false;
+        engine->statisticsPending[frame] = false;
+    }
+    resetLayerStats(engine);
+    engine->adaptiveLayerCount = engine->layerCount;
+    engine->adaptiveShrinkFrames = 0;
+
+    VkQueryPoolCreateInfo queryPoolCreateInfo;
+    queryPoolCreateInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolCreateInfo.pNext = NULL;
+    queryPoolCreateInfo.flags = 0;
+    queryPoolCreateInfo.queryType = VK_QUERY_TYPE_OCCLUSION;
+    queryPoolCreateInfo.queryCount = LAYER_QUERY_COUNT*engine->framesInFlight;
+    queryPoolCreateInfo.pipelineStatistics = 0;
+    VkResult res = vkCreateQueryPool(engine->vkDevice, &queryPoolCreateInfo, NULL, &engine->occlusionQueryPool);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateQueryPool returned error %d.\n", res);
+        return -1;
+    }
+
+    if (!engine->pipelineStatisticsSupported) {
+        LOGI("Pipeline statistics queries are not supported, layer statistics will only count samples.");
+        return 0;
+    }
+    //The results are returned in bit order: clipping primitives then fragment shader invocations.
+    queryPoolCreateInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+    queryPoolCreateInfo.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT |
+                                             VK_QUERY_PIPELINE_STATISTIC_FRAGMENT_SHADER_INVOCATIONS_BIT;
+    res = vkCreateQueryPool(engine->vkDevice, &queryPoolCreateInfo, NULL, &engine->statisticsQueryPool);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateQueryPool returned error %d.\n", res);
+        engine->pipelineStatisticsSupported = false;
+    }
+    return 0;
+}
+
+//Like the timestamps the queries are begun and ended within the secondary buffers, after the peel buffers'
+//clears so only the boxes are counted.
+//The adaptive layer count only needs the occlusion queries.
+void beginLayerQueries(struct engine* engine, VkCommandBuffer commandBuffer, int frame, int query)
+{
+    if (engine->layerStats || engine->adaptiveLayers)
+        vkCmdBeginQuery(commandBuffer, engine->occlusionQueryPool, frame*LAYER_QUERY_COUNT + query,
+                        engine->occlusionQueryPrecise ? VK_QUERY_CONTROL_PRECISE_BIT : 0);
+    if (engine->layerStats && engine->pipelineStatisticsSupported)
+        vkCmdBeginQuery(commandBuffer, engine->statisticsQueryPool, frame*LAYER_QUERY_COUNT + query, 0);
+}
+
+void endLayerQueries(struct engine* engine, VkCommandBuffer commandBuffer, int frame, int query)
+{
+    if (engine->layerStats || engine->adaptiveLayers)
+        vkCmdEndQuery(commandBuffer, engine->occlusionQueryPool, frame*LAYER_QUERY_COUNT + query);
+    if (engine->layerStats && engine->pipelineStatisticsSupported)
+        vkCmdEndQuery(commandBuffer, engine->statisticsQueryPool, frame*LAYER_QUERY_COUNT + query);
+}
+
+//Adds the query results from the last frame that used this slot to the totals, skipping buffers that weren't
+//executed. As with the timestamps the slot's fence has signalled so this doesn't wait.
+void readLayerStats(struct engine* engine, int frame)
+{
+    if (!engine->layerStatsPending[frame])
+        return;
+    engine->layerStatsPending[frame] = false;
+    bool statisticsPending = engine->statisticsPending[frame];
+    engine->statisticsPending[frame] = false;
+
+    uint64_t samples[LAYER_QUERY_COUNT][2]; //Samples passed then availability.
+    VkResult res = vkGetQueryPoolResults(engine->vkDevice, engine->occlusionQueryPool, frame*LAYER_QUERY_COUNT,
+                                         LAYER_QUERY_COUNT, sizeof(samples), samples, sizeof(samples[0]),
+                                         VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+    if (res != VK_SUCCESS && res != VK_NOT_READY) {
+        LOGE ("vkGetQueryPoolResults returned error %d.\n", res);
+        return;
+    }
+    if (engine->adaptiveLayers && engine->peeledLayers[frame] >= 0)
+        updateAdaptiveLayers(engine, samples, engine->peeledLayers[frame]);
+    if (!engine->layerStats)
+        return;
+
+    uint64_t statistics[LAYER_QUERY_COUNT][3] = {}; //Clipping primitives, fragment shader invocations then availability.
+    if (statisticsPending) {
+        res = vkGetQueryPoolResults(engine->vkDevice, engine->statisticsQueryPool, frame*LAYER_QUERY_COUNT,
+                                    LAYER_QUERY_COUNT, sizeof(statistics), statistics, sizeof(statistics[0]),
+                                    VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+        if (res != VK_SUCCESS && res != VK_NOT_READY) {
+            LOGE ("vkGetQueryPoolResults returned error %d.\n", res);
+            return;
+        }
+    }
+
+    for (int query = 0; query < LAYER_QUERY_COUNT; query++) {
+        if (!samples[query][1])
+            continue;
+        engine->layerSampleTotals[query] += samples[query][0];
+        if (statistics[query][2]) {
+            engine->layerPrimitiveTotals[query] += statistics[query][0];
+            engine->layerFragmentTotals[query] += statistics[query][1];
+        }
+        engine->layerStatsSamples[query]++;
+    }
+}
+
+void resetLayerStats(struct engine* engine)
+{
+    for (int query = 0; query < LAYER_QUERY_COUNT; query++) {
+        engine->layerSampleTotals[query] = 0;
+        engine->layerFragmentTotals[query] = 0;
+        engine->layerPrimitiveTotals[query] = 0;
+        engine->layerStatsSamples[query] = 0;
+    }
+}
+
+//Logs the mean per frame samples passed, fragment shader invocations and clipping primitives of the
+//traditional blend and each peel. A layer that passes no samples adds nothing to the image.
+void reportLayerStats(struct engine* engine)
+{
+    for (int query = 0; query < LAYER_QUERY_COUNT; query++) {
+        int frames = engine->layerStatsSamples[query];
+        if (frames == 0)
+            continue;
+        char name[16];
+        if (query == 0)
+            snprintf(name, sizeof(name), "Trad");
+        else
+            snprintf(name, sizeof(name), "%s %d", (engine->oitMode == OIT_MODE_DEPTH_PEEL) ? "Layer" : "Pass", query-1);
+        if (engine->pipelineStatisticsSupported)
+            LOGI("%s: %llu samples passed, %llu fragment shader invocations, %llu clipping primitives", name,
+                 (unsigned long long)(engine->layerSampleTotals[query]/frames),
+                 (unsigned long long)(engine->layerFragmentTotals[query]/frames),
+                 (unsigned long long)(engine->layerPrimitiveTotals[query]/frames));
+        else
+            LOGI("%s: %llu samples passed", name, (unsigned long long)(engine->layerSampleTotals[query]/frames));
+    }
+    resetLayerStats(engine);
+}
+
+//Picks the number of layers to peel from the occlusion results of a frame that peeled peeledLayers layers.
+//Layers after the last one to pass any samples aren't needed. If the last peeled layer passed samples there may
+//be more below it so one more is tried. More layers are used at once, fewer only after ADAPTIVE_SHRINK_FRAMES
+//frames in a row so the count doesn't flicker as boxes move.
+void updateAdaptiveLayers(struct engine* engine, const uint64_t (*samples)[2], int peeledLayers)
+{
+    int neededLayers = 0;
+    for (int layer = 0; layer < peeledLayers; layer++)
+        if (samples[1+layer][1] && samples[1+layer][0] > 0)
+            neededLayers = layer+1;
+    if (neededLayers == peeledLayers)
+        neededLayers++;
+    if (neededLayers < 1)
+        neededLayers = 1;
+    if (neededLayers > engine->layerCount)
+        neededLayers = engine->layerCount;
+
+    if (engine->adaptiveLayerCount > engine->layerCount)
+        engine->adaptiveLayerCount = engine->layerCount;
+    if (neededLayers > engine->adaptiveLayerCount) {
+        engine->adaptiveLayerCount = neededLayers;
+        engine->adaptiveShrinkFrames = 0;
+    } else if (neededLayers < engine->adaptiveLayerCount) {
+        if (++engine->adaptiveShrinkFrames >= ADAPTIVE_SHRINK_FRAMES) {
+            engine->adaptiveLayerCount = neededLayers;
+            engine->adaptiveShrinkFrames = 0;
+        }
+    } else
+        engine->adaptiveShrinkFrames = 0;
+}
+
+void toggleAdaptiveLayers(struct engine* engine)
+{
+    engine->adaptiveLayers = !engine->adaptiveLayers;
+    engine->adaptiveLayerCount = engine->layerCount;
+    engine->adaptiveShrinkFrames = 0;
+    LOGI("Adaptive layer count %s", engine->adaptiveLayers ? "on" : "off");
+    engine->rebuildCommadBuffersRequired=true;
+}
+
+void toggleLayerStats(struct engine* engine)
+{
+    engine->layerStats = !engine->layerStats;
+    resetLayerStats(engine);
+    LOGI("Layer statistics %s", engine->layerStats ? "on" : "off");
+    engine->rebuildCommadBuffersRequired=true;
+}
+
+void toggleSaturationTermination(struct engine* engine)
+{
+    if (!engine->saturationSupported) {
+        LOGW("Saturation termination is not supported.");
+        return;
+    }
+    engine->saturationTermination = !engine->saturationTermination;
+    LOGI("Saturation termination %s", engine->saturationTermination ? "on" : "off");
+    engine->rebuildCommadBuffersRequired=true;
+}
+
+int setupUniforms(struct engine* engine)
+{
+    VkResult res;
+
+    //Only the instanced mode scales to the full capacity.
+    VkDeviceSize maxInstanceBoxes = engine->deviceProperties.limits.maxStorageBufferRange/(sizeof(float)*16);
+    if ((VkDeviceSize)engine->boxCapacity > maxInstanceBoxes) {
+        LOGW("Box capacity %d exceeds the storage buffer range, limiting to %d boxes.\n", engine->boxCapacity, (int)maxInstanceBoxes);
+        engine->boxCapacity = maxInstanceBoxes;
+        if (engine->boxCount > engine->boxCapacity)
+            engine->boxCount = engine->boxCapacity;
+    }
+    engine->uniformBoxCapacity = engine->boxCapacity;
+    if (engine->uniformBoxCapacity > MAX_UNIFORM_BOXES)
+        engine->uniformBoxCapacity = MAX_UNIFORM_BOXES;
+    LOGI("Box capacity %d (%d in the per box uniform modes)", engine->boxCapacity, engine->uniformBoxCapacity);
+
+    //Create a descriptor pool
+    VkDescriptorPoolSize typeCounts[4];
+    typeCounts[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    typeCounts[0].descriptorCount = 3*engine->framesInFlight;
+    typeCounts[1].type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+    typeCounts[1].descriptorCount = 3;
+    typeCounts[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    typeCounts[2].descriptorCount = engine->framesInFlight;
+    typeCounts[3].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    typeCounts[3].descriptorCount = engine->framesInFlight;
+
+    VkDescriptorPoolCreateInfo descriptorPoolInfo;
+    descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolInfo.flags = 0;
+    descriptorPoolInfo.pNext = NULL;
+    descriptorPoolInfo.maxSets = 5*engine->framesInFlight+3;
+    descriptorPoolInfo.poolSizeCount = 4;
+    descriptorPoolInfo.pPoolSizes = typeCounts;
+
+    VkDescriptorPool descriptorPool;
+    res = vkCreateDescriptorPool(engine->vkDevice, &descriptorPoolInfo, NULL, &descriptorPool);
+    if (res != VK_SUCCESS) {
+        printf ("vkCreateDescriptorPool returned error %d.\n", res);
+        return -1;
+    }
+
+    printf ("minUniformBufferOffsetAlignment %d.\n", (int)engine->deviceProperties.limits.minUniformBufferOffsetAlignment);
+    engine->modelBufferValsOffset = sizeof(float)*16;
+    if (engine->modelBufferValsOffset < engine->deviceProperties.limits.minUniformBufferOffsetAlignment)
+        engine->modelBufferValsOffset = engine->deviceProperties.limits.minUniformBufferOffsetAlignment;
+    printf ("modelBufferValsOffset %d.\n", engine->modelBufferValsOffset);
+
+    //The uniform buffer is a ring of framesInFlight slots so the CPU can write the next frame while
+    //the GPU reads the current one. modelBufferValsOffset is aligned so every slot is aligned too.
+    engine->uniformSlotSize = engine->modelBufferValsOffset*(engine->uniformBoxCapacity+3); //Enough to store uniformBoxCapacity+3 matricies.
+
+    VkBufferCreateInfo uniformBufferCreateInfo;
+    uniformBufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    uniformBufferCreateInfo.pNext = NULL;
+    uniformBufferCreateInfo.usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
+    uniformBufferCreateInfo.size = engine->uniformSlotSize*engine->framesInFlight;
+    uniformBufferCreateInfo.queueFamilyIndexCount = 0;
+    uniformBufferCreateInfo.pQueueFamilyIndices = NULL;
+    uniformBufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    uniformBufferCreateInfo.flags = 0;
+
+    VkBuffer uniformBuffer;
+    res = vkCreateBuffer(engine->vkDevice, &uniformBufferCreateInfo, NULL, &uniformBuffer);
+    engine->uniformBuffer = uniformBuffer;
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateBuffer returned error %d.\n", res);
+        return -1;
+    }
+
+    VkMemoryRequirements memoryRequirements;
+    vkGetBufferMemoryRequirements(engine->vkDevice, uniformBuffer, &memoryRequirements);
+    uint8_t found = 0;
+    uint32_t typeBits = memoryRequirements.memoryTypeBits;
+    LOGI("Uniform memory types %d", typeBits);
+    VkFlags requirements_mask = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    uint32_t typeIndex;
+    for (typeIndex = 0; typeIndex < engine->physicalDeviceMemoryProperties.memoryTypeCount; typeIndex++) {
+        if ((typeBits & 1) == 1)//Check last bit;
+        {
+            if ((engine->physicalDeviceMemoryProperties.memoryTypes[typeIndex].propertyFlags & requirements_mask) == requirements_mask)
+            {
+                found=1;
+                break;
+            }
+        }
+        typeBits >>= 1;
+    }
+
+    if (!found)
+    {
+        LOGE ("Did not find a suitable memory type.\n");
+        return -1;
+    }else
+        LOGI ("Using memory type %d.\n", typeIndex);
+
+    VkMemoryAllocateInfo memAllocInfo;
+    memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memAllocInfo.pNext = NULL;
+    memAllocInfo.allocationSize = memoryRequirements.size;
+    memAllocInfo.memoryTypeIndex = typeIndex;
+    //
+    VkDeviceMemory uniformMemory;
+    res = vkAllocateMemory(engine->vkDevice, &memAllocInfo, NULL, &uniformMemory);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateBuffer returned error %d.\n", res);
+        return -1;
+    }
+
+    res = vkMapMemory(engine->vkDevice, uniformMemory, 0, memoryRequirements.size, 0, (void **)&engine->uniformMappedMemory);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkMapMemory returned error %d.\n", res);
+        return -1;
+    }
+
+    res = vkBindBufferMemory(engine->vkDevice, uniformBuffer, uniformMemory, 0);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkBindBufferMemory returned error %d.\n", res);
+        return -1;
+    }
+
+    //The instance buffer holds tightly packed model matrices for the instanced draw mode, one slot per frame in flight.
+    engine->instanceSlotSize = sizeof(float)*16*engine->boxCapacity;
+    VkDeviceSize storageAlignment = engine->deviceProperties.limits.minStorageBufferOffsetAlignment;
+    if (storageAlignment > 1)
+        engine->instanceSlotSize = (engine->instanceSlotSize + storageAlignment - 1) / storageAlignment * storageAlignment;
+
+    VkDeviceMemory instanceMemory;
+    if (createBuffer(engine, engine->instanceSlotSize*engine->framesInFlight, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &engine->instanceBuffer, &instanceMemory) != 0)
+        return -1;
+
+    res = vkMapMemory(engine->vkDevice, instanceMemory, 0, VK_WHOLE_SIZE, 0, (void **)&engine->instanceMappedMemory);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkMapMemory returned error %d.\n", res);
+        return -1;
+    }
+
+    //The instanced draws are indirect so the box count can change without recording the secondary buffers again.
+    VkDeviceMemory indirectMemory;
+    if (createBuffer(engine, sizeof(VkDrawIndirectCommand)*engine->framesInFlight, VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                     &engine->indirectBuffer, &indirectMemory) != 0)
+        return -1;
+
+    res = vkMapMemory(engine->vkDevice, indirectMemory, 0, VK_WHOLE_SIZE, 0, (void **)&engine->indirectCommands);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkMapMemory returned error %d.\n", res);
+        return -1;
+    }
+    for (int frame = 0; frame < engine->framesInFlight; frame++) {
+        engine->indirectCommands[frame].vertexCount = 12 * 3;
+        engine->indirectCommands[frame].instanceCount = engine->boxCount;
+        engine->indirectCommands[frame].firstVertex = 0;
+        engine->indirectCommands[frame].firstInstance = 0;
+    }
+
+    engine->descriptorSetLayouts = new VkDescriptorSetLayout[3];
+
+    for (int i = 0; i <3; i++) {
+        VkDescriptorSetLayoutBinding layout_bindings[1];
+        layout_bindings[0].binding = 0;
         layout_bindings[0].descriptorType = (i<2) ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
         layout_bindings[0].descriptorCount = 1;
         layout_bindings[0].stageFlags = (i<2) ? VK_SHADER_STAGE_VERTEX_BIT : VK_SHADER_STAGE_FRAGMENT_BIT;
@@ -2095,56 +5992,91 @@ int setupUniforms(struct engine* engine)
         }
     }
 
+    {
+        VkDescriptorSetLayoutBinding layout_bindings[1];
+        layout_bindings[0].binding = 0;
+        layout_bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        layout_bindings[0].descriptorCount = 1;
+        layout_bindings[0].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+        layout_bindings[0].pImmutableSamplers = NULL;
+
+        VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo;
+        descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        descriptorSetLayoutCreateInfo.flags = 0;
+        descriptorSetLayoutCreateInfo.pNext = NULL;
+        descriptorSetLayoutCreateInfo.bindingCount = 1;
+        descriptorSetLayoutCreateInfo.pBindings = layout_bindings;
+
+        res = vkCreateDescriptorSetLayout(engine->vkDevice, &descriptorSetLayoutCreateInfo, NULL,
+                                          &engine->instanceDescriptorSetLayout);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkCreateDescriptorSetLayout returned error.\n");
+            return -1;
+        }
+
+        layout_bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        res = vkCreateDescriptorSetLayout(engine->vkDevice, &descriptorSetLayoutCreateInfo, NULL,
+                                          &engine->dynamicModelDescriptorSetLayout);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkCreateDescriptorSetLayout returned error.\n");
+            return -1;
+        }
+    }
+
     //Create the descriptor sets
 
     VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
     descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
     descriptorSetAllocateInfo.pNext = NULL;
     descriptorSetAllocateInfo.descriptorPool = descriptorPool;
-    descriptorSetAllocateInfo.descriptorSetCount = 1;
-    descriptorSetAllocateInfo.pSetLayouts = &engine->descriptorSetLayouts[0];
+    descriptorSetAllocateInfo.descriptorSetCount = engine->framesInFlight;
+    VkDescriptorSetLayout uniformLayouts[MAX_FRAMES_IN_FLIGHT];
+    for (int frame=0; frame<engine->framesInFlight; frame++)
+        uniformLayouts[frame]=engine->descriptorSetLayouts[0];
+    descriptorSetAllocateInfo.pSetLayouts = uniformLayouts;
 
-    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, &engine->sceneDescriptorSet);
+    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, engine->sceneDescriptorSets);
     if (res != VK_SUCCESS) {
         printf ("vkAllocateDescriptorSets returned error %d.\n", res);
         return -1;
     }
 
-    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, &engine->identitySceneDescriptorSet);
+    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, engine->identitySceneDescriptorSets);
     if (res != VK_SUCCESS) {
         printf ("vkAllocateDescriptorSets returned error %d.\n", res);
         return -1;
     }
 
-    engine->modelDescriptorSets = new VkDescriptorSet[MAX_BOXES];
-    VkDescriptorSetLayout sceneLayouts[MAX_BOXES];
-    for (int i=0; i<MAX_BOXES; i++)
-        sceneLayouts[i]=engine->descriptorSetLayouts[1];
+    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, engine->identityModelDescriptorSets);
+    if (res != VK_SUCCESS) {
+        printf ("vkAllocateDescriptorSets returned error %d.\n", res);
+        return -1;
+    }
 
-    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    descriptorSetAllocateInfo.pNext = NULL;
-    descriptorSetAllocateInfo.descriptorPool = descriptorPool;
-    descriptorSetAllocateInfo.descriptorSetCount = MAX_BOXES;
-    descriptorSetAllocateInfo.pSetLayouts = sceneLayouts;
+    VkDescriptorSetLayout instanceLayouts[MAX_FRAMES_IN_FLIGHT];
+    for (int frame=0; frame<engine->framesInFlight; frame++)
+        instanceLayouts[frame]=engine->instanceDescriptorSetLayout;
+    descriptorSetAllocateInfo.pSetLayouts = instanceLayouts;
 
-    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, engine->modelDescriptorSets);
+    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, engine->instanceDescriptorSets);
     if (res != VK_SUCCESS) {
         printf ("vkAllocateDescriptorSets returned error %d.\n", res);
         return -1;
     }
 
-    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    descriptorSetAllocateInfo.pNext = NULL;
-    descriptorSetAllocateInfo.descriptorPool = descriptorPool;
-    descriptorSetAllocateInfo.descriptorSetCount = 1;
-    descriptorSetAllocateInfo.pSetLayouts = engine->descriptorSetLayouts;
-
-    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, &engine->identityModelDescriptorSet);
+    VkDescriptorSetLayout dynamicModelLayouts[MAX_FRAMES_IN_FLIGHT];
+    for (int frame=0; frame<engine->framesInFlight; frame++)
+        dynamicModelLayouts[frame]=engine->dynamicModelDescriptorSetLayout;
+    descriptorSetAllocateInfo.pSetLayouts = dynamicModelLayouts;
+
+    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, engine->dynamicModelDescriptorSets);
     if (res != VK_SUCCESS) {
         printf ("vkAllocateDescriptorSets returned error %d.\n", res);
         return -1;
     }
 
+    engine->modelDescriptorSets = NULL;
+
     //The input attachments:
     descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
     descriptorSetAllocateInfo.pNext = NULL;
@@ -2180,362 +6112,1184 @@ int setupUniforms(struct engine* engine)
     }
 
 
-    VkDescriptorBufferInfo uniformBufferInfo[MAX_BOXES+3];
-    VkWriteDescriptorSet writes[MAX_BOXES+6];
-    for (int i = 0; i<MAX_BOXES+3; i++) {
-        uniformBufferInfo[i].buffer = uniformBuffer;
-        uniformBufferInfo[i].offset = engine->modelBufferValsOffset*i;
-        uniformBufferInfo[i].range = sizeof(float) * 16;
-    }
-    for (int i = 0; i<MAX_BOXES; i++) {
-        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        writes[i].pNext = NULL;
-        writes[i].dstSet = engine->modelDescriptorSets[i];
-        writes[i].descriptorCount = 1;
-        writes[i].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        writes[i].pBufferInfo = &uniformBufferInfo[i];
-        writes[i].dstArrayElement = 0;
-        writes[i].dstBinding = 0;
+    //Every frame slot holds uniformBoxCapacity model matrices followed by the scene and identity matrices,
+    //the per box model sets are written by setupModelDescriptorSets.
+    int uniformWriteCount = 3*engine->framesInFlight;
+    VkDescriptorBufferInfo *uniformBufferInfo = new VkDescriptorBufferInfo[uniformWriteCount];
+    VkWriteDescriptorSet *writes = new VkWriteDescriptorSet[uniformWriteCount+3+engine->framesInFlight*2];
+    for (int frame = 0; frame<engine->framesInFlight; frame++) {
+        for (int i = 0; i<3; i++) {
+            int write = frame*3+i;
+            uniformBufferInfo[write].buffer = uniformBuffer;
+            uniformBufferInfo[write].offset = engine->uniformSlotSize*frame + engine->modelBufferValsOffset*(engine->uniformBoxCapacity+i);
+            uniformBufferInfo[write].range = sizeof(float) * 16;
+
+            writes[write].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            writes[write].pNext = NULL;
+            if (i==0) //Scene data
+                writes[write].dstSet = engine->sceneDescriptorSets[frame];
+            else if (i==1) //Identity model matrix
+                writes[write].dstSet = engine->identityModelDescriptorSets[frame];
+            else //Identity scene matrix
+                writes[write].dstSet = engine->identitySceneDescriptorSets[frame];
+            writes[write].descriptorCount = 1;
+            writes[write].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            writes[write].pBufferInfo = &uniformBufferInfo[write];
+            writes[write].dstArrayElement = 0;
+            writes[write].dstBinding = 0;
+        }
     }
 
-    //Scene data
-    writes[MAX_BOXES].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writes[MAX_BOXES].pNext = NULL;
-    writes[MAX_BOXES].dstSet = engine->sceneDescriptorSet;
-    writes[MAX_BOXES].descriptorCount = 1;
-    writes[MAX_BOXES].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    writes[MAX_BOXES].pBufferInfo = &uniformBufferInfo[MAX_BOXES];
-    writes[MAX_BOXES].dstArrayElement = 0;
-    writes[MAX_BOXES].dstBinding = 0;
-
-    //Identity model matrix
-    writes[MAX_BOXES+1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writes[MAX_BOXES+1].pNext = NULL;
-    writes[MAX_BOXES+1].dstSet = engine->identityModelDescriptorSet;
-    writes[MAX_BOXES+1].descriptorCount = 1;
-    writes[MAX_BOXES+1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    writes[MAX_BOXES+1].pBufferInfo = &uniformBufferInfo[MAX_BOXES+1];
-    writes[MAX_BOXES+1].dstArrayElement = 0;
-    writes[MAX_BOXES+1].dstBinding = 0;
-
-    //Identity scene matrix
-    writes[MAX_BOXES+2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writes[MAX_BOXES+2].pNext = NULL;
-    writes[MAX_BOXES+2].dstSet = engine->identitySceneDescriptorSet;
-    writes[MAX_BOXES+2].descriptorCount = 1;
-    writes[MAX_BOXES+2].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    writes[MAX_BOXES+2].pBufferInfo = &uniformBufferInfo[MAX_BOXES+2];
-    writes[MAX_BOXES+2].dstArrayElement = 0;
-    writes[MAX_BOXES+2].dstBinding = 0;
-
     //The input attachment:
     VkDescriptorImageInfo uniformImageInfo;
     uniformImageInfo.imageLayout=VK_IMAGE_LAYOUT_GENERAL;
     uniformImageInfo.imageView=engine->peelView;
     uniformImageInfo.sampler=NULL;
-    writes[MAX_BOXES+3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writes[MAX_BOXES+3].pNext = NULL;
-    writes[MAX_BOXES+3].dstSet = engine->colourInputAttachmentDescriptorSet;
-    writes[MAX_BOXES+3].descriptorCount = 1;
-    writes[MAX_BOXES+3].descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
-    writes[MAX_BOXES+3].pImageInfo=&uniformImageInfo;
-    writes[MAX_BOXES+3].dstArrayElement = 0;
-    writes[MAX_BOXES+3].dstBinding = 0;
+    writes[uniformWriteCount].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[uniformWriteCount].pNext = NULL;
+    writes[uniformWriteCount].dstSet = engine->colourInputAttachmentDescriptorSet;
+    writes[uniformWriteCount].descriptorCount = 1;
+    writes[uniformWriteCount].descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+    writes[uniformWriteCount].pImageInfo=&uniformImageInfo;
+    writes[uniformWriteCount].dstArrayElement = 0;
+    writes[uniformWriteCount].dstBinding = 0;
 
     VkDescriptorImageInfo depthuniformImageInfo[2];
     depthuniformImageInfo[0].imageLayout=VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
     depthuniformImageInfo[0].imageView=engine->depthView[0];
     depthuniformImageInfo[0].sampler=NULL;
-    writes[MAX_BOXES+4].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writes[MAX_BOXES+4].pNext = NULL;
-    writes[MAX_BOXES+4].dstSet = engine->depthInputAttachmentDescriptorSets[0];
-    writes[MAX_BOXES+4].descriptorCount = 1;
-    writes[MAX_BOXES+4].descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
-    writes[MAX_BOXES+4].pImageInfo=&depthuniformImageInfo[0];
-    writes[MAX_BOXES+4].dstArrayElement = 0;
-    writes[MAX_BOXES+4].dstBinding = 0;
+    writes[uniformWriteCount+1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[uniformWriteCount+1].pNext = NULL;
+    writes[uniformWriteCount+1].dstSet = engine->depthInputAttachmentDescriptorSets[0];
+    writes[uniformWriteCount+1].descriptorCount = 1;
+    writes[uniformWriteCount+1].descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+    writes[uniformWriteCount+1].pImageInfo=&depthuniformImageInfo[0];
+    writes[uniformWriteCount+1].dstArrayElement = 0;
+    writes[uniformWriteCount+1].dstBinding = 0;
 
     depthuniformImageInfo[1].imageLayout=VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
     depthuniformImageInfo[1].imageView=engine->depthView[1];
     depthuniformImageInfo[1].sampler=NULL;
-    writes[MAX_BOXES+5].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    writes[MAX_BOXES+5].pNext = NULL;
-    writes[MAX_BOXES+5].dstSet = engine->depthInputAttachmentDescriptorSets[1];
-    writes[MAX_BOXES+5].descriptorCount = 1;
-    writes[MAX_BOXES+5].descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
-    writes[MAX_BOXES+5].pImageInfo=&depthuniformImageInfo[1];
-    writes[MAX_BOXES+5].dstArrayElement = 0;
-    writes[MAX_BOXES+5].dstBinding = 0;
+    writes[uniformWriteCount+2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[uniformWriteCount+2].pNext = NULL;
+    writes[uniformWriteCount+2].dstSet = engine->depthInputAttachmentDescriptorSets[1];
+    writes[uniformWriteCount+2].descriptorCount = 1;
+    writes[uniformWriteCount+2].descriptorType = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+    writes[uniformWriteCount+2].pImageInfo=&depthuniformImageInfo[1];
+    writes[uniformWriteCount+2].dstArrayElement = 0;
+    writes[uniformWriteCount+2].dstBinding = 0;
+
+    //The instance storage buffers:
+    VkDescriptorBufferInfo instanceBufferInfo[MAX_FRAMES_IN_FLIGHT];
+    for (int frame = 0; frame<engine->framesInFlight; frame++) {
+        int write = uniformWriteCount+3+frame;
+        instanceBufferInfo[frame].buffer = engine->instanceBuffer;
+        instanceBufferInfo[frame].offset = engine->instanceSlotSize*frame;
+        instanceBufferInfo[frame].range = sizeof(float)*16*engine->boxCapacity;
+
+        writes[write].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[write].pNext = NULL;
+        writes[write].dstSet = engine->instanceDescriptorSets[frame];
+        writes[write].descriptorCount = 1;
+        writes[write].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        writes[write].pBufferInfo = &instanceBufferInfo[frame];
+        writes[write].dstArrayElement = 0;
+        writes[write].dstBinding = 0;
+    }
+
+    //The dynamic model sets cover the first model matrix of their slot, the per box offset is supplied when binding.
+    VkDescriptorBufferInfo dynamicModelBufferInfo[MAX_FRAMES_IN_FLIGHT];
+    for (int frame = 0; frame<engine->framesInFlight; frame++) {
+        int write = uniformWriteCount+3+engine->framesInFlight+frame;
+        dynamicModelBufferInfo[frame].buffer = uniformBuffer;
+        dynamicModelBufferInfo[frame].offset = engine->uniformSlotSize*frame;
+        dynamicModelBufferInfo[frame].range = sizeof(float)*16;
+
+        writes[write].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[write].pNext = NULL;
+        writes[write].dstSet = engine->dynamicModelDescriptorSets[frame];
+        writes[write].descriptorCount = 1;
+        writes[write].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        writes[write].pBufferInfo = &dynamicModelBufferInfo[frame];
+        writes[write].dstArrayElement = 0;
+        writes[write].dstBinding = 0;
+    }
+
+    vkUpdateDescriptorSets(engine->vkDevice, uniformWriteCount+3+engine->framesInFlight*2, writes, 0, NULL);
+    delete[] writes;
+    delete[] uniformBufferInfo;
+
+    LOGI ("Descriptor sets updated %d.\n", res);
+    return 0;
+}
+
+//Creates one model descriptor set per box and frame slot for the descriptor sets draw mode, the other modes don't
+//need them so they are only created the first time that mode is used. They get their own pool sized to match.
+int setupModelDescriptorSets(struct engine* engine)
+{
+    if (engine->modelDescriptorSets != NULL)
+        return 0;
+
+    VkResult res;
+    //Model descriptor sets are indexed by frame*uniformBoxCapacity+box.
+    int modelDescriptorSetCount = engine->uniformBoxCapacity*engine->framesInFlight;
+
+    VkDescriptorPoolSize typeCount;
+    typeCount.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    typeCount.descriptorCount = modelDescriptorSetCount;
+
+    VkDescriptorPoolCreateInfo descriptorPoolInfo;
+    descriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolInfo.flags = 0;
+    descriptorPoolInfo.pNext = NULL;
+    descriptorPoolInfo.maxSets = modelDescriptorSetCount;
+    descriptorPoolInfo.poolSizeCount = 1;
+    descriptorPoolInfo.pPoolSizes = &typeCount;
+
+    VkDescriptorPool descriptorPool;
+    res = vkCreateDescriptorPool(engine->vkDevice, &descriptorPoolInfo, NULL, &descriptorPool);
+    if (res != VK_SUCCESS) {
+        LOGE ("vkCreateDescriptorPool returned error %d.\n", res);
+        return -1;
+    }
+
+    VkDescriptorSet *modelDescriptorSets = new VkDescriptorSet[modelDescriptorSetCount];
+    VkDescriptorSetLayout *modelLayouts = new VkDescriptorSetLayout[modelDescriptorSetCount];
+    for (int i=0; i<modelDescriptorSetCount; i++)
+        modelLayouts[i]=engine->descriptorSetLayouts[1];
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.pNext = NULL;
+    descriptorSetAllocateInfo.descriptorPool = descriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = modelDescriptorSetCount;
+    descriptorSetAllocateInfo.pSetLayouts = modelLayouts;
+
+    res = vkAllocateDescriptorSets(engine->vkDevice, &descriptorSetAllocateInfo, modelDescriptorSets);
+    delete[] modelLayouts;
+    if (res != VK_SUCCESS) {
+        LOGE ("vkAllocateDescriptorSets returned error %d.\n", res);
+        delete[] modelDescriptorSets;
+        vkDestroyDescriptorPool(engine->vkDevice, descriptorPool, NULL);
+        return -1;
+    }
+
+    VkDescriptorBufferInfo *modelBufferInfo = new VkDescriptorBufferInfo[modelDescriptorSetCount];
+    VkWriteDescriptorSet *writes = new VkWriteDescriptorSet[modelDescriptorSetCount];
+    for (int frame = 0; frame<engine->framesInFlight; frame++) {
+        for (int i = 0; i<engine->uniformBoxCapacity; i++) {
+            int write = frame*engine->uniformBoxCapacity+i;
+            modelBufferInfo[write].buffer = engine->uniformBuffer;
+            modelBufferInfo[write].offset = engine->uniformSlotSize*frame + engine->modelBufferValsOffset*i;
+            modelBufferInfo[write].range = sizeof(float) * 16;
+
+            writes[write].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            writes[write].pNext = NULL;
+            writes[write].dstSet = modelDescriptorSets[write];
+            writes[write].descriptorCount = 1;
+            writes[write].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            writes[write].pBufferInfo = &modelBufferInfo[write];
+            writes[write].dstArrayElement = 0;
+            writes[write].dstBinding = 0;
+        }
+    }
+    vkUpdateDescriptorSets(engine->vkDevice, modelDescriptorSetCount, writes, 0, NULL);
+    delete[] writes;
+    delete[] modelBufferInfo;
+
+    engine->modelDescriptorSets = modelDescriptorSets;
+    LOGI ("Created %d model descriptor sets.\n", modelDescriptorSetCount);
+    return 0;
+}
+
+//Takes the next unused secondary buffer from a worker's record pool, allocating one the first time it is needed.
+VkCommandBuffer nextRecordBuffer(struct engine* engine, int worker)
+{
+    struct RecordPool *recordPool = &engine->recordPools[worker];
+    if (recordPool->used == recordPool->allocated) {
+        VkCommandBufferAllocateInfo commandBufferAllocateInfo = {};
+        commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        commandBufferAllocateInfo.pNext = NULL;
+        commandBufferAllocateInfo.commandPool = recordPool->commandPool;
+        commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        commandBufferAllocateInfo.commandBufferCount = 1;
+        VkResult res = vkAllocateCommandBuffers(engine->vkDevice, &commandBufferAllocateInfo,
+                                                &recordPool->commandBuffers[recordPool->allocated]);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkAllocateCommandBuffers returned error %d.\n", res);
+            return VK_NULL_HANDLE;
+        }
+        recordPool->allocated++;
+    }
+    return recordPool->commandBuffers[recordPool->used++];
+}
+
+//The number of secondary buffers each frame slot needs for the current transparency technique, one per subpass.
+int secondaryBufferCount(struct engine* engine)
+{
+    switch (engine->oitMode) {
+        case OIT_MODE_DUAL_PEEL:
+            return DUAL_PEEL_SUBPASS_COUNT;
+        case OIT_MODE_WEIGHTED_BLENDED:
+        case OIT_MODE_ABUFFER:
+            return 3;
+        default:
+            return engine->renderPassLayers*2+1;
+    }
+}
+
+//Records every secondary buffer across the worker pool, each thread into buffers from its own record pool. Must
+//only be called once the GPU is done with all of them.
+void createSecondaryBuffers(struct engine* engine)
+{
+    LOGI("Creating Secondary Buffers");
+    engine->rebuildCommadBuffersRequired=false;
+    for (int i = 0; i < engine->recordPoolCount; i++) {
+        vkResetCommandPool(engine->vkDevice, engine->recordPools[i].commandPool, 0);
+        engine->recordPools[i].used = 0;
+    }
+    int bufferCount = secondaryBufferCount(engine);
+    std::function<void(int, int, int)> recordBuffers = [&](int begin, int end, int worker) {
+        for (int i = begin; i < end; i++) {
+            int frame = i / bufferCount;
+            int subpass = i % bufferCount;
+            VkCommandBuffer commandBuffer = nextRecordBuffer(engine, worker);
+            engine->secondaryCommandBuffers[frame*SECONDARY_BUFFERS_PER_FRAME + subpass] = commandBuffer;
+            if (commandBuffer == VK_NULL_HANDLE)
+                continue;
+            if (engine->oitMode == OIT_MODE_DUAL_PEEL)
+                recordDualPeelSecondaryBuffer(engine, frame, subpass, commandBuffer);
+            else if (engine->oitMode == OIT_MODE_WEIGHTED_BLENDED)
+                recordWeightedBlendedSecondaryBuffer(engine, frame, subpass, commandBuffer);
+            else if (engine->oitMode == OIT_MODE_ABUFFER)
+                recordABufferSecondaryBuffer(engine, frame, subpass, commandBuffer);
+            else
+                recordSecondaryBuffer(engine, frame, subpass, commandBuffer);
+        }
+    };
+    btClock clock;
+    engine->workerPool->parallelFor(engine->framesInFlight*bufferCount, 1, recordBuffers);
+    LOGI("Recorded %d secondary buffers in %.1f ms on %d threads", engine->framesInFlight*bufferCount,
+         clock.getTimeMicroseconds()/1000.0f, engine->workerPool->threadCount());
+}
+
+//The number of boxes drawn by the per box uniform modes.
+int uniformBoxCount(struct engine* engine)
+{
+    return (engine->boxCount < engine->uniformBoxCapacity) ? engine->boxCount : engine->uniformBoxCapacity;
+}
+
+//Records the draws for every box using the current draw mode, the pipeline and scene set must already be bound.
+//The instanced draw is indirect, updateUniforms writes its instance count for each frame (or the culling dispatch
+//when GPU culling is on).
+void recordBoxDraws(struct engine* engine, VkCommandBuffer commandBuffer, VkPipelineLayout pipelineLayout, int frame)
+{
+    if (engine->drawMode == DRAW_MODE_INSTANCED) {
+        //With the GPU simulation the matrices come from the compute dispatch rather than this frame's slot.
+        VkDescriptorSet *instanceDescriptorSet = engine->gpuSimulation ? &engine->simulationInstanceDescriptorSet : &engine->instanceDescriptorSets[frame];
+        if (engine->gpuCulling)
+            instanceDescriptorSet = &engine->culledInstanceDescriptorSets[frame];
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                pipelineLayout, 0, 1,
+                                instanceDescriptorSet, 0, NULL);
+
+        if (engine->gpuCulling)
+            vkCmdDrawIndirect(commandBuffer, engine->culledIndirectBuffer, engine->culledIndirectSlotSize*frame, 1, sizeof(VkDrawIndirectCommand));
+        else
+            vkCmdDrawIndirect(commandBuffer, engine->indirectBuffer, sizeof(VkDrawIndirectCommand)*frame, 1, sizeof(VkDrawIndirectCommand));
+    }
+    else if (engine->drawMode == DRAW_MODE_DYNAMIC_OFFSETS) {
+        for (int object = 0; object < uniformBoxCount(engine); object++) {
+            uint32_t dynamicOffset = engine->modelBufferValsOffset*object;
+            vkCmdBindDescriptorSets(commandBuffer,
+                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    pipelineLayout, 0, 1,
+                                    &engine->dynamicModelDescriptorSets[frame], 1, &dynamicOffset);
+
+            vkCmdDraw(commandBuffer, 12 * 3, 1, 0, 0);
+        }
+    }
+    else {
+        VkDescriptorSet *modelDescriptorSets = engine->modelDescriptorSets + frame*engine->uniformBoxCapacity;
+        for (int object = 0; object < uniformBoxCount(engine); object++) {
+            vkCmdBindDescriptorSets(commandBuffer,
+                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    pipelineLayout, 0, 1,
+                                    &modelDescriptorSets[object], 0, NULL);
+
+            vkCmdDraw(commandBuffer, 12 * 3, 1, 0, 0);
+        }
+    }
+}
+
+//Records the secondary buffer for one subpass of one frame slot, it binds that slot's uniform descriptor sets.
+void recordSecondaryBuffer(struct engine* engine, int frame, int subpass, VkCommandBuffer commandBuffer)
+{
+    //Pick the pipelines and layouts matching the way the boxes are drawn.
+    VkPipeline traditionalBlendPipeline, firstPeelPipeline, peelPipeline;
+    VkPipelineLayout pipelineLayout, blendPeelPipelineLayout;
+    switch (engine->drawMode) {
+        case DRAW_MODE_INSTANCED:
+            traditionalBlendPipeline = engine->instancedTraditionalBlendPipeline;
+            firstPeelPipeline = engine->instancedFirstPeelPipeline;
+            peelPipeline = engine->instancedPeelPipeline;
+            pipelineLayout = engine->instancedPipelineLayout;
+            blendPeelPipelineLayout = engine->instancedBlendPeelPipelineLayout;
+            break;
+        case DRAW_MODE_DYNAMIC_OFFSETS:
+            traditionalBlendPipeline = engine->dynamicTraditionalBlendPipeline;
+            firstPeelPipeline = engine->dynamicFirstPeelPipeline;
+            peelPipeline = engine->dynamicPeelPipeline;
+            pipelineLayout = engine->dynamicPipelineLayout;
+            blendPeelPipelineLayout = engine->dynamicBlendPeelPipelineLayout;
+            break;
+        default:
+            traditionalBlendPipeline = engine->traditionalBlendPipeline;
+            firstPeelPipeline = engine->firstPeelPipeline;
+            peelPipeline = engine->peelPipeline;
+            pipelineLayout = engine->pipelineLayout;
+            blendPeelPipelineLayout = engine->blendPeelPipelineLayout;
+    }
+    if (subpass == 0) {
+        VkResult res;
+        VkCommandBufferInheritanceInfo commandBufferInheritanceInfo;
+        commandBufferInheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        commandBufferInheritanceInfo.pNext = 0;
+        commandBufferInheritanceInfo.renderPass = engine->renderPass;
+        commandBufferInheritanceInfo.subpass = 0;
+        commandBufferInheritanceInfo.framebuffer = VK_NULL_HANDLE;
+        commandBufferInheritanceInfo.occlusionQueryEnable = 0;
+        commandBufferInheritanceInfo.queryFlags = 0;
+        commandBufferInheritanceInfo.pipelineStatistics = 0;
+
+        VkCommandBufferBeginInfo commandBufferBeginInfo = {};
+        commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        commandBufferBeginInfo.pNext = NULL;
+        commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+        commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
+        LOGI("Creating Secondary Buffer using subpass %d (frame %d, %s, %d boxes)", subpass, frame, drawModeNames[engine->drawMode], engine->boxCount);
+        res = vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo);
+        if (res != VK_SUCCESS) {
+            printf("vkBeginCommandBuffer returned error.\n");
+            return;
+        }
+
+        writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame, 0);
+
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          traditionalBlendPipeline);
+
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                pipelineLayout, 1, 1,
+                                &engine->sceneDescriptorSets[frame], 0, NULL);
+        VkDeviceSize offsets[1] = {0};
+        vkCmdBindVertexBuffers(commandBuffer, 0, 1, &engine->vertexBuffer,
+                               offsets);
+        beginLayerQueries(engine, commandBuffer, frame, 0);
+        recordBoxDraws(engine, commandBuffer, pipelineLayout, frame);
+        endLayerQueries(engine, commandBuffer, frame, 0);
+        writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame, 1);
+
+        res = vkEndCommandBuffer(commandBuffer);
+        if (res != VK_SUCCESS) {
+            printf("vkBeginCommandBuffer returned error.\n");
+            return;
+        }
+    }
+    else if (subpass%2 == 1) {
+        int layer = (subpass-1)/2;
+        VkResult res;
+        VkCommandBufferInheritanceInfo commandBufferInheritanceInfo;
+        commandBufferInheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        commandBufferInheritanceInfo.pNext = 0;
+        commandBufferInheritanceInfo.renderPass = engine->renderPass;
+        commandBufferInheritanceInfo.subpass = layer*2+1;
+        commandBufferInheritanceInfo.framebuffer = VK_NULL_HANDLE;
+        commandBufferInheritanceInfo.occlusionQueryEnable = 0;
+        commandBufferInheritanceInfo.queryFlags = 0;
+        commandBufferInheritanceInfo.pipelineStatistics = 0;
+
+        VkCommandBufferBeginInfo commandBufferBeginInfo = {};
+        commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        commandBufferBeginInfo.pNext = NULL;
+        commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+        commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
+        LOGI("Creating Secondary Buffer using subpass %d (layer %d)", subpass, layer);
+        res = vkBeginCommandBuffer(commandBuffer,
+                                   &commandBufferBeginInfo);
+        if (res != VK_SUCCESS) {
+            printf("vkBeginCommandBuffer returned error.\n");
+            return;
+        }
+
+        writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame, 2+layer*4);
+
+        //Clear the peel colour buffer
+        {
+            VkClearAttachment clear[2];
+            clear[0].aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            clear[0].clearValue.color.float32[0] = 0.0f;
+            clear[0].clearValue.color.float32[1] = 0.0f;
+            clear[0].clearValue.color.float32[2] = 0.0f;
+            clear[0].clearValue.color.float32[3] = 0.0f;
+            clear[0].colorAttachment=0;
+            clear[1].aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+            if (engine->saturationTermination)
+                clear[1].aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+            clear[1].clearValue.depthStencil.depth = 1.0f;
+            clear[1].clearValue.depthStencil.stencil = 0;
+            VkClearRect clearRect;
+            clearRect.baseArrayLayer=0;
+            clearRect.layerCount=1;
+            clearRect.rect.extent.height=engine->height;
+            clearRect.rect.extent.width=engine->width;
+            clearRect.rect.offset.x=0;
+            clearRect.rect.offset.y=0;
+            vkCmdClearAttachments(commandBuffer, 2, clear, 1, &clearRect);
+        }
+
+        VkRect2D scissor;
+        if (engine->splitscreen)
+            scissor.extent.width = engine->width / 2;
+        else
+            scissor.extent.width = engine->width;
+        scissor.extent.height = engine->height;
+        if (engine->splitscreen)
+            scissor.offset.x = scissor.extent.width;
+        else
+            scissor.offset.x = 0;
+        scissor.offset.y = 0;
+
+        //Mark the pixels this peel can skip.
+        if (layer>0 && engine->saturationTermination)
+        {
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, engine->saturationMarkPipeline);
+            vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    engine->saturationMarkPipelineLayout, 0, 1,
+                                    &engine->identityModelDescriptorSets[frame], 0, NULL);
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    engine->saturationMarkPipelineLayout, 1, 1,
+                                    &engine->identitySceneDescriptorSets[frame], 0, NULL);
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    engine->saturationMarkPipelineLayout, 2, 1,
+                                    &engine->depthInputAttachmentDescriptorSets[!(layer%2)], 0, NULL);
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    engine->saturationMarkPipelineLayout, 3, 1,
+                                    &engine->transmittanceDescriptorSet, 0, NULL);
+            VkDeviceSize offsets[1] = {0};
+            vkCmdBindVertexBuffers(commandBuffer, 0, 1, &engine->vertexBuffer, offsets);
+            vkCmdDraw(commandBuffer, 12 * 3, 1, 0, 0);
+        }
+
+        VkPipelineLayout layerPipelineLayout = (layer==0) ? pipelineLayout : blendPeelPipelineLayout;
+
+        vkCmdBindPipeline(commandBuffer,
+                          VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          (layer==0) ? firstPeelPipeline : peelPipeline);
+
+        vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+        if (layer>0)
+            vkCmdSetStencilCompareMask(commandBuffer, VK_STENCIL_FRONT_AND_BACK,
+                                       engine->saturationTermination ? 1 : 0);
+
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                layerPipelineLayout, 1, 1,
+                                &engine->sceneDescriptorSets[frame], 0, NULL);
+        VkDeviceSize offsets[1] = {0};
+        vkCmdBindVertexBuffers(commandBuffer, 0, 1,
+                               &engine->vertexBuffer,
+                               offsets);
+
+        if (layer>0)
+        {
+            vkCmdBindDescriptorSets(commandBuffer,
+                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    layerPipelineLayout, 2, 1,
+                                    &engine->depthInputAttachmentDescriptorSets[!(layer%2)], 0, NULL);
+        }
+
+        beginLayerQueries(engine, commandBuffer, frame, 1+layer);
+        recordBoxDraws(engine, commandBuffer, layerPipelineLayout, frame);
+        endLayerQueries(engine, commandBuffer, frame, 1+layer);
+
+        writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame, 3+layer*4);
+
+        res = vkEndCommandBuffer(commandBuffer);
+        if (res != VK_SUCCESS) {
+            printf("vkBeginCommandBuffer returned error.\n");
+            return;
+        }
+    }
+    else {
+        int layer = (subpass-2)/2;
+        VkResult res;
+        VkCommandBufferInheritanceInfo commandBufferInheritanceInfo;
+        commandBufferInheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        commandBufferInheritanceInfo.pNext = 0;
+        commandBufferInheritanceInfo.renderPass = engine->renderPass;
+        commandBufferInheritanceInfo.subpass = layer*2+2;
+        commandBufferInheritanceInfo.framebuffer = VK_NULL_HANDLE;
+        commandBufferInheritanceInfo.occlusionQueryEnable = 0;
+        commandBufferInheritanceInfo.queryFlags = 0;
+        commandBufferInheritanceInfo.pipelineStatistics = 0;
+
+        VkCommandBufferBeginInfo commandBufferBeginInfo = {};
+        commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        commandBufferBeginInfo.pNext = NULL;
+        commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+        commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
+
+        LOGI("Creating secondaryCommandBuffer using subpass %d (layer %d)", subpass, layer);
+        res = vkBeginCommandBuffer(commandBuffer,
+                                   &commandBufferBeginInfo);
+        if (res != VK_SUCCESS) {
+            printf("vkBeginCommandBuffer returned error.\n");
+            return;
+        }
+
+        writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame, 4+layer*4);
+
+        vkCmdBindPipeline(commandBuffer,
+                          VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          engine->saturationTermination ? engine->saturationBlendPipeline : engine->blendPipeline);
+
+        VkRect2D scissor;
+        if (engine->splitscreen)
+            scissor.extent.width = engine->width / 2;
+        else
+            scissor.extent.width = engine->width;
+        scissor.extent.height = engine->height;
+        if (engine->splitscreen)
+            scissor.offset.x = scissor.extent.width;
+        else
+            scissor.offset.x = 0;
+        scissor.offset.y = 0;
+
+        vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                engine->blendPeelPipelineLayout, 1, 1,
+                                &engine->identitySceneDescriptorSets[frame], 0, NULL);
+
+        VkDeviceSize offsets[1] = {0};
+        vkCmdBindVertexBuffers(commandBuffer, 0, 1,
+                               &engine->vertexBuffer,
+                               offsets);
+
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                engine->blendPeelPipelineLayout, 0, 1,
+                                &engine->identityModelDescriptorSets[frame], 0, NULL);
+
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                engine->blendPeelPipelineLayout, 2, 1,
+                                &engine->colourInputAttachmentDescriptorSet, 0, NULL);
+
+
+        vkCmdDraw(commandBuffer, 12 * 3, 1, 0, 0);
+//            for (int object = 0; object < MAX_BOXES; object++) {
+//                vkCmdBindDescriptorSets(commandBuffer,
+//                                        VK_PIPELINE_BIND_POINT_GRAPHICS,
+//                                        engine->blendPipelineLayout, 0, 1,
+//                                        &modelDescriptorSets[object], 0, NULL);
+//
+//                vkCmdDraw(commandBuffer, 12 * 3, 1, 0, 0);
+//            }
+
+        writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame, 5+layer*4);
+
+        res = vkEndCommandBuffer(commandBuffer);
+        if (res != VK_SUCCESS) {
+            printf("vkBeginCommandBuffer returned error.\n");
+            return;
+        }
+    }
+}
+
+//Records the dual depth peel secondary buffer for one subpass of one frame slot.
+void recordDualPeelSecondaryBuffer(struct engine* engine, int frame, int subpass, VkCommandBuffer commandBuffer)
+{
+    VkPipelineLayout pipelineLayout, blendPeelPipelineLayout;
+    switch (engine->drawMode) {
+        case DRAW_MODE_INSTANCED:
+            pipelineLayout = engine->instancedPipelineLayout;
+            blendPeelPipelineLayout = engine->instancedBlendPeelPipelineLayout;
+            break;
+        case DRAW_MODE_DYNAMIC_OFFSETS:
+            pipelineLayout = engine->dynamicPipelineLayout;
+            blendPeelPipelineLayout = engine->dynamicBlendPeelPipelineLayout;
+            break;
+        default:
+            pipelineLayout = engine->pipelineLayout;
+            blendPeelPipelineLayout = engine->blendPeelPipelineLayout;
+    }
+    int pass = (subpass-2)/3;
+    int stage;
+    if (subpass < 2)
+        stage = subpass; //The traditional blend then the init.
+    else if (subpass == DUAL_PEEL_SUBPASS_COUNT-1)
+        stage = DUAL_PEEL_STAGE_COMPOSITE;
+    else
+        stage = DUAL_PEEL_STAGE_PEEL + (subpass-2)%3;
+    VkResult res;
+    VkCommandBufferInheritanceInfo commandBufferInheritanceInfo;
+    commandBufferInheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    commandBufferInheritanceInfo.pNext = 0;
+    commandBufferInheritanceInfo.renderPass = engine->dualPeelRenderPass;
+    commandBufferInheritanceInfo.subpass = subpass;
+    commandBufferInheritanceInfo.framebuffer = VK_NULL_HANDLE;
+    commandBufferInheritanceInfo.occlusionQueryEnable = 0;
+    commandBufferInheritanceInfo.queryFlags = 0;
+    commandBufferInheritanceInfo.pipelineStatistics = 0;
+
+    VkCommandBufferBeginInfo commandBufferBeginInfo = {};
+    commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    commandBufferBeginInfo.pNext = NULL;
+    commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
+    res = vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo);
+    if (res != VK_SUCCESS) {
+        printf("vkBeginCommandBuffer returned error.\n");
+        return;
+    }
+
+    //A pass's time runs from the init (for the first pass) or its peel to the end of its back blend.
+    if (stage == DUAL_PEEL_STAGE_TRADITIONAL_BLEND)
+        writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame, 0);
+    else if (stage == DUAL_PEEL_STAGE_INIT)
+        writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame, 2);
+    else if (stage == DUAL_PEEL_STAGE_PEEL && pass > 0)
+        writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame, 2+pass*4);
+    else if (stage == DUAL_PEEL_STAGE_FRONT_BLEND)
+        writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame, 4+pass*4);
+
+    if (stage != DUAL_PEEL_STAGE_TRADITIONAL_BLEND) {
+        VkRect2D scissor;
+        if (engine->splitscreen)
+            scissor.extent.width = engine->width / 2;
+        else
+            scissor.extent.width = engine->width;
+        scissor.extent.height = engine->height;
+        if (engine->splitscreen)
+            scissor.offset.x = scissor.extent.width;
+        else
+            scissor.offset.x = 0;
+        scissor.offset.y = 0;
+        vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+    }
+
+    //Reset the depth range to empty and the peeled layers to transparent.
+    if (stage == DUAL_PEEL_STAGE_INIT || stage == DUAL_PEEL_STAGE_PEEL) {
+        VkClearAttachment clear[3];
+        for (int attachment = 0; attachment < 3; attachment++) {
+            clear[attachment].aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            clear[attachment].clearValue.color.float32[0] = (attachment == 0) ? -1.0f : 0.0f;
+            clear[attachment].clearValue.color.float32[1] = 0.0f;
+            clear[attachment].clearValue.color.float32[2] = 0.0f;
+            clear[attachment].clearValue.color.float32[3] = 0.0f;
+            clear[attachment].colorAttachment = attachment;
+        }
+        VkClearRect clearRect;
+        clearRect.baseArrayLayer=0;
+        clearRect.layerCount=1;
+        clearRect.rect.extent.height=engine->height;
+        clearRect.rect.extent.width=engine->width;
+        clearRect.rect.offset.x=0;
+        clearRect.rect.offset.y=0;
+        vkCmdClearAttachments(commandBuffer, (stage == DUAL_PEEL_STAGE_INIT) ? 1 : 3, clear, 1, &clearRect);
+    }
+
+    VkDeviceSize offsets[1] = {0};
+    vkCmdBindVertexBuffers(commandBuffer, 0, 1, &engine->vertexBuffer, offsets);
+    switch (stage) {
+        case DUAL_PEEL_STAGE_TRADITIONAL_BLEND:
+        case DUAL_PEEL_STAGE_INIT:
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                              (stage == DUAL_PEEL_STAGE_INIT) ? engine->dualInitPipelines[engine->drawMode] : engine->dualTraditionalBlendPipelines[engine->drawMode]);
+            vkCmdBindDescriptorSets(commandBuffer,
+                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    pipelineLayout, 1, 1,
+                                    &engine->sceneDescriptorSets[frame], 0, NULL);
+            if (stage == DUAL_PEEL_STAGE_TRADITIONAL_BLEND)
+                beginLayerQueries(engine, commandBuffer, frame, 0);
+            recordBoxDraws(engine, commandBuffer, pipelineLayout, frame);
+            if (stage == DUAL_PEEL_STAGE_TRADITIONAL_BLEND)
+                endLayerQueries(engine, commandBuffer, frame, 0);
+            break;
+        case DUAL_PEEL_STAGE_PEEL:
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                              engine->dualPeelPipelines[engine->drawMode]);
+            vkCmdBindDescriptorSets(commandBuffer,
+                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    blendPeelPipelineLayout, 1, 1,
+                                    &engine->sceneDescriptorSets[frame], 0, NULL);
+            vkCmdBindDescriptorSets(commandBuffer,
+                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    blendPeelPipelineLayout, 2, 1,
+                                    &engine->dualDepthDescriptorSets[pass%2], 0, NULL);
+            beginLayerQueries(engine, commandBuffer, frame, 1+pass);
+            recordBoxDraws(engine, commandBuffer, blendPeelPipelineLayout, frame);
+            endLayerQueries(engine, commandBuffer, frame, 1+pass);
+            break;
+        default: {
+            VkPipeline pipeline = engine->dualCompositePipeline;
+            VkDescriptorSet *inputAttachmentSet = &engine->dualBackAccumulationDescriptorSet;
+            if (stage == DUAL_PEEL_STAGE_FRONT_BLEND) {
+                pipeline = engine->dualFrontBlendPipeline;
+                inputAttachmentSet = &engine->dualFrontDescriptorSet;
+            } else if (stage == DUAL_PEEL_STAGE_BACK_BLEND) {
+                pipeline = engine->dualBackBlendPipeline;
+                inputAttachmentSet = &engine->dualBackDescriptorSet;
+            }
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+            vkCmdBindDescriptorSets(commandBuffer,
+                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    engine->blendPeelPipelineLayout, 0, 1,
+                                    &engine->identityModelDescriptorSets[frame], 0, NULL);
+            vkCmdBindDescriptorSets(commandBuffer,
+                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    engine->blendPeelPipelineLayout, 1, 1,
+                                    &engine->identitySceneDescriptorSets[frame], 0, NULL);
+            vkCmdBindDescriptorSets(commandBuffer,
+                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                    engine->blendPeelPipelineLayout, 2, 1,
+                                    inputAttachmentSet, 0, NULL);
+            vkCmdDraw(commandBuffer, 12 * 3, 1, 0, 0);
+        }
+    }
 
-    vkUpdateDescriptorSets(engine->vkDevice, MAX_BOXES+6, writes, 0, NULL);
+    if (stage == DUAL_PEEL_STAGE_TRADITIONAL_BLEND)
+        writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame, 1);
+    else if (stage == DUAL_PEEL_STAGE_PEEL)
+        writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame, 3+pass*4);
+    else if (stage == DUAL_PEEL_STAGE_BACK_BLEND)
+        writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame, 5+pass*4);
 
-    LOGI ("Descriptor sets updated %d.\n", res);
-    return 0;
+    res = vkEndCommandBuffer(commandBuffer);
+    if (res != VK_SUCCESS) {
+        printf("vkEndCommandBuffer returned error.\n");
+        return;
+    }
 }
 
-void createSecondaryBuffers(struct engine* engine)
+//Records the weighted blended secondary buffer for one subpass of one frame slot.
+void recordWeightedBlendedSecondaryBuffer(struct engine* engine, int frame, int stage, VkCommandBuffer commandBuffer)
 {
-    LOGI("Creating Secondary Buffers");
-    LOGI("Creating trad blend buffers");
-    engine->rebuildCommadBuffersRequired=false;
-    for (int i = 0; i< engine->swapchainImageCount; i++) {
-        VkResult res;
-        VkCommandBufferInheritanceInfo commandBufferInheritanceInfo;
-        commandBufferInheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
-        commandBufferInheritanceInfo.pNext = 0;
-        commandBufferInheritanceInfo.renderPass = engine->renderPass;
-        commandBufferInheritanceInfo.subpass = 0;
-        commandBufferInheritanceInfo.framebuffer = engine->framebuffers[i];
-        commandBufferInheritanceInfo.occlusionQueryEnable = 0;
-        commandBufferInheritanceInfo.queryFlags = 0;
-        commandBufferInheritanceInfo.pipelineStatistics = 0;
+    VkPipelineLayout pipelineLayout;
+    switch (engine->drawMode) {
+        case DRAW_MODE_INSTANCED:
+            pipelineLayout = engine->instancedPipelineLayout;
+            break;
+        case DRAW_MODE_DYNAMIC_OFFSETS:
+            pipelineLayout = engine->dynamicPipelineLayout;
+            break;
+        default:
+            pipelineLayout = engine->pipelineLayout;
+    }
+    VkResult res;
+    VkCommandBufferInheritanceInfo commandBufferInheritanceInfo;
+    commandBufferInheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    commandBufferInheritanceInfo.pNext = 0;
+    commandBufferInheritanceInfo.renderPass = engine->weightedBlendedRenderPass;
+    commandBufferInheritanceInfo.subpass = stage;
+    commandBufferInheritanceInfo.framebuffer = VK_NULL_HANDLE;
+    commandBufferInheritanceInfo.occlusionQueryEnable = 0;
+    commandBufferInheritanceInfo.queryFlags = 0;
+    commandBufferInheritanceInfo.pipelineStatistics = 0;
 
-        VkCommandBufferBeginInfo commandBufferBeginInfo = {};
-        commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        commandBufferBeginInfo.pNext = NULL;
-        commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
-        commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
-        LOGI("Creating Secondary Buffer %d using subpass %d (%d boxes)", i, 0, engine->boxCount);
-        res = vkBeginCommandBuffer(engine->secondaryCommandBuffers[i], &commandBufferBeginInfo);
-        if (res != VK_SUCCESS) {
-            printf("vkBeginCommandBuffer returned error.\n");
-            return;
-        }
+    VkCommandBufferBeginInfo commandBufferBeginInfo = {};
+    commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    commandBufferBeginInfo.pNext = NULL;
+    commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
+    res = vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo);
+    if (res != VK_SUCCESS) {
+        printf("vkBeginCommandBuffer returned error.\n");
+        return;
+    }
+
+    //The accumulation and resolve are timed as the first layer would be, the peel then the blend.
+    writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame, stage*2);
 
-        vkCmdBindPipeline(engine->secondaryCommandBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS,
-                          engine->traditionalBlendPipeline);
+    if (stage != WEIGHTED_BLENDED_STAGE_TRADITIONAL_BLEND) {
+        VkRect2D scissor;
+        if (engine->splitscreen)
+            scissor.extent.width = engine->width / 2;
+        else
+            scissor.extent.width = engine->width;
+        scissor.extent.height = engine->height;
+        if (engine->splitscreen)
+            scissor.offset.x = scissor.extent.width;
+        else
+            scissor.offset.x = 0;
+        scissor.offset.y = 0;
+        vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+    }
 
-        vkCmdBindDescriptorSets(engine->secondaryCommandBuffers[i],
+    VkDeviceSize offsets[1] = {0};
+    vkCmdBindVertexBuffers(commandBuffer, 0, 1, &engine->vertexBuffer, offsets);
+    if (stage == WEIGHTED_BLENDED_STAGE_RESOLVE) {
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, engine->weightedBlendedResolvePipeline);
+        vkCmdBindDescriptorSets(commandBuffer,
                                 VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                engine->pipelineLayout, 1, 1,
-                                &engine->sceneDescriptorSet, 0, NULL);
-        VkDeviceSize offsets[1] = {0};
-        vkCmdBindVertexBuffers(engine->secondaryCommandBuffers[i], 0, 1, &engine->vertexBuffer,
-                               offsets);
-        for (int object = 0; object < engine->boxCount; object++) {
-            vkCmdBindDescriptorSets(engine->secondaryCommandBuffers[i],
-                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                    engine->pipelineLayout, 0, 1,
-                                    &engine->modelDescriptorSets[object], 0, NULL);
+                                engine->weightedBlendedResolvePipelineLayout, 0, 1,
+                                &engine->identityModelDescriptorSets[frame], 0, NULL);
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                engine->weightedBlendedResolvePipelineLayout, 1, 1,
+                                &engine->identitySceneDescriptorSets[frame], 0, NULL);
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                engine->weightedBlendedResolvePipelineLayout, 2, 2,
+                                engine->weightedBlendedDescriptorSets, 0, NULL);
+        vkCmdDraw(commandBuffer, 12 * 3, 1, 0, 0);
+    }
+    else {
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          (stage == WEIGHTED_BLENDED_STAGE_ACCUMULATE) ? engine->weightedBlendedAccumulatePipelines[engine->drawMode] : engine->weightedBlendedTraditionalBlendPipelines[engine->drawMode]);
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                pipelineLayout, 1, 1,
+                                &engine->sceneDescriptorSets[frame], 0, NULL);
+        beginLayerQueries(engine, commandBuffer, frame, stage);
+        recordBoxDraws(engine, commandBuffer, pipelineLayout, frame);
+        endLayerQueries(engine, commandBuffer, frame, stage);
+    }
 
-            vkCmdDraw(engine->secondaryCommandBuffers[i], 12 * 3, 1, 0, 0);
-        }
+    writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame, stage*2+1);
 
-        res = vkEndCommandBuffer(engine->secondaryCommandBuffers[i]);
-        if (res != VK_SUCCESS) {
-            printf("vkBeginCommandBuffer returned error.\n");
-            return;
-        }
+    res = vkEndCommandBuffer(commandBuffer);
+    if (res != VK_SUCCESS) {
+        printf("vkEndCommandBuffer returned error.\n");
+        return;
     }
-    LOGI("Creating peel stage buffers");
-    for (int layer = 0; layer < MAX_LAYERS; layer++) {
-        for (int i = 0; i < engine->swapchainImageCount; i++) {
-            int cmdBuffIndex = engine->swapchainImageCount + layer * engine->swapchainImageCount * 2 + i;
-            VkResult res;
-            VkCommandBufferInheritanceInfo commandBufferInheritanceInfo;
-            commandBufferInheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
-            commandBufferInheritanceInfo.pNext = 0;
-            commandBufferInheritanceInfo.renderPass = engine->renderPass;
-            commandBufferInheritanceInfo.subpass = layer*2+1;
-            commandBufferInheritanceInfo.framebuffer = engine->framebuffers[i];
-            commandBufferInheritanceInfo.occlusionQueryEnable = 0;
-            commandBufferInheritanceInfo.queryFlags = 0;
-            commandBufferInheritanceInfo.pipelineStatistics = 0;
-
-            VkCommandBufferBeginInfo commandBufferBeginInfo = {};
-            commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-            commandBufferBeginInfo.pNext = NULL;
-            commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
-            commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
-            LOGI("Creating Secondary Buffer %d using subpass %d (layer %d, swapchainImage %d)", cmdBuffIndex, commandBufferInheritanceInfo.subpass, layer, i);
-            res = vkBeginCommandBuffer(engine->secondaryCommandBuffers[cmdBuffIndex],
-                                       &commandBufferBeginInfo);
-            if (res != VK_SUCCESS) {
-                printf("vkBeginCommandBuffer returned error.\n");
-                return;
-            }
+}
 
-            //Clear the peel colour buffer
-            {
-                VkClearAttachment clear[2];
-                clear[0].aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-                clear[0].clearValue.color.float32[0] = 0.0f;
-                clear[0].clearValue.color.float32[1] = 0.0f;
-                clear[0].clearValue.color.float32[2] = 0.0f;
-                clear[0].clearValue.color.float32[3] = 0.0f;
-                clear[0].colorAttachment=0;
-                clear[1].aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-                clear[1].clearValue.depthStencil.depth = 1.0f;
-                clear[1].clearValue.depthStencil.stencil = 0;
-                VkClearRect clearRect;
-                clearRect.baseArrayLayer=0;
-                clearRect.layerCount=1;
-                clearRect.rect.extent.height=engine->height;
-                clearRect.rect.extent.width=engine->width;
-                clearRect.rect.offset.x=0;
-                clearRect.rect.offset.y=0;
-                vkCmdClearAttachments(engine->secondaryCommandBuffers[cmdBuffIndex], 2, clear, 1, &clearRect);
-            }
+//Records the A-buffer secondary buffer for one subpass of one frame slot.
+void recordABufferSecondaryBuffer(struct engine* engine, int frame, int stage, VkCommandBuffer commandBuffer)
+{
+    VkPipelineLayout pipelineLayout;
+    switch (engine->drawMode) {
+        case DRAW_MODE_INSTANCED:
+            pipelineLayout = engine->instancedPipelineLayout;
+            break;
+        case DRAW_MODE_DYNAMIC_OFFSETS:
+            pipelineLayout = engine->dynamicPipelineLayout;
+            break;
+        default:
+            pipelineLayout = engine->pipelineLayout;
+    }
+    VkResult res;
+    VkCommandBufferInheritanceInfo commandBufferInheritanceInfo;
+    commandBufferInheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    commandBufferInheritanceInfo.pNext = 0;
+    commandBufferInheritanceInfo.renderPass = engine->abufferRenderPass;
+    commandBufferInheritanceInfo.subpass = stage;
+    commandBufferInheritanceInfo.framebuffer = VK_NULL_HANDLE;
+    commandBufferInheritanceInfo.occlusionQueryEnable = 0;
+    commandBufferInheritanceInfo.queryFlags = 0;
+    commandBufferInheritanceInfo.pipelineStatistics = 0;
 
-            vkCmdBindPipeline(engine->secondaryCommandBuffers[cmdBuffIndex],
-                              VK_PIPELINE_BIND_POINT_GRAPHICS,
-                              (layer==0) ? engine->firstPeelPipeline : engine->peelPipeline);
+    VkCommandBufferBeginInfo commandBufferBeginInfo = {};
+    commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    commandBufferBeginInfo.pNext = NULL;
+    commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
+    res = vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo);
+    if (res != VK_SUCCESS) {
+        printf("vkBeginCommandBuffer returned error.\n");
+        return;
+    }
 
-            VkRect2D scissor;
-            if (engine->splitscreen)
-                scissor.extent.width = engine->width / 2;
-            else
-                scissor.extent.width = engine->width;
-            scissor.extent.height = engine->height;
-            if (engine->splitscreen)
-                scissor.offset.x = scissor.extent.width;
-            else
-                scissor.offset.x = 0;
-            scissor.offset.y = 0;
+    //The build and resolve are timed as the first layer would be, the peel then the blend.
+    writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame, stage*2);
 
-            vkCmdSetScissor(engine->secondaryCommandBuffers[cmdBuffIndex], 0, 1, &scissor);
+    if (stage != ABUFFER_STAGE_TRADITIONAL_BLEND) {
+        VkRect2D scissor;
+        if (engine->splitscreen)
+            scissor.extent.width = engine->width / 2;
+        else
+            scissor.extent.width = engine->width;
+        scissor.extent.height = engine->height;
+        if (engine->splitscreen)
+            scissor.offset.x = scissor.extent.width;
+        else
+            scissor.offset.x = 0;
+        scissor.offset.y = 0;
+        vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+    }
 
-            vkCmdBindDescriptorSets(engine->secondaryCommandBuffers[cmdBuffIndex],
+    VkDeviceSize offsets[1] = {0};
+    vkCmdBindVertexBuffers(commandBuffer, 0, 1, &engine->vertexBuffer, offsets);
+    if (stage == ABUFFER_STAGE_RESOLVE) {
+        VkPipelineLayout resolvePipelineLayout = engine->abufferPipelineLayouts[DRAW_MODE_DESCRIPTOR_SETS];
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, engine->abufferResolvePipeline);
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                resolvePipelineLayout, 0, 1,
+                                &engine->identityModelDescriptorSets[frame], 0, NULL);
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                resolvePipelineLayout, 1, 1,
+                                &engine->identitySceneDescriptorSets[frame], 0, NULL);
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                resolvePipelineLayout, 2, 1,
+                                &engine->abufferDescriptorSet, 0, NULL);
+        vkCmdDraw(commandBuffer, 12 * 3, 1, 0, 0);
+    }
+    else {
+        if (stage == ABUFFER_STAGE_BUILD) {
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, engine->abufferBuildPipelines[engine->drawMode]);
+            pipelineLayout = engine->abufferPipelineLayouts[engine->drawMode];
+            vkCmdBindDescriptorSets(commandBuffer,
                                     VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                    (layer==0) ? engine->pipelineLayout : engine->blendPeelPipelineLayout, 1, 1,
-                                    &engine->sceneDescriptorSet, 0, NULL);
-            VkDeviceSize offsets[1] = {0};
-            vkCmdBindVertexBuffers(engine->secondaryCommandBuffers[cmdBuffIndex], 0, 1,
-                                   &engine->vertexBuffer,
-                                   offsets);
-
-            if (layer>0)
-            {
-                vkCmdBindDescriptorSets(engine->secondaryCommandBuffers[cmdBuffIndex],
-                                        VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                        engine->blendPeelPipelineLayout, 2, 1,
-                                        &engine->depthInputAttachmentDescriptorSets[!(layer%2)], 0, NULL);
-            }
+                                    pipelineLayout, 2, 1,
+                                    &engine->abufferDescriptorSet, 0, NULL);
+        }
+        else
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, engine->abufferTraditionalBlendPipelines[engine->drawMode]);
+        vkCmdBindDescriptorSets(commandBuffer,
+                                VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                pipelineLayout, 1, 1,
+                                &engine->sceneDescriptorSets[frame], 0, NULL);
+        beginLayerQueries(engine, commandBuffer, frame, stage);
+        recordBoxDraws(engine, commandBuffer, pipelineLayout, frame);
+        endLayerQueries(engine, commandBuffer, frame, stage);
+    }
 
-            for (int object = 0; object < engine->boxCount; object++) {
-                vkCmdBindDescriptorSets(engine->secondaryCommandBuffers[cmdBuffIndex],
-                                        VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                        (layer==0) ? engine->pipelineLayout : engine->blendPeelPipelineLayout, 0, 1,
-                                        &engine->modelDescriptorSets[object], 0, NULL);
+    writeTimestamp(engine, commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame, stage*2+1);
 
-                vkCmdDraw(engine->secondaryCommandBuffers[cmdBuffIndex], 12 * 3, 1, 0, 0);
-            }
+    res = vkEndCommandBuffer(commandBuffer);
+    if (res != VK_SUCCESS) {
+        printf("vkEndCommandBuffer returned error.\n");
+        return;
+    }
+}
 
+//Empties the lists and the pool before the render pass. The previous frame's resolve may still be reading them, the
+//node count is rewritten with the capacity and framebuffer width the shaders need.
+void recordABufferReset(struct engine* engine, VkCommandBuffer commandBuffer)
+{
+    VkMemoryBarrier memoryBarrier;
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.pNext = NULL;
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                         1, &memoryBarrier, 0, NULL, 0, NULL);
+
+    uint32_t counter[4] = {0, engine->abufferCapacity, engine->abufferWidth, 0};
+    vkCmdFillBuffer(commandBuffer, engine->abufferHeadBuffer, 0, VK_WHOLE_SIZE, 0xFFFFFFFF); //Every list empty.
+    vkCmdUpdateBuffer(commandBuffer, engine->abufferCounterBuffer, 0, sizeof(counter), counter);
+
+    memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0,
+                         1, &memoryBarrier, 0, NULL, 0, NULL);
+}
 
-            //Test clearing depth buffer at end
-            VkClearAttachment clear;
-            clear.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-            clear.clearValue.depthStencil.depth = 0.0f;
-            clear.clearValue.depthStencil.stencil = 0;
-            VkClearRect clearRect;
-            clearRect.baseArrayLayer=0;
-            clearRect.layerCount=1;
-            clearRect.rect.extent.height=engine->height/4*2;
-            clearRect.rect.extent.width=engine->width/4*2;
-            clearRect.rect.offset.x=engine->height/4;
-            clearRect.rect.offset.y=engine->width/4;
-            //vkCmdClearAttachments(engine->secondaryCommandBuffers[cmdBuffIndex], 1, &clear, 1, &clearRect);
+//Copies the frame's node count to the frame slot's readback word after the render pass. It keeps counting past
+//the capacity so it also gives the number of dropped fragments.
+void recordABufferReadback(struct engine* engine, VkCommandBuffer commandBuffer, int frame)
+{
+    VkMemoryBarrier memoryBarrier;
+    memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    memoryBarrier.pNext = NULL;
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+                         1, &memoryBarrier, 0, NULL, 0, NULL);
+
+    VkBufferCopy copyRegion;
+    copyRegion.srcOffset = 0;
+    copyRegion.dstOffset = sizeof(uint32_t)*frame;
+    copyRegion.size = sizeof(uint32_t);
+    vkCmdCopyBuffer(commandBuffer, engine->abufferCounterBuffer, engine->abufferReadbackBuffer, 1, &copyRegion);
+
+    memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+                         1, &memoryBarrier, 0, NULL, 0, NULL);
+}
 
-            res = vkEndCommandBuffer(engine->secondaryCommandBuffers[cmdBuffIndex]);
-            if (res != VK_SUCCESS) {
-                printf("vkBeginCommandBuffer returned error.\n");
-                return;
-            }
-        }
+//Adds the node count of the last frame that used this slot to the A-buffer statistics, the slot's fence has
+//signalled so this doesn't wait.
+void readABufferCount(struct engine* engine, int frame)
+{
+    if (!engine->abufferCountPending[frame])
+        return;
+    engine->abufferCountPending[frame] = false;
+
+    uint32_t count = engine->abufferReadbackMappedMemory[frame];
+    engine->abufferFrames++;
+    if (count > engine->abufferPeakFragments)
+        engine->abufferPeakFragments = count;
+    if (count > engine->abufferCapacity) {
+        engine->abufferDroppedFragments += count - engine->abufferCapacity;
+        engine->abufferOverflowFrames++;
     }
-    LOGI("Creating blend stage buffers");
-    for (int layer = 0; layer < MAX_LAYERS; layer++) {
-        for (int i = 0; i < engine->swapchainImageCount; i++) {
-            int cmdBuffIndex = engine->swapchainImageCount + engine->swapchainImageCount * layer * 2 + i + engine->swapchainImageCount;
-            VkResult res;
-            VkCommandBufferInheritanceInfo commandBufferInheritanceInfo;
-            commandBufferInheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
-            commandBufferInheritanceInfo.pNext = 0;
-            commandBufferInheritanceInfo.renderPass = engine->renderPass;
-            commandBufferInheritanceInfo.subpass = layer*2+2;
-            commandBufferInheritanceInfo.framebuffer = engine->framebuffers[i];
-            commandBufferInheritanceInfo.occlusionQueryEnable = 0;
-            commandBufferInheritanceInfo.queryFlags = 0;
-            commandBufferInheritanceInfo.pipelineStatistics = 0;
-
-            VkCommandBufferBeginInfo commandBufferBeginInfo = {};
-            commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-            commandBufferBeginInfo.pNext = NULL;
-            commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
-            commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
-
-            LOGI("Creating secondaryCommandBuffer %d using subpass %d (layer %d, swapchainImage %d)", cmdBuffIndex, layer*2+2, layer, i);
-            res = vkBeginCommandBuffer(engine->secondaryCommandBuffers[cmdBuffIndex],
-                                       &commandBufferBeginInfo);
-            if (res != VK_SUCCESS) {
-                printf("vkBeginCommandBuffer returned error.\n");
-                return;
-            }
-
-            vkCmdBindPipeline(engine->secondaryCommandBuffers[cmdBuffIndex],
-                              VK_PIPELINE_BIND_POINT_GRAPHICS,
-                              engine->blendPipeline);
+}
 
-            VkRect2D scissor;
-            if (engine->splitscreen)
-                scissor.extent.width = engine->width / 2;
-            else
-                scissor.extent.width = engine->width;
-            scissor.extent.height = engine->height;
-            if (engine->splitscreen)
-                scissor.offset.x = scissor.extent.width;
-            else
-                scissor.offset.x = 0;
-            scissor.offset.y = 0;
+void resetABufferStats(struct engine* engine)
+{
+    engine->abufferPeakFragments = 0;
+    engine->abufferDroppedFragments = 0;
+    engine->abufferOverflowFrames = 0;
+    engine->abufferFrames = 0;
+}
 
-            vkCmdSetScissor(engine->secondaryCommandBuffers[cmdBuffIndex], 0, 1, &scissor);
+//Logs the peak fragment count against the pool size and warns if fragments were dropped since the last report.
+void reportABufferStats(struct engine* engine)
+{
+    if (engine->abufferFrames == 0)
+        return;
+    if (engine->abufferOverflowFrames > 0)
+        LOGW("A-buffer pool overflowed in %d of %d frames, %llu fragments dropped (peak %u of %u nodes), raise --abuffer-nodes",
+             engine->abufferOverflowFrames, engine->abufferFrames, (unsigned long long)engine->abufferDroppedFragments,
+             engine->abufferPeakFragments, engine->abufferCapacity);
+    else
+        LOGI("A-buffer peak %u of %u nodes", engine->abufferPeakFragments, engine->abufferCapacity);
+    resetABufferStats(engine);
+}
 
-            vkCmdBindDescriptorSets(engine->secondaryCommandBuffers[cmdBuffIndex],
-                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                    engine->blendPeelPipelineLayout, 1, 1,
-                                    &engine->identitySceneDescriptorSet, 0, NULL);
+//Writes the uniforms for a frame slot, the slot must not be in use by the GPU.
+void updateUniforms(struct engine* engine, int frame)
+{
+    uint8_t *slotMemory = engine->uniformMappedMemory + engine->uniformSlotSize*frame;
+    //Built locally as CPU culling reads it back, which is slow from uncached mapped memory.
+    float projection[16];
+    perspective_matrix(0.7853 /* 45deg */, (float)engine->width/(float)engine->height, 0.1f, 50.0f, projection);
+    memcpy(slotMemory + engine->modelBufferValsOffset*engine->uniformBoxCapacity, projection, sizeof(projection));
+    identity_matrix((float*)(slotMemory + engine->modelBufferValsOffset*(engine->uniformBoxCapacity+1)));
+    identity_matrix((float*)(slotMemory + engine->modelBufferValsOffset*(engine->uniformBoxCapacity+2)));
+    engine->indirectCommands[frame].instanceCount = engine->boxCount;
+    if (engine->gpuSimulation)
+        return;
+    if (engine->drawMode == DRAW_MODE_INSTANCED && engine->cpuCulling) {
+        int visibleCount = engine->simulation->cull(projection, engine->boxCount);
+        engine->simulation->write(engine->instanceMappedMemory + engine->instanceSlotSize*frame, sizeof(float)*16, visibleCount, engine->simulation->visible);
+        engine->indirectCommands[frame].instanceCount = visibleCount;
+    }
+    else if (engine->drawMode == DRAW_MODE_INSTANCED)
+        engine->simulation->write(engine->instanceMappedMemory + engine->instanceSlotSize*frame, sizeof(float)*16, engine->boxCount);
+    else
+        engine->simulation->write(slotMemory, engine->modelBufferValsOffset, uniformBoxCount(engine));
+}
 
-            VkDeviceSize offsets[1] = {0};
-            vkCmdBindVertexBuffers(engine->secondaryCommandBuffers[cmdBuffIndex], 0, 1,
-                                   &engine->vertexBuffer,
-                                   offsets);
+//Switches to the next available draw mode, the secondary buffers are rerecorded before the next frame.
+void cycleDrawMode(struct engine* engine)
+{
+    if (engine->gpuSimulation) {
+        LOGI("The GPU simulation only supports instanced drawing");
+        return;
+    }
+    if (engine->gpuCulling || engine->cpuCulling) {
+        LOGI("Culling only supports instanced drawing");
+        return;
+    }
+    do
+        engine->drawMode = (engine->drawMode+1) % DRAW_MODE_COUNT;
+    while ((engine->drawMode == DRAW_MODE_INSTANCED && !engine->instancingSupported) ||
+           (engine->drawMode == DRAW_MODE_DESCRIPTOR_SETS && setupModelDescriptorSets(engine) != 0));
+    LOGI("Drawing using %s", drawModeNames[engine->drawMode]);
+    engine->rebuildCommadBuffersRequired=true;
+}
 
-            vkCmdBindDescriptorSets(engine->secondaryCommandBuffers[cmdBuffIndex],
-                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                    engine->blendPeelPipelineLayout, 0, 1,
-                                    &engine->identityModelDescriptorSet, 0, NULL);
+bool oitModeSupported(struct engine* engine, int oitMode)
+{
+    switch (oitMode) {
+        case OIT_MODE_DUAL_PEEL:
+            return engine->dualPeelSupported;
+        case OIT_MODE_WEIGHTED_BLENDED:
+            return engine->weightedBlendedSupported;
+        case OIT_MODE_ABUFFER:
+            return engine->abufferSupported;
+        default:
+            return true;
+    }
+}
 
-            vkCmdBindDescriptorSets(engine->secondaryCommandBuffers[cmdBuffIndex],
-                                    VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                    engine->blendPeelPipelineLayout, 2, 1,
-                                    &engine->colourInputAttachmentDescriptorSet, 0, NULL);
+//Switches to the next available transparency technique, the secondary buffers are rerecorded before the next frame.
+void cycleOitMode(struct engine* engine)
+{
+    do
+        engine->oitMode = (engine->oitMode+1) % OIT_MODE_COUNT;
+    while (!oitModeSupported(engine, engine->oitMode));
+    LOGI("Using %s", oitModeNames[engine->oitMode]);
+    engine->rebuildCommadBuffersRequired=true;
+}
 
+//Switches between the CPU and GPU simulations, the box state is carried across so the boxes continue where they are.
+void toggleGpuSimulation(struct engine* engine)
+{
+    if (!engine->gpuSimulationSupported) {
+        LOGI("GPU simulation not available");
+        return;
+    }
+    engine->gpuSimulation = !engine->gpuSimulation;
+    if (engine->gpuSimulation) {
+        engine->drawMode = DRAW_MODE_INSTANCED;
+        engine->gpuSimulationUploadRequired = true;
+    }
+    else if (engine->gpuSimulationUploadRequired)
+        engine->gpuSimulationUploadRequired = false; //No dispatch has run, the CPU state is still current.
+    else if (readGpuSimulation(engine) != 0)
+        LOGE("Could not read back the GPU simulation");
+    LOGI("Simulating on the %s", engine->gpuSimulation ? "GPU" : "CPU");
+    engine->rebuildCommadBuffersRequired=true;
+}
 
-            vkCmdDraw(engine->secondaryCommandBuffers[cmdBuffIndex], 12 * 3, 1, 0, 0);
-//            for (int object = 0; object < MAX_BOXES; object++) {
-//                vkCmdBindDescriptorSets(engine->secondaryCommandBuffers[cmdBuffIndex],
-//                                        VK_PIPELINE_BIND_POINT_GRAPHICS,
-//                                        engine->blendPipelineLayout, 0, 1,
-//                                        &engine->modelDescriptorSets[object], 0, NULL);
-//
-//                vkCmdDraw(engine->secondaryCommandBuffers[cmdBuffIndex], 12 * 3, 1, 0, 0);
-//            }
+void toggleGpuCulling(struct engine* engine)
+{
+    if (!engine->gpuCullingSupported) {
+        LOGI("GPU culling not available");
+        return;
+    }
+    engine->gpuCulling = !engine->gpuCulling;
+    if (engine->gpuCulling) {
+        engine->drawMode = DRAW_MODE_INSTANCED;
+        engine->cpuCulling = false;
+    }
+    LOGI("GPU culling %s", engine->gpuCulling ? "on" : "off");
+    engine->rebuildCommadBuffersRequired=true;
+}
 
-            res = vkEndCommandBuffer(engine->secondaryCommandBuffers[cmdBuffIndex]);
-            if (res != VK_SUCCESS) {
-                printf("vkBeginCommandBuffer returned error.\n");
-                return;
-            }
-        }
+//CPU culling needs the box positions so it is skipped while the GPU simulation runs. Only one of the CPU and GPU
+//culling is used at once, the GPU would otherwise cull the already culled list.
+void toggleCpuCulling(struct engine* engine)
+{
+    if (!engine->instancingSupported) {
+        LOGI("CPU culling needs instanced drawing");
+        return;
+    }
+    engine->cpuCulling = !engine->cpuCulling;
+    if (engine->cpuCulling) {
+        engine->drawMode = DRAW_MODE_INSTANCED;
+        engine->gpuCulling = false;
     }
+    LOGI("CPU culling %s", engine->cpuCulling ? "on" : "off");
+    engine->rebuildCommadBuffersRequired=true;
 }
 
-void updateUniforms(struct engine* engine)
+//Nothing will signal a frame slot's fence after a failed submit, so it is replaced by a signalled one to keep
+//the next wait on the slot from hanging.
+void replaceFrameFence(struct engine* engine, int frame)
 {
-    perspective_matrix(0.7853 /* 45deg */, (float)engine->width/(float)engine->height, 0.1f, 50.0f, (float*)(engine->uniformMappedMemory + engine->modelBufferValsOffset*MAX_BOXES));
-    identity_matrix((float*)(engine->uniformMappedMemory + engine->modelBufferValsOffset*(MAX_BOXES+1)));
-    identity_matrix((float*)(engine->uniformMappedMemory + engine->modelBufferValsOffset*(MAX_BOXES+2)));
-    engine->simulation->write(engine->uniformMappedMemory, engine->modelBufferValsOffset);
+    VkFenceCreateInfo fenceCreateInfo;
+    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fenceCreateInfo.pNext = NULL;
+    fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    vkDestroyFence(engine->vkDevice, engine->frameFences[frame], NULL);
+    VkResult res = vkCreateFence(engine->vkDevice, &fenceCreateInfo, NULL, &engine->frameFences[frame]);
+    if (res != VK_SUCCESS)
+        LOGE ("vkCreateFence returned error %d.\n", res);
 }
 
 /**
@@ -2554,28 +7308,63 @@ static void engine_draw_frame(struct engine* engine) {
 
 //    sleep(1);
 
-    VkClearValue clearValues[1];
+    //Only the colour buffer, the depth peel transmittance, the dual depth peel back accumulator and the weighted
+    //blended accumulation and revealage are cleared, everything else is zero except the revealage and the
+    //transmittance which start at one.
+    VkClearValue clearValues[7] = {};
     clearValues[0].color.float32[0] = 0.0f;
     clearValues[0].color.float32[1] = 0.0f;
     clearValues[0].color.float32[2] = 0.0f;
     clearValues[0].color.float32[3] = 1.0f;
-
-    //The queue is idle, now is a good time to update the bound memory.
-    updateUniforms(engine);
-
-    if (engine->rebuildCommadBuffersRequired)
-        createSecondaryBuffers(engine);
+    clearValues[3].color.float32[0] = 1.0f;
+    clearValues[4].color.float32[0] = 1.0f;
 
     uint32_t currentBuffer;
     VkResult res;
+    int frameIndex = engine->frame % engine->framesInFlight;
+    VkCommandBuffer renderCommandBuffer = engine->renderCommandBuffer[frameIndex];
+    VkCommandBuffer *secondaryCommandBuffers = engine->secondaryCommandBuffers + frameIndex*SECONDARY_BUFFERS_PER_FRAME;
 
-    // Get next image in the swap chain (back/front buffer)
-    res = vkAcquireNextImageKHR(engine->vkDevice, engine->swapchain, UINT64_MAX,
-                                engine->presentCompleteSemaphore, NULL, &currentBuffer);
+    //Wait until the GPU has finished with the last frame that used this slot.
+    res = vkWaitForFences(engine->vkDevice, 1, &engine->frameFences[frameIndex], VK_TRUE, UINT64_MAX);
     if (res != VK_SUCCESS) {
-        LOGE ("vkAcquireNextImageKHR returned error.\n");
+        LOGE ("vkWaitForFences returned error %d.\n", res);
         return;
     }
+    readTimestamps(engine, frameIndex);
+    readLayerStats(engine, frameIndex);
+    readABufferCount(engine, frameIndex);
+
+    if (engine->rebuildCommadBuffersRequired) {
+        //The secondary buffers may still be referenced by other frames in flight.
+        res = vkWaitForFences(engine->vkDevice, engine->framesInFlight, engine->frameFences, VK_TRUE, UINT64_MAX);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkWaitForFences returned error %d.\n", res);
+            return;
+        }
+        //A new draw mode may need pipelines still being built in the background.
+        waitForPipelines(engine);
+        if (engine->oitMode == OIT_MODE_DEPTH_PEEL && engine->layerCount != engine->renderPassLayers &&
+            switchLayerRenderPass(engine, engine->layerCount) != 0)
+            return;
+        createSecondaryBuffers(engine);
+    }
+
+    //The GPU is done with this slot, now is a good time to update its bound memory.
+    //This happens after any rebuild so the matrices go where the current draw mode reads them.
+    updateUniforms(engine, frameIndex);
+
+    if (engine->headless)
+        currentBuffer = frameIndex; //Each frame slot has its own offscreen image.
+    else {
+        // Get next image in the swap chain (back/front buffer)
+        res = vkAcquireNextImageKHR(engine->vkDevice, engine->swapchain, UINT64_MAX,
+                                    engine->imageAcquiredSemaphores[frameIndex], VK_NULL_HANDLE, &currentBuffer);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkAcquireNextImageKHR returned error.\n");
+            return;
+        }
+    }
 
 //    LOGI("Using buffer %d", currentBuffer);
 
@@ -2589,15 +7378,29 @@ static void engine_draw_frame(struct engine* engine) {
     renderPassBeginInfo.renderArea.offset.y = 0;
     renderPassBeginInfo.renderArea.extent.width = engine->width;
     renderPassBeginInfo.renderArea.extent.height = engine->height;
-    renderPassBeginInfo.clearValueCount = 1;
+    renderPassBeginInfo.clearValueCount = 5;
     renderPassBeginInfo.pClearValues = clearValues;// + (i*2);
+    if (engine->oitMode == OIT_MODE_DUAL_PEEL) {
+        renderPassBeginInfo.renderPass = engine->dualPeelRenderPass;
+        renderPassBeginInfo.framebuffer = engine->dualPeelFramebuffers[currentBuffer];
+        renderPassBeginInfo.clearValueCount = 7;
+    }
+    else if (engine->oitMode == OIT_MODE_WEIGHTED_BLENDED) {
+        renderPassBeginInfo.renderPass = engine->weightedBlendedRenderPass;
+        renderPassBeginInfo.framebuffer = engine->weightedBlendedFramebuffers[currentBuffer];
+        renderPassBeginInfo.clearValueCount = 4;
+    }
+    else if (engine->oitMode == OIT_MODE_ABUFFER) {
+        renderPassBeginInfo.renderPass = engine->abufferRenderPass;
+        renderPassBeginInfo.framebuffer = engine->abufferFramebuffers[currentBuffer];
+    }
 
     VkCommandBufferBeginInfo commandBufferBeginInfo = {};
     commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
     commandBufferBeginInfo.pNext = NULL;
     commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
     commandBufferBeginInfo.pInheritanceInfo = NULL;
-    res = vkBeginCommandBuffer(engine->renderCommandBuffer[0], &commandBufferBeginInfo);
+    res = vkBeginCommandBuffer(renderCommandBuffer, &commandBufferBeginInfo);
     if (res != VK_SUCCESS) {
         printf("vkBeginCommandBuffer returned error.\n");
         return;
@@ -2618,41 +7421,118 @@ static void engine_draw_frame(struct engine* engine) {
     imageMemoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     imageMemoryBarrier.srcAccessMask = 0;
     imageMemoryBarrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-    VkPipelineStageFlags srcStageFlags = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    VkPipelineStageFlags destStageFlags = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    vkCmdPipelineBarrier(engine->renderCommandBuffer[0], srcStageFlags, destStageFlags, 0,
-                         0, NULL, 0, NULL, 1, &imageMemoryBarrier);
-
-    vkCmdBeginRenderPass(engine->renderCommandBuffer[0], &renderPassBeginInfo,
+    //The depth, peel and other attachments are shared by every frame in flight, so this frame's clears and writes
+    //must wait for the previous frame's attachment writes and input attachment reads of them.
+    VkMemoryBarrier attachmentMemoryBarrier;
+    attachmentMemoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    attachmentMemoryBarrier.pNext = NULL;
+    attachmentMemoryBarrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    attachmentMemoryBarrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT |
+                                            VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT |
+                                            VK_ACCESS_INPUT_ATTACHMENT_READ_BIT;
+    VkPipelineStageFlags attachmentStageFlags = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT |
+                                                VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    VkPipelineStageFlags srcStageFlags = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | attachmentStageFlags;
+    VkPipelineStageFlags destStageFlags = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | attachmentStageFlags;
+    vkCmdPipelineBarrier(renderCommandBuffer, srcStageFlags, destStageFlags, 0,
+                         1, &attachmentMemoryBarrier, 0, NULL, 1, &imageMemoryBarrier);
+
+    if (engine->gpuSimulation)
+        recordGpuSimulation(engine, renderCommandBuffer);
+    if (engine->gpuCulling && engine->drawMode == DRAW_MODE_INSTANCED)
+        recordGpuCulling(engine, renderCommandBuffer, frameIndex);
+
+    //Queries can't be reset inside the render pass.
+    if (engine->timestampsSupported)
+        vkCmdResetQueryPool(renderCommandBuffer, engine->timestampQueryPool, frameIndex*TIMESTAMP_QUERY_COUNT, TIMESTAMP_QUERY_COUNT);
+    if (engine->layerStats || engine->adaptiveLayers)
+        vkCmdResetQueryPool(renderCommandBuffer, engine->occlusionQueryPool, frameIndex*LAYER_QUERY_COUNT, LAYER_QUERY_COUNT);
+    if (engine->layerStats && engine->pipelineStatisticsSupported)
+        vkCmdResetQueryPool(renderCommandBuffer, engine->statisticsQueryPool, frameIndex*LAYER_QUERY_COUNT, LAYER_QUERY_COUNT);
+    if (engine->oitMode == OIT_MODE_ABUFFER)
+        recordABufferReset(engine, renderCommandBuffer);
+
+    vkCmdBeginRenderPass(renderCommandBuffer, &renderPassBeginInfo,
                          VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
 
     if (engine->splitscreen) {
         //Draw using traditional depth dependent transparency:
-//        LOGI("Trad: Executing secondaryCommandBuffer %d", currentBuffer);
-        vkCmdExecuteCommands(engine->renderCommandBuffer[0], 1,
-                             &engine->secondaryCommandBuffers[currentBuffer]);
+//        LOGI("Trad: Executing secondaryCommandBuffer 0");
+        vkCmdExecuteCommands(renderCommandBuffer, 1,
+                             &secondaryCommandBuffers[0]);
     }
 
-    for (int layer = 0; layer < engine->layerCount; layer++) {
-        int cmdBuffIndex = engine->swapchainImageCount + layer * engine->swapchainImageCount*2 + currentBuffer;
+    int layerCount = engine->layerCount;
+    if (engine->oitMode == OIT_MODE_DUAL_PEEL) {
+        //Every subpass is stepped through but only the passes needed for layerCount layers are executed.
+        int passCount = (layerCount+1)/2;
+        vkCmdNextSubpass(renderCommandBuffer, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        vkCmdExecuteCommands(renderCommandBuffer, 1,
+                             &secondaryCommandBuffers[1]);
+        for (int pass = 0; pass < DUAL_PEEL_PASSES; pass++) {
+            //displayLayer picks the pass that peels it, which shows both that layer and its partner.
+            bool displayed = engine->displayLayer < 0 || engine->displayLayer/2 == pass;
+            for (int subpass = 2+pass*3; subpass < 5+pass*3; subpass++) {
+                vkCmdNextSubpass(renderCommandBuffer, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+                if (pass < passCount && (subpass == 2+pass*3 || displayed))
+                    vkCmdExecuteCommands(renderCommandBuffer, 1,
+                                         &secondaryCommandBuffers[subpass]);
+            }
+        }
+        vkCmdNextSubpass(renderCommandBuffer, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        vkCmdExecuteCommands(renderCommandBuffer, 1,
+                             &secondaryCommandBuffers[DUAL_PEEL_SUBPASS_COUNT-1]);
+        layerCount = 0; //Nothing below is depth peeled.
+    }
+    else if (engine->oitMode == OIT_MODE_WEIGHTED_BLENDED) {
+        //The layer count and layer display don't apply, every layer is accumulated at once.
+        for (int subpass = 1; subpass < 3; subpass++) {
+            vkCmdNextSubpass(renderCommandBuffer, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+            vkCmdExecuteCommands(renderCommandBuffer, 1,
+                                 &secondaryCommandBuffers[subpass]);
+        }
+        layerCount = 0;
+    }
+    else if (engine->oitMode == OIT_MODE_ABUFFER) {
+        //As with weighted blended OIT every layer is built and resolved at once.
+        for (int subpass = 1; subpass < 3; subpass++) {
+            vkCmdNextSubpass(renderCommandBuffer, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+            vkCmdExecuteCommands(renderCommandBuffer, 1,
+                                 &secondaryCommandBuffers[subpass]);
+        }
+        layerCount = 0;
+    }
+    else if (engine->adaptiveLayers && engine->adaptiveLayerCount < layerCount)
+        layerCount = engine->adaptiveLayerCount;
+    if (layerCount > engine->renderPassLayers)
+        layerCount = engine->renderPassLayers;
+    //A render pass must be ended from its last subpass, so the subpasses of layers the adaptive count skips are
+    //stepped through empty.
+    int subpassLayers = (engine->oitMode == OIT_MODE_DEPTH_PEEL) ? engine->renderPassLayers : 0;
+    for (int layer = 0; layer < subpassLayers; layer++) {
+        int cmdBuffIndex = layer*2+1;
         //Peel
-        vkCmdNextSubpass(engine->renderCommandBuffer[0],
+        vkCmdNextSubpass(renderCommandBuffer,
                          VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
 //        LOGI("Peel: Executing secondaryCommandBuffer %d", cmdBuffIndex);
-        vkCmdExecuteCommands(engine->renderCommandBuffer[0], 1,
-                           &engine->secondaryCommandBuffers[cmdBuffIndex]);
+        if (layer < layerCount)
+            vkCmdExecuteCommands(renderCommandBuffer, 1,
+                                 &secondaryCommandBuffers[cmdBuffIndex]);
         //Blend
-        vkCmdNextSubpass(engine->renderCommandBuffer[0],
+        vkCmdNextSubpass(renderCommandBuffer,
                          VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
-        if (engine->displayLayer < 0 || layer==engine->displayLayer)
+        if (layer < layerCount && (engine->displayLayer < 0 || layer==engine->displayLayer))
         {
-//        LOGI("Blend: Executing secondaryCommandBuffer %d", cmdBuffIndex + engine->swapchainImageCount);
-        vkCmdExecuteCommands(engine->renderCommandBuffer[0], 1,
-                             &engine->secondaryCommandBuffers[cmdBuffIndex + engine->swapchainImageCount]);
+//        LOGI("Blend: Executing secondaryCommandBuffer %d", cmdBuffIndex + 1);
+        vkCmdExecuteCommands(renderCommandBuffer, 1,
+                             &secondaryCommandBuffers[cmdBuffIndex + 1]);
         }
     }
 
-    vkCmdEndRenderPass(engine->renderCommandBuffer[0]);
+    vkCmdEndRenderPass(renderCommandBuffer);
+
+    if (engine->oitMode == OIT_MODE_ABUFFER)
+        recordABufferReadback(engine, renderCommandBuffer, frameIndex);
 
     VkImageMemoryBarrier prePresentBarrier;
     prePresentBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
@@ -2669,58 +7549,71 @@ static void engine_draw_frame(struct engine* engine) {
     prePresentBarrier.subresourceRange.baseArrayLayer = 0;
     prePresentBarrier.subresourceRange.layerCount = 1;
     prePresentBarrier.image = engine->swapChainImages[currentBuffer];
-    vkCmdPipelineBarrier(engine->renderCommandBuffer[0], VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0,
-                         NULL, 1, &prePresentBarrier);
+    if (!engine->headless)
+        vkCmdPipelineBarrier(renderCommandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                             VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, 0,
+                             NULL, 1, &prePresentBarrier);
 
-    res = vkEndCommandBuffer(engine->renderCommandBuffer[0]);
+    res = vkEndCommandBuffer(renderCommandBuffer);
     if (res != VK_SUCCESS) {
         LOGE ("vkEndCommandBuffer returned error %d.\n", res);
         return;
     }
 
-    VkPipelineStageFlags pipe_stage_flags = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
-    VkSubmitInfo submitInfo[2];
+    //Only the colour attachment writes need to wait for the swapchain image to be acquired.
+    VkPipelineStageFlags pipe_stage_flags = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    VkSubmitInfo submitInfo[1];
     submitInfo[0].pNext = NULL;
     submitInfo[0].sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo[0].waitSemaphoreCount = 1; //Only the first command buffer should wait on a semaphore,
-    submitInfo[0].pWaitSemaphores = &engine->presentCompleteSemaphore;
+    submitInfo[0].waitSemaphoreCount = 1;
+    submitInfo[0].pWaitSemaphores = &engine->imageAcquiredSemaphores[frameIndex];
     submitInfo[0].pWaitDstStageMask = &pipe_stage_flags;
     submitInfo[0].commandBufferCount = 1;
-    submitInfo[0].pCommandBuffers = engine->renderCommandBuffer;
-    submitInfo[0].signalSemaphoreCount = 0;
-    submitInfo[0].pSignalSemaphores = NULL;
-
+    submitInfo[0].pCommandBuffers = &renderCommandBuffer;
+    submitInfo[0].signalSemaphoreCount = 1;
+    submitInfo[0].pSignalSemaphores = &engine->renderCompleteSemaphores[frameIndex];
+    if (engine->headless) {
+        //There is no swapchain image to wait for or present.
+        submitInfo[0].waitSemaphoreCount = 0;
+        submitInfo[0].signalSemaphoreCount = 0;
+    }
 
-    res = vkQueueSubmit(engine->queue, 1, submitInfo, VK_NULL_HANDLE);
+    //The fence is only reset once nothing can stop the submit that signals it.
+    res = vkResetFences(engine->vkDevice, 1, &engine->frameFences[frameIndex]);
     if (res != VK_SUCCESS) {
-        LOGE ("vkQueueSubmit returned error %d.\n", res);
+        LOGE ("vkResetFences returned error %d.\n", res);
         return;
     }
-
-//    LOGI ("Waiting.\n");
-
-    res = vkQueueWaitIdle(engine->queue);
+    res = vkQueueSubmit(engine->queue, 1, submitInfo, engine->frameFences[frameIndex]);
     if (res != VK_SUCCESS) {
         LOGE ("vkQueueSubmit returned error %d.\n", res);
+        replaceFrameFence(engine, frameIndex);
         return;
     }
+    engine->timestampsPending[frameIndex] = engine->timestampsSupported;
+    engine->layerStatsPending[frameIndex] = engine->layerStats || engine->adaptiveLayers;
+    engine->statisticsPending[frameIndex] = engine->layerStats && engine->pipelineStatisticsSupported;
+    engine->peeledLayers[frameIndex] = (engine->oitMode == OIT_MODE_DEPTH_PEEL) ? layerCount : -1;
+    engine->abufferCountPending[frameIndex] = engine->oitMode == OIT_MODE_ABUFFER;
 
 //    LOGI ("Presentng.\n");
 
-    VkPresentInfoKHR presentInfo;
-    presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-    presentInfo.pNext = NULL;
-    presentInfo.swapchainCount = 1;
-    presentInfo.pSwapchains = &engine->swapchain;
-    presentInfo.pImageIndices = &currentBuffer;
-    presentInfo.pWaitSemaphores = NULL;
-    presentInfo.waitSemaphoreCount = 0;
-    presentInfo.pResults = NULL;
-    res = vkQueuePresentKHR(engine->queue, &presentInfo);
-    if (res != VK_SUCCESS) {
-        LOGE ("vkQueuePresentKHR returned error %d.\n", res);
-        return;
+    //Presentation waits for rendering on the GPU, the CPU carries on with the next frame.
+    if (!engine->headless) {
+        VkPresentInfoKHR presentInfo;
+        presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        presentInfo.pNext = NULL;
+        presentInfo.swapchainCount = 1;
+        presentInfo.pSwapchains = &engine->swapchain;
+        presentInfo.pImageIndices = &currentBuffer;
+        presentInfo.pWaitSemaphores = &engine->renderCompleteSemaphores[frameIndex];
+        presentInfo.waitSemaphoreCount = 1;
+        presentInfo.pResults = NULL;
+        res = vkQueuePresentKHR(engine->queue, &presentInfo);
+        if (res != VK_SUCCESS) {
+            LOGE ("vkQueuePresentKHR returned error %d.\n", res);
+            return;
+        }
     }
 
 //    LOGI ("Finished frame %d.\n", engine->frame);
@@ -2729,6 +7622,13 @@ static void engine_draw_frame(struct engine* engine) {
         float frameRate = (120.0f/((float)(engine->frameRateClock->getTimeMilliseconds())/1000.0f));
         LOGI("Framerate: %f", frameRate);
         engine->frameRateClock->reset();
+        if (!engine->headless) {
+            reportGpuTimes(engine);
+            reportLayerStats(engine);
+            reportABufferStats(engine);
+        }
+        if (engine->adaptiveLayers && engine->oitMode == OIT_MODE_DEPTH_PEEL)
+            LOGI("Peeling %d of %d layers", layerCount, engine->layerCount);
     }
 }
 
@@ -2737,6 +7637,9 @@ static void engine_draw_frame(struct engine* engine) {
  */
 static void engine_term_display(struct engine* engine) {
     LOGI("engine_term_display");
+    waitForPipelines(engine);
+    if (engine->vulkanSetupOK)
+        savePipelineCache(engine);
 //    vkDestroyImageView(engine->vkDevice, engine->depthView, NULL);
 //    vkDestroyImage(engine->vkDevice, engine->depthImage, NULL);
 //    vkFreeMemory(engine->vkDevice, engine->depthMemory, NULL);
@@ -2790,6 +7693,7 @@ static int32_t engine_handle_input(struct android_app* app, AInputEvent* event)
             else if (engine->layerCount>MAX_LAYERS)
                 engine->layerCount=MAX_LAYERS;
             LOGI("Using %d layers", engine->layerCount);
+            engine->rebuildCommadBuffersRequired=true;
         }
 //        if ((keycode==AKEYCODE_DPAD_LEFT || keycode==AKEYCODE_DPAD_RIGHT) && action == AKEY_EVENT_ACTION_DOWN) {
 //            if (keycode == AKEYCODE_DPAD_RIGHT)
@@ -2798,8 +7702,8 @@ static int32_t engine_handle_input(struct android_app* app, AInputEvent* event)
 //                engine->boxCount-=50;
 //            if (engine->boxCount<50)
 //                engine->boxCount=50;
-//            else if (engine->boxCount>MAX_BOXES)
-//                engine->boxCount=MAX_BOXES;
+//            else if (engine->boxCount>engine->boxCapacity)
+//                engine->boxCount=engine->boxCapacity;
 //            LOGI("Drawing %d boxes", engine->boxCount);
 //            engine->rebuildCommadBuffersRequired=true;
 //        }
@@ -2816,6 +7720,30 @@ static int32_t engine_handle_input(struct android_app* app, AInputEvent* event)
             else
                 LOGI("Displaying only layer %d", engine->displayLayer);
         }
+        if (keycode==AKEYCODE_MENU && action == AKEY_EVENT_ACTION_DOWN) {
+            cycleDrawMode(engine);
+        }
+        if (keycode==AKEYCODE_G && action == AKEY_EVENT_ACTION_DOWN) {
+            toggleGpuSimulation(engine);
+        }
+        if (keycode==AKEYCODE_Q && action == AKEY_EVENT_ACTION_DOWN) {
+            toggleLayerStats(engine);
+        }
+        if (keycode==AKEYCODE_A && action == AKEY_EVENT_ACTION_DOWN) {
+            toggleAdaptiveLayers(engine);
+        }
+        if (keycode==AKEYCODE_O && action == AKEY_EVENT_ACTION_DOWN) {
+            cycleOitMode(engine);
+        }
+        if (keycode==AKEYCODE_T && action == AKEY_EVENT_ACTION_DOWN) {
+            toggleSaturationTermination(engine);
+        }
+        if (keycode==AKEYCODE_C && action == AKEY_EVENT_ACTION_DOWN) {
+            toggleGpuCulling(engine);
+        }
+        if (keycode==AKEYCODE_V && action == AKEY_EVENT_ACTION_DOWN) {
+            toggleCpuCulling(engine);
+        }
         if (keycode==AKEYCODE_BACK && action == AKEY_EVENT_ACTION_UP) {
             ANativeActivity_finish(engine->app->activity);
         }
@@ -2895,13 +7823,21 @@ void android_main(struct android_app* state) {
     engine.vulkanSetupOK=false;
     engine.frameRateClock=new btClock;
     engine.frameRateClock->reset();
-    engine.simulation = new Simulation;
-    engine.simulation->step();
     engine.splitscreen = true;
     engine.rebuildCommadBuffersRequired = false;
     engine.displayLayer=-1;
     engine.layerCount=4;
     engine.boxCount=100;
+    engine.boxCapacity=DEFAULT_BOX_CAPACITY;
+    engine.framesInFlight=2;
+    engine.drawMode=DRAW_MODE_DESCRIPTOR_SETS;
+    engine.threadCount=std::thread::hardware_concurrency();
+    engine.seed=1;
+    if (engine.threadCount < 1)
+        engine.threadCount = 1;
+    engine.workerPool = new WorkerPool(engine.threadCount-1);
+    engine.simulation = new Simulation(engine.boxCapacity, engine.seed, engine.workerPool);
+    engine.simulation->step(engine.boxCount);
 
 
     // Prepare to monitor accelerometer
@@ -2972,7 +7908,8 @@ void android_main(struct android_app* state) {
             // is no need to do timing here.
 //            LOGI("calling engine_draw_frame");
             engine_draw_frame(&engine);
-            engine.simulation->step();
+            if (!engine.gpuSimulation)
+                engine.simulation->step(engine.boxCount);
         }
     }
 }
@@ -2980,7 +7917,108 @@ void android_main(struct android_app* state) {
 //END_INCLUDE(all)
 
 #ifndef __ANDROID__
-int main()
+//Renders frameCount frames without a window and prints frame time statistics. The first few frames
+//are not counted as they include pipeline and memory warm up.
+static int runHeadlessBenchmark(struct engine* engine, int frameCount)
+{
+    const int warmupFrames = 10;
+    if (engine_init_display(engine) != 0 || !engine->vulkanSetupOK) {
+        LOGE("Vulkan setup failed");
+        return -1;
+    }
+    waitForPipelines(engine);
+
+    std::vector<float> frameTimes;
+    frameTimes.reserve(frameCount);
+    btClock frameClock;
+    btClock totalClock;
+    for (int frame = 0; frame < warmupFrames + frameCount; frame++) {
+        if (frame == warmupFrames) {
+            totalClock.reset();
+            resetGpuTimes(engine);
+            resetLayerStats(engine);
+            resetABufferStats(engine);
+        }
+        frameClock.reset();
+        engine_draw_frame(engine);
+        if (!engine->gpuSimulation)
+            engine->simulation->step(engine->boxCount);
+        if (frame >= warmupFrames)
+            frameTimes.push_back(frameClock.getTimeMicroseconds()/1000.0f);
+    }
+    vkDeviceWaitIdle(engine->vkDevice);
+    float totalTime = totalClock.getTimeMicroseconds()/1000.0f;
+    for (int frame = 0; frame < engine->framesInFlight; frame++) {
+        readTimestamps(engine, frame);
+        readLayerStats(engine, frame);
+        readABufferCount(engine, frame);
+    }
+
+    std::sort(frameTimes.begin(), frameTimes.end());
+    float sum = 0;
+    for (size_t i = 0; i < frameTimes.size(); i++)
+        sum += frameTimes[i];
+    printf("Headless benchmark: %s, %dx%d, %s, %d layers, %d boxes, %s draw mode, %s simulation%s\n",
+           engine->deviceProperties.deviceName, engine->width, engine->height, oitModeNames[engine->oitMode],
+           engine->layerCount, engine->boxCount, drawModeNames[engine->drawMode], engine->gpuSimulation ? "GPU" : "CPU",
+           engine->gpuCulling ? ", GPU culling" : (engine->cpuCulling ? ", CPU culling" : ""));
+    printf("%d frames in %.1f ms (%.1f fps)\n", frameCount, totalTime, frameCount*1000.0f/totalTime);
+    printf("Frame time ms: min %.3f mean %.3f median %.3f p95 %.3f p99 %.3f max %.3f\n",
+           frameTimes.front(), sum/frameTimes.size(), frameTimes[frameTimes.size()/2],
+           frameTimes[frameTimes.size()*95/100], frameTimes[frameTimes.size()*99/100], frameTimes.back());
+    reportGpuTimes(engine);
+    reportLayerStats(engine);
+    reportABufferStats(engine);
+
+    engine_term_display(engine);
+    return 0;
+}
+
+//Times preparing the instanced draws' matrices with and without CPU culling at 10k and 100k boxes. Only the CPU
+//side is measured, the GPU saving from every subpass drawing fewer boxes shows in --headless with --cpu-cull.
+static int runCullBenchmark(struct engine* engine)
+{
+    const int boxCounts[] = {10000, 100000};
+    const int frameCount = 500;
+    float projection[16];
+    perspective_matrix(0.7853 /* 45deg */, (float)engine->width/(float)engine->height, 0.1f, 50.0f, projection);
+    for (size_t test = 0; test < sizeof(boxCounts)/sizeof(boxCounts[0]); test++) {
+        int boxCount = boxCounts[test];
+        Simulation simulation(boxCount, engine->seed, engine->workerPool);
+        uint8_t *instances = (uint8_t*)malloc(sizeof(float)*16*boxCount);
+        if (!instances) {
+            printf("Could not allocate the matrices for %d boxes\n", boxCount);
+            return -1;
+        }
+        //The boxes start off screen, give them time to spread out first.
+        for (int frame = 0; frame < 100; frame++)
+            simulation.step(boxCount);
+        unsigned long writeTime = 0, cullTime = 0, culledWriteTime = 0;
+        long visibleTotal = 0;
+        for (int frame = 0; frame < frameCount; frame++) {
+            simulation.step(boxCount);
+            btClock clock;
+            simulation.write(instances, sizeof(float)*16, boxCount);
+            writeTime += clock.getTimeMicroseconds();
+            clock.reset();
+            int visibleCount = simulation.cull(projection, boxCount);
+            cullTime += clock.getTimeMicroseconds();
+            clock.reset();
+            simulation.write(instances, sizeof(float)*16, visibleCount, simulation.visible);
+            culledWriteTime += clock.getTimeMicroseconds();
+            visibleTotal += visibleCount;
+        }
+        free(instances);
+        printf("Cull benchmark: %d boxes, %.1f%% visible, %d threads\n", boxCount,
+               visibleTotal*100.0f/((float)boxCount*frameCount), engine->workerPool->threadCount());
+        printf("Per frame ms: unculled write %.3f, cull %.3f + culled write %.3f = %.3f\n",
+               writeTime/1000.0f/frameCount, cullTime/1000.0f/frameCount, culledWriteTime/1000.0f/frameCount,
+               (cullTime+culledWriteTime)/1000.0f/frameCount);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
 {
     struct engine engine;
     engine.width=800;
@@ -2993,13 +8031,110 @@ int main()
     engine.vulkanSetupOK=false;
     engine.frameRateClock=new btClock;
     engine.frameRateClock->reset();
-    engine.simulation = new Simulation;
-    engine.simulation->step();
     engine.splitscreen = false;
     engine.rebuildCommadBuffersRequired = false;
     engine.displayLayer=-1;
     engine.layerCount=4;
     engine.boxCount=100;
+    engine.boxCapacity=DEFAULT_BOX_CAPACITY;
+    engine.framesInFlight=2;
+    engine.drawMode=DRAW_MODE_DESCRIPTOR_SETS;
+    engine.threadCount=std::thread::hardware_concurrency();
+    engine.seed=1;
+    engine.gpuSimulation=false;
+    engine.gpuCulling=false;
+    engine.cpuCulling=false;
+    engine.pipelineThread=NULL;
+    engine.headless=false;
+    engine.layerStats=false;
+    engine.adaptiveLayers=false;
+    engine.saturationTermination=false;
+    engine.oitMode=OIT_MODE_DEPTH_PEEL;
+    engine.abufferCapacity=0;
+    int frameCount=1000;
+    bool cullBenchmark=false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--capacity") == 0 && i+1 < argc)
+            engine.boxCapacity = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--boxes") == 0 && i+1 < argc)
+            engine.boxCount = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+            engine.threadCount = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--frames-in-flight") == 0 && i+1 < argc)
+            engine.framesInFlight = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i+1 < argc)
+            engine.seed = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--gpu-sim") == 0)
+            engine.gpuSimulation = true;
+        else if (strcmp(argv[i], "--gpu-cull") == 0)
+            engine.gpuCulling = true;
+        else if (strcmp(argv[i], "--cpu-cull") == 0)
+            engine.cpuCulling = true;
+        else if (strcmp(argv[i], "--cull-benchmark") == 0)
+            cullBenchmark = true;
+        else if (strcmp(argv[i], "--headless") == 0)
+            engine.headless = true;
+        else if (strcmp(argv[i], "--layer-stats") == 0)
+            engine.layerStats = true;
+        else if (strcmp(argv[i], "--adaptive-layers") == 0)
+            engine.adaptiveLayers = true;
+        else if (strcmp(argv[i], "--saturation-termination") == 0)
+            engine.saturationTermination = true;
+        else if (strcmp(argv[i], "--oit") == 0 && i+1 < argc) {
+            const char *name = argv[++i];
+            engine.oitMode = OIT_MODE_COUNT;
+            for (int mode = 0; mode < OIT_MODE_COUNT; mode++)
+                if (strcmp(name, oitModeOptions[mode]) == 0)
+                    engine.oitMode = mode;
+            if (engine.oitMode == OIT_MODE_COUNT) {
+                printf("Unknown transparency technique %s\n", name);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--abuffer-nodes") == 0 && i+1 < argc)
+            engine.abufferCapacity = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--frames") == 0 && i+1 < argc)
+            frameCount = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--width") == 0 && i+1 < argc)
+            engine.width = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--height") == 0 && i+1 < argc)
+            engine.height = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--layers") == 0 && i+1 < argc)
+            engine.layerCount = atoi(argv[++i]);
+        else {
+            printf("Usage: %s [--capacity maxBoxes] [--boxes boxes] [--threads threads] [--seed seed] [--gpu-sim] [--gpu-cull] [--cpu-cull]\n"
+                   "          [--frames-in-flight frames] [--layers layers] [--layer-stats] [--oit peel|dual|weighted|abuffer] [--abuffer-nodes nodes]\n"
+                   "          [--saturation-termination] [--adaptive-layers]\n"
+                   "          [--headless [--frames frames] [--width width] [--height height]] [--cull-benchmark]\n", argv[0]);
+            return -1;
+        }
+    }
+    if (engine.boxCapacity < 1)
+        engine.boxCapacity = 1;
+    if (engine.boxCount > engine.boxCapacity)
+        engine.boxCount = engine.boxCapacity;
+    else if (engine.boxCount < 1)
+        engine.boxCount = 1;
+    if (engine.layerCount < 1)
+        engine.layerCount = 1;
+    else if (engine.layerCount > MAX_LAYERS)
+        engine.layerCount = MAX_LAYERS;
+    if (engine.width < 1 || engine.height < 1 || frameCount < 1) {
+        printf("The size and frame count must be positive\n");
+        return -1;
+    }
+
+    if (engine.threadCount < 1)
+        engine.threadCount = 1;
+    engine.workerPool = new WorkerPool(engine.threadCount-1);
+    if (cullBenchmark)
+        return runCullBenchmark(&engine);
+    engine.simulation = new Simulation(engine.boxCapacity, engine.seed, engine.workerPool);
+    engine.simulation->step(engine.boxCount);
+
+    if (engine.headless)
+        return runHeadlessBenchmark(&engine, frameCount);
 
     //Setup XCB Connection:
     const xcb_setup_t *setup;
@@ -3106,19 +8241,23 @@ int main()
                     else if (engine.layerCount>MAX_LAYERS)
                         engine.layerCount=MAX_LAYERS;
                     LOGI("Using %d layers", engine.layerCount);
+                    engine.rebuildCommadBuffersRequired=true;
                 }
                 else if (key == 113 || key == 114)
                 {
+                    //Small scenes step by 50 boxes, large ones double or halve.
                     if (key == 114)
-                        engine.boxCount+=50;
+                        engine.boxCount = (engine.boxCount<1000) ? engine.boxCount+50 : engine.boxCount*2;
                     else
-                        engine.boxCount-=50;
+                        engine.boxCount = (engine.boxCount<=1000) ? engine.boxCount-50 : engine.boxCount/2;
                     if (engine.boxCount<50)
                         engine.boxCount=50;
-                    else if (engine.boxCount>MAX_BOXES)
-                        engine.boxCount=MAX_BOXES;
+                    if (engine.boxCount>engine.boxCapacity)
+                        engine.boxCount=engine.boxCapacity;
                     LOGI("Drawing %d boxes", engine.boxCount);
-                    engine.rebuildCommadBuffersRequired=true;
+                    //The instanced draws read the count each frame, the per box draws are recorded one by one.
+                    if (engine.drawMode != DRAW_MODE_INSTANCED)
+                        engine.rebuildCommadBuffersRequired=true;
                 }
                 else if (key == 33)
                     engine.simulation->paused= !engine.simulation->paused;
@@ -3127,6 +8266,22 @@ int main()
                     engine.splitscreen = !engine.splitscreen;
                     engine.rebuildCommadBuffersRequired=true;
                 }
+                else if (key == 58)
+                    cycleDrawMode(&engine);
+                else if (key == 42)
+                    toggleGpuSimulation(&engine);
+                else if (key == 24)
+                    toggleLayerStats(&engine);
+                else if (key == 38)
+                    toggleAdaptiveLayers(&engine);
+                else if (key == 32)
+                    cycleOitMode(&engine);
+                else if (key == 28)
+                    toggleSaturationTermination(&engine);
+                else if (key == 54)
+                    toggleGpuCulling(&engine);
+                else if (key == 55)
+                    toggleCpuCulling(&engine);
             }
                 break;
             default:
@@ -3143,8 +8298,10 @@ int main()
         if (done)
             printf("done\n");
         engine_draw_frame(&engine);
-        engine.simulation->step();
+        if (!engine.gpuSimulation)
+            engine.simulation->step(engine.boxCount);
     }
+    engine_term_display(&engine);
     return 0;
 }
 
@@ -0,0 +1,35 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+//Appends the fragment to its pixel's linked list. A node is taken from the pool with the atomic counter and
+//swapped in as the pixel's head. Past the end of the pool the fragment is dropped, the counter carries on so the
+//number of dropped fragments can be read back.
+struct Node {
+   vec4 color;
+   float depth;
+   uint next;
+};
+
+layout (std430, set = 2, binding = 0) buffer Heads {
+   uint heads[];
+};
+layout (std430, set = 2, binding = 1) buffer Nodes {
+   Node nodes[];
+};
+layout (std430, set = 2, binding = 2) buffer Counter {
+   uint nodeCount;
+   uint capacity;
+   uint width;
+};
+layout (location = 0) in vec4 color;
+
+void main() {
+   uint node = atomicAdd(nodeCount, 1u);
+   if (node >= capacity)
+    return;
+   uint pixel = uint(gl_FragCoord.y) * width + uint(gl_FragCoord.x);
+   nodes[node].color = color;
+   nodes[node].depth = gl_FragCoord.z;
+   nodes[node].next = atomicExchange(heads[pixel], node);
+}
@@ -0,0 +1,59 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+//Sorts the pixel's fragments by depth and blends them front to back. Only the nearest MAX_FRAGMENTS are kept,
+//the output is premultiplied by its coverage so it can be blended under the colour buffer like a peeled layer.
+#define MAX_FRAGMENTS 32
+#define END_OF_LIST 0xFFFFFFFFu
+
+struct Node {
+   vec4 color;
+   float depth;
+   uint next;
+};
+
+layout (std430, set = 2, binding = 0) readonly buffer Heads {
+   uint heads[];
+};
+layout (std430, set = 2, binding = 1) readonly buffer Nodes {
+   Node nodes[];
+};
+layout (std430, set = 2, binding = 2) readonly buffer Counter {
+   uint nodeCount;
+   uint capacity;
+   uint width;
+};
+layout (location = 0) out vec4 outColor;
+
+void main() {
+   vec4 colors[MAX_FRAGMENTS];
+   float depths[MAX_FRAGMENTS];
+   int count = 0;
+   uint pixel = uint(gl_FragCoord.y) * width + uint(gl_FragCoord.x);
+   for (uint node = heads[pixel]; node != END_OF_LIST; node = nodes[node].next) {
+      float depth = nodes[node].depth;
+      int i = count;
+      if (count < MAX_FRAGMENTS)
+       count++;
+      else if (depth >= depths[MAX_FRAGMENTS-1])
+       continue;
+      else
+       i = MAX_FRAGMENTS-1;
+      while (i > 0 && depths[i-1] > depth) {
+         depths[i] = depths[i-1];
+         colors[i] = colors[i-1];
+         i--;
+      }
+      depths[i] = depth;
+      colors[i] = nodes[node].color;
+   }
+
+   vec3 result = vec3(0.0);
+   float transmittance = 1.0;
+   for (int i = 0; i < count; i++) {
+      result += transmittance * colors[i].a * colors[i].rgb;
+      transmittance *= 1.0 - colors[i].a;
+   }
+   outColor = vec4(result, 1.0 - transmittance);
+}
@@ -0,0 +1,11 @@
+#version 400
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+//The back layers are accumulated premultiplied so they are passed through as they are.
+layout (input_attachment_index=0, set=2, binding=0) uniform subpassInput subpass;
+layout (location = 0) out vec4 outColor;
+
+void main() {
+   outColor = subpassLoad(subpass);
+}
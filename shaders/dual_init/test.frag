@@ -0,0 +1,10 @@
+#version 400
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+//Finds the nearest and furthest depth at each pixel, blended with MAX so the nearest is stored negated.
+layout (location = 0) out vec2 outDepth;
+
+void main() {
+   outDepth = vec2(-gl_FragCoord.z, gl_FragCoord.z);
+}
@@ -0,0 +1,30 @@
+#version 400
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+//Peels the nearest and furthest remaining layers and finds the depth range of the layers left after them.
+//All three outputs are blended with MAX, (-1, 0) and zero colour leave an output unchanged.
+layout (input_attachment_index=0, set=2, binding=0) uniform subpassInput depthRange;
+layout (location = 0) in vec4 color;
+layout (location = 0) out vec2 outDepth;
+layout (location = 1) out vec4 outFront;
+layout (location = 2) out vec4 outBack;
+
+void main() {
+   vec2 range = subpassLoad(depthRange).rg;
+   float nearest = -range.r;
+   float furthest = range.g;
+   float depth = gl_FragCoord.z;
+   //Already peeled by an earlier pass.
+   if (depth < nearest || depth > furthest)
+    discard;
+   outDepth = vec2(-1.0, 0.0);
+   outFront = vec4(0.0);
+   outBack = vec4(0.0);
+   if (depth == nearest)
+    outFront = color;
+   else if (depth == furthest)
+    outBack = color;
+   else
+    outDepth = vec2(-depth, depth);
+}
@@ -0,0 +1,15 @@
+#version 400
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+//The blend shader with a second output: the layer's alpha, which the pipeline multiplies into the
+//transmittance attachment as (1 - alpha).
+layout (input_attachment_index=0, set=2, binding=0) uniform subpassInput subpass;
+layout (location = 0) out vec4 outColor;
+layout (location = 1) out vec4 outTransmittance;
+
+void main() {
+   vec4 color = subpassLoad(subpass);
+   outColor = vec4(color.r*color.a, color.g*color.a, color.b*color.a, color.a);
+   outTransmittance = vec4(0.0, 0.0, 0.0, color.a);
+}
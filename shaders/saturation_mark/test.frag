@@ -0,0 +1,17 @@
+#version 400
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+//Drawn over the screen at the start of a peel, the pipeline writes 1 to the stencil wherever a fragment survives
+//so the peel that follows skips the pixel. A pixel is done if the previous peel found nothing there (its depth
+//is still the cleared 1.0) or if so little light gets through the layers already blended that nothing behind
+//them could change its 8 bit colour.
+layout (input_attachment_index=0, set=2, binding=0) uniform subpassInput previousDepth;
+layout (input_attachment_index=1, set=3, binding=0) uniform subpassInput transmittance;
+
+const float saturated = 1.0/255.0;
+
+void main() {
+   if (subpassLoad(previousDepth).r < 1.0 && subpassLoad(transmittance).r > saturated)
+    discard;
+}
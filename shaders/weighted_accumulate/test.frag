@@ -0,0 +1,17 @@
+#version 400
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+//Weighted blended order independent transparency (McGuire and Bavoil). Every fragment adds its premultiplied
+//colour scaled by a weight that falls with view depth to the accumulation (blended ONE, ONE) and multiplies
+//the revealage by 1-alpha (blended ZERO, ONE_MINUS_SRC_COLOR).
+layout (location = 0) in vec4 color;
+layout (location = 0) out vec4 outAccumulation;
+layout (location = 1) out float outRevealage;
+
+void main() {
+   float viewDepth = 1.0 / gl_FragCoord.w;
+   float weight = color.a * clamp(10.0 / (1e-5 + pow(viewDepth / 5.0, 2.0) + pow(viewDepth / 200.0, 6.0)), 1e-2, 3e3);
+   outAccumulation = vec4(color.rgb * color.a, color.a) * weight;
+   outRevealage = color.a;
+}
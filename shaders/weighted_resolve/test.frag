@@ -0,0 +1,16 @@
+#version 400
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+//Turns the accumulation into the weighted average colour and outputs it premultiplied by the coverage, so it
+//can be blended under the colour buffer like a peeled layer.
+layout (input_attachment_index=0, set=2, binding=0) uniform subpassInput accumulation;
+layout (input_attachment_index=1, set=3, binding=0) uniform subpassInput revealage;
+layout (location = 0) out vec4 outColor;
+
+void main() {
+   vec4 accum = subpassLoad(accumulation);
+   float coverage = 1.0 - subpassLoad(revealage).r;
+   vec3 average = accum.rgb / max(accum.a, 1e-5);
+   outColor = vec4(average * coverage, coverage);
+}